@@ -0,0 +1,508 @@
+/**
+ * @file bench.c
+ * @brief Benchmarks of the builder framework, driven by the builder itself.
+ *
+ * Measures the spawn throughput of the fork and `posix_spawn` backends, the cost of the
+ * staleness checks over synthetic trees of files, the cost of parsing large option sets and
+ * the overhead of the scheduler per job. Every measurement is written as one JSON object per
+ * line, so runs can be compared with `--baseline`.
+ *
+ * Build it once from the root of the repository, it recompiles itself afterwards:
+ *
+ *   cc -O2 -o bench/bench bench/bench.c
+ *   ./bench/bench --output bench.jsonl
+ *   ./bench/bench --baseline bench.jsonl
+ *
+ * The synthetic trees are generated in `BUILDER_STATE_DIR/bench` and kept between runs.
+ */
+#define BUILDER_SCRIPT_CFLAGS "-O2"
+
+#include "../build/builder.h"
+
+argument_definition_t arguments[] = {
+  Argument(.longName = "output", .shortName = 'o', .requiresValue = true),
+  Argument(.longName = "baseline", .shortName = 'b', .requiresValue = true),
+  Argument(.longName = "threshold", .requiresValue = true),
+  Argument(.longName = "only", .requiresValue = true),
+  Argument(.longName = "spawns", .requiresValue = true),
+  Argument(.longName = "files", .requiresValue = true),
+  Argument(.longName = "options", .requiresValue = true),
+  Argument(.longName = "stale-check", .requiresValue = true),
+};
+
+/** @brief The directory the synthetic trees are generated in. */
+#define BENCH_DIR BUILDER_STATE_DIR "/bench"
+
+/** @brief The number of files per directory of a synthetic tree, which is also one target. */
+#define BENCH_FILES_PER_DIR 100
+
+/** @brief The file the results are written to. */
+static FILE *bench_results = NULL;
+
+/**
+ * @brief Gets the value of an option, or a default.
+ */
+static const char *bench_option(arguments_t *args, const char *name, const char *fallback) {
+  argument_t *arg = builder_get_argument(args, name);
+
+  return arg && arg->value ? arg->value : fallback;
+}
+
+/**
+ * @brief Checks if a suite was selected with `--only`.
+ */
+static bool bench_selected(arguments_t *args, const char *suite) {
+  const char *only = bench_option(args, "only", NULL);
+
+  return !only || strcmp(only, suite) == 0;
+}
+
+/**
+ * @brief Writes a result, and prints it for humans.
+ * @param suite The suite (e.g., "spawn").
+ * @param name The measured case (e.g., "fork").
+ * @param n The number of operations (jobs, files, ...) measured.
+ * @param elapsed_ns The time the operations took.
+ * @param value The value compared between runs.
+ * @param unit The unit of `value`. Values in "per_second" are better when higher, the others when lower.
+ */
+static void bench_report(const char *suite, const char *name, size_t n, uint64_t elapsed_ns, double value,
+                         const char *unit) {
+  fprintf(bench_results, "{\"suite\": \"%s\", \"case\": \"%s\", \"n\": %zu, \"seconds\": %.6f, \"value\": %.3f, \"unit\": \"%s\"}\n",
+          suite, name, n, (double)elapsed_ns / 1e9, value, unit);
+  fflush(bench_results);
+
+  info("%-10s %-22s n=%-8zu %12.3f %s", suite, name, n, value, unit);
+}
+
+/**
+ * @brief Runs `/bin/true`-like jobs through a `SyncGroup`.
+ * @return The time it took.
+ */
+static uint64_t bench_sync_group(size_t jobs) {
+  uint64_t start = builder_now_ns();
+
+  SyncGroup() {
+    for (size_t i = 0; i < jobs; i++) {
+      $("true");
+    }
+  }
+
+  return builder_now_ns() - start;
+}
+
+/**
+ * @brief Measures how many noop jobs per second each spawn backend starts and reaps.
+ */
+static void bench_spawn(size_t jobs) {
+  static const struct { const char *name; int backend; } backends[] = {
+    { "fork", BUILDER_SPAWN_FORK },
+    { "posix_spawn", BUILDER_SPAWN_POSIX },
+  };
+  int saved = builder_spawn_backend;
+
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    builder_spawn_backend = backends[i].backend;
+
+    uint64_t elapsed = bench_sync_group(jobs);
+
+    bench_report("spawn", backends[i].name, jobs, elapsed, (double)jobs * 1e9 / (double)elapsed, "per_second");
+  }
+
+  builder_spawn_backend = saved;
+}
+
+/**
+ * @brief Measures the time the scheduler adds to every job, compared to running them one by one by hand.
+ */
+static void bench_scheduler(size_t jobs) {
+  long saved = builder_get_max_jobs();
+  uint64_t start = builder_now_ns();
+
+  for (size_t i = 0; i < jobs; i++) {
+    wait_pid_sync(run_command("true", StringArrayN("true")));
+  }
+
+  uint64_t direct = builder_now_ns() - start;
+
+  // One job at a time as well, so only the bookkeeping differs
+  builder_set_max_jobs(1);
+
+  uint64_t captured = bench_sync_group(jobs);
+
+  builder_set_output_capture(false);
+
+  uint64_t uncaptured = bench_sync_group(jobs);
+
+  builder_set_output_capture(true);
+  builder_set_max_jobs(saved);
+
+  bench_report("scheduler", "direct", jobs, direct, (double)direct / (double)jobs, "ns_per_job");
+  bench_report("scheduler", "overhead", jobs, captured,
+               ((double)captured - (double)direct) / (double)jobs, "ns_per_job");
+  bench_report("scheduler", "overhead_uncaptured", jobs, uncaptured,
+               ((double)uncaptured - (double)direct) / (double)jobs, "ns_per_job");
+}
+
+/**
+ * @brief Measures parsing a command line with `options` options out of as many definitions.
+ */
+static void bench_arguments(size_t options) {
+  argument_definition_t *defs = calloc(options, sizeof(argument_definition_t));
+  char **argv = calloc(options * 2 + 2, sizeof(char *));
+  char **names = calloc(options, sizeof(char *)), **flags = calloc(options, sizeof(char *));
+  int argc = 0;
+  size_t rounds = 200, found = 0;
+
+  argv[argc++] = "bench";
+
+  for (size_t i = 0; i < options; i++) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "option-%zu", i);
+    names[i] = strdup(name);
+
+    defs[i] = Argument(.longName = names[i], .requiresValue = i % 2 == 0, .toggleOption = i % 2 != 0);
+
+    snprintf(name, sizeof(name), "--option-%zu", i);
+    flags[i] = strdup(name);
+    argv[argc++] = flags[i];
+
+    if (i % 2 == 0) {
+      argv[argc++] = "value";
+    }
+  }
+
+  // The first parse also builds the lookup table of the definitions
+  uint64_t start = builder_now_ns();
+
+  builder_free_arguments(builder_parse_arguments(argc, argv, defs, options));
+
+  uint64_t first = builder_now_ns() - start;
+
+  start = builder_now_ns();
+
+  for (size_t round = 0; round < rounds; round++) {
+    builder_free_arguments(builder_parse_arguments(argc, argv, defs, options));
+  }
+
+  uint64_t parse = builder_now_ns() - start;
+  arguments_t *args = builder_parse_arguments(argc, argv, defs, options);
+
+  start = builder_now_ns();
+
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < options; i++) {
+      found += builder_get_argument(args, names[i]) != NULL;
+    }
+  }
+
+  uint64_t lookup = builder_now_ns() - start;
+
+  if (found != rounds * options) {
+    warn("only %zu of %zu options were found", found, rounds * options);
+  }
+
+  builder_free_arguments(args);
+
+  bench_report("arguments", "first_parse", options, first, (double)first / 1e3, "us");
+  bench_report("arguments", "parse", options, parse, (double)parse / (double)rounds / 1e3, "us");
+  bench_report("arguments", "lookup", options * rounds, lookup, (double)lookup / (double)(options * rounds), "ns_per_lookup");
+
+  for (size_t i = 0; i < options; i++) {
+    free(names[i]);
+    free(flags[i]);
+  }
+
+  free(names);
+  free(flags);
+  free(argv);
+  free(defs);
+}
+
+/**
+ * @brief Creates a synthetic tree of `files` C files, unless it already exists.
+ * @param root Where to store the path of the tree.
+ */
+static void bench_tree(size_t files, char root[PATH_MAX]) {
+  char path[PATH_MAX], marker[PATH_MAX];
+
+  snprintf(root, PATH_MAX, BENCH_DIR "/tree-%zu", files);
+  snprintf(marker, sizeof(marker), "%s/.complete", root);
+
+  if (access(marker, F_OK) == 0) {
+    return;
+  }
+
+  info("generating %s...", root);
+
+  mkdir(BUILDER_STATE_DIR, 0755);
+  mkdir(BENCH_DIR, 0755);
+  mkdir(root, 0755);
+
+  for (size_t i = 0; i < files; i++) {
+    if (i % BENCH_FILES_PER_DIR == 0) {
+      snprintf(path, sizeof(path), "%s/d%05zu", root, i / BENCH_FILES_PER_DIR);
+      mkdir(path, 0755);
+    }
+
+    snprintf(path, sizeof(path), "%s/d%05zu/f%03zu.c", root, i / BENCH_FILES_PER_DIR, i % BENCH_FILES_PER_DIR);
+
+    FILE *file = fopen(path, "w");
+
+    if (file) {
+      fprintf(file, "int function_%zu(void) { return %zu; }\n", i, i);
+      fclose(file);
+    }
+  }
+
+  FILE *file = fopen(marker, "w");
+
+  if (file) fclose(file);
+}
+
+/**
+ * @brief Checks the targets of a synthetic tree, one per directory with its files as inputs.
+ * @param files The files of the tree, sorted.
+ * @param touch `true` to write the targets found out of date, as if they were built.
+ * @return The number of targets that were out of date.
+ */
+static size_t bench_check_tree(path_list_t *files, bool touch) {
+  char target[PATH_MAX];
+  char *inputs[BENCH_FILES_PER_DIR + 1];
+  size_t stale = 0;
+
+  for (size_t start = 0; start < files->count; start += BENCH_FILES_PER_DIR) {
+    size_t count = files->count - start < BENCH_FILES_PER_DIR ? files->count - start : BENCH_FILES_PER_DIR;
+    const char *slash = strrchr(files->items[start], '/');
+
+    memcpy(inputs, files->items + start, sizeof(char *) * count);
+    inputs[count] = NULL;
+
+    snprintf(target, sizeof(target), "%.*s.stamp", (int)(slash - files->items[start]), files->items[start]);
+
+    if (builder_needs_rebuild(target, inputs, NULL)) {
+      stale++;
+
+      FILE *file = touch ? fopen(target, "w") : NULL;
+
+      if (file) fclose(file);
+    }
+  }
+
+  return stale;
+}
+
+/**
+ * @brief Finds the files of a synthetic tree.
+ */
+static void bench_glob(const char *root, path_list_t *files) {
+  char pattern[PATH_MAX + 16];
+
+  snprintf(pattern, sizeof(pattern), "%s/**/*.c", root);
+  glob_files(files, pattern);
+}
+
+/**
+ * @brief Measures the up-to-date checks over a synthetic tree: hashing every file the first time,
+ * checking again in the same process, and a whole noop run of a fresh process.
+ */
+static void bench_staleness(char *program, size_t count) {
+  char root[PATH_MAX], name[64];
+  path_list_t files = {0};
+
+  bench_tree(count, root);
+
+  uint64_t start = builder_now_ns();
+
+  bench_glob(root, &files);
+
+  uint64_t glob = builder_now_ns() - start;
+
+  snprintf(name, sizeof(name), "glob_%zu", count);
+  bench_report("staleness", name, files.count, glob, (double)glob / (double)files.count, "ns_per_file");
+
+  // The targets of the last run are stale, `builder_state_reset` dropped their records at startup
+  start = builder_now_ns();
+
+  size_t stale = bench_check_tree(&files, true);
+  uint64_t cold = builder_now_ns() - start;
+
+  snprintf(name, sizeof(name), "cold_%zu", count);
+  bench_report("staleness", name, files.count, cold, (double)cold / (double)files.count, "ns_per_file");
+
+  start = builder_now_ns();
+  builder_state_save();
+
+  uint64_t save = builder_now_ns() - start;
+
+  snprintf(name, sizeof(name), "save_%zu", count);
+  bench_report("staleness", name, files.count, save, (double)save / 1e6, "ms");
+
+  builder_stat_invalidate_all();
+
+  start = builder_now_ns();
+  stale = bench_check_tree(&files, false);
+
+  uint64_t warm = builder_now_ns() - start;
+
+  if (stale != 0) {
+    warn("%zu targets are still out of date", stale);
+  }
+
+  snprintf(name, sizeof(name), "warm_%zu", count);
+  bench_report("staleness", name, files.count, warm, (double)warm / (double)files.count, "ns_per_file");
+
+  // A fresh process loads the state and checks everything again, like a noop build
+  char size[32];
+
+  snprintf(size, sizeof(size), "%zu", count);
+  start = builder_now_ns();
+  wait_pid_sync(run_command(program, StringArrayN(program, "--stale-check", size)));
+
+  uint64_t noop = builder_now_ns() - start;
+
+  snprintf(name, sizeof(name), "noop_run_%zu", count);
+  bench_report("staleness", name, files.count, noop, (double)noop / 1e6, "ms");
+
+  path_list_free(&files);
+}
+
+/**
+ * @brief Compares the results with the ones of an earlier run.
+ * @return The number of values that got worse by more than `threshold` percent.
+ */
+static size_t bench_compare(const char *results, const char *baseline, double threshold) {
+  char line[1024], suite[64], name[64], unit[32];
+  double value;
+  size_t regressions = 0;
+  FILE *old = fopen(baseline, "r");
+  FILE *new = fopen(results, "r");
+
+  if (!old || !new) {
+    error("couldn't compare %s with %s: %s", results, baseline, strerror(errno));
+
+    if (old) fclose(old);
+    if (new) fclose(new);
+
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), new)) {
+    char old_line[1024], old_suite[64], old_name[64];
+    double old_value;
+
+    if (sscanf(line, "{\"suite\": \"%63[^\"]\", \"case\": \"%63[^\"]\", \"n\": %*u, \"seconds\": %*f, \"value\": %lf, \"unit\": \"%31[^\"]\"",
+               suite, name, &value, unit) != 4) {
+      continue;
+    }
+
+    rewind(old);
+
+    while (fgets(old_line, sizeof(old_line), old)) {
+      if (sscanf(old_line, "{\"suite\": \"%63[^\"]\", \"case\": \"%63[^\"]\", \"n\": %*u, \"seconds\": %*f, \"value\": %lf",
+                 old_suite, old_name, &old_value) != 3 ||
+          strcmp(suite, old_suite) != 0 || strcmp(name, old_name) != 0) {
+        continue;
+      }
+
+      bool higher_is_better = strcmp(unit, "per_second") == 0;
+      double change = old_value != 0 ? (value - old_value) / old_value * 100.0 : 0;
+
+      if (higher_is_better ? change < -threshold : change > threshold) {
+        warn("%s/%s regressed: %.3f -> %.3f %s (%+.1f%%)", suite, name, old_value, value, unit, change);
+        regressions++;
+      }
+
+      break;
+    }
+  }
+
+  fclose(old);
+  fclose(new);
+
+  return regressions;
+}
+
+entrypoint(args) {
+  const char *check = bench_option(args, "stale-check", NULL);
+
+  // Started by the staleness suite, only checks a tree against the state left by the parent
+  if (check) {
+    char root[PATH_MAX];
+    path_list_t files = {0};
+
+    bench_tree(strtoul(check, NULL, 10), root);
+    bench_glob(root, &files);
+
+    size_t stale = bench_check_tree(&files, false);
+
+    if (stale != 0) {
+      warn("%zu targets are out of date", stale);
+    }
+
+    path_list_free(&files);
+
+    return;
+  }
+
+  const char *output = bench_option(args, "output", "bench.jsonl");
+  const char *baseline = bench_option(args, "baseline", NULL);
+  size_t spawns = strtoul(bench_option(args, "spawns", "2000"), NULL, 10);
+  size_t options = strtoul(bench_option(args, "options", "1000"), NULL, 10);
+  char sizes[256];
+
+  if (baseline && strcmp(baseline, output) == 0) {
+    error("the baseline %s would be overwritten by the results", baseline);
+
+    return;
+  }
+
+  // Forget the targets of the last run, the staleness suite measures the first check too
+  builder_state_reset();
+
+  bench_results = fopen(output, "w");
+
+  if (!bench_results) {
+    error("couldn't write %s: %s", output, strerror(errno));
+
+    return;
+  }
+
+  if (bench_selected(args, "spawn")) {
+    bench_spawn(spawns);
+  }
+
+  if (bench_selected(args, "scheduler")) {
+    bench_scheduler(spawns);
+  }
+
+  if (bench_selected(args, "arguments")) {
+    bench_arguments(options);
+  }
+
+  if (bench_selected(args, "staleness")) {
+    snprintf(sizes, sizeof(sizes), "%s", bench_option(args, "files", "10000,100000"));
+
+    char *saveptr = NULL;
+
+    for (char *size = strtok_r(sizes, ",", &saveptr); size; size = strtok_r(NULL, ",", &saveptr)) {
+      bench_staleness(builder_program_name(), strtoul(size, NULL, 10));
+    }
+  }
+
+  fclose(bench_results);
+
+  info("results written to %s", output);
+
+  if (baseline) {
+    size_t regressions = bench_compare(output, baseline, strtod(bench_option(args, "threshold", "10"), NULL));
+
+    if (regressions > 0) {
+      error("%zu results regressed compared to %s", regressions, baseline);
+      exit(1);
+    }
+
+    info("no regressions compared to %s", baseline);
+  }
+}
@@ -40,13 +40,31 @@
  * effectively hiding function bodies. Otherwise, it expands to its arguments.
  * This allows the library to be used in a "header-only" fashion where one
  * source file defines `BUILDER_IMPLEMENTATION` to generate the object code.
+ *
+ * A build script made of several source files can be compiled with
+ * `-DBUILDER_NO_IMPLEMENTATION` everywhere, and `#define BUILDER_IMPLEMENTATION`
+ * in the one file that holds the implementation. `BUILDER_IMPLEMENTATION` wins
+ * over `BUILDER_NO_IMPLEMENTATION`, and without either the file holds the
+ * implementation, like a single-file build script.
  */
-#ifdef BUILDER_NO_IMPLEMENTATION
+#if defined BUILDER_NO_IMPLEMENTATION && !defined BUILDER_IMPLEMENTATION
 #define impl(...)
 #else
 #define impl(...) __VA_ARGS__
 #endif
 
+/**
+ * @brief Defines a global variable of the implementation, or declares it `extern` elsewhere.
+ * Every source file of a build script shares the same variable (e.g., the current `build_context`).
+ * @param declaration The declaration of the variable (e.g., `char *build_mode`).
+ * @param ... Its initial value.
+ */
+#if defined BUILDER_NO_IMPLEMENTATION && !defined BUILDER_IMPLEMENTATION
+#define impl_global(declaration, ...) extern declaration
+#else
+#define impl_global(declaration, ...) declaration = __VA_ARGS__
+#endif
+
 /**
  * @brief A convenience macro to create a `char *` array from string literals.
  * @param ... A comma-separated list of string literals.
@@ -73,9 +91,9 @@
  * @param arg_var The variable name (argument_t*) to hold the current argument in each loop iteration.
  */
 #define arguments_foreach(args_ptr, arg_var) \
-    for (argument_node_t* _node = (args_ptr)->head; \
-         _node != NULL && ((arg_var) = _node->argument); \
-         _node = _node->next)
+    for (size_t _index = 0; \
+         _index < (args_ptr)->count && ((arg_var) = &(args_ptr)->items[_index]); \
+         _index++)
 
 /**
  * @brief Defines a valid command-line argument that can be parsed.
@@ -101,19 +119,28 @@ typedef struct argument_t {
   char shortName;
   /** @brief The value provided for the argument, or NULL for a toggle option. */
   char *value;
+  /** @brief The definition the argument was parsed with, from the script's definitions or the builtin ones. */
+  const argument_definition_t *definition;
 } argument_t;
 
 /**
  * @brief The main container for all parsed arguments.
  */
 typedef struct arguments_t {
-  /** @brief The head of the linked list of parsed arguments.
-    * @note The internal `argument_node_t` is defined in the platform-specific backend. */
-  struct argument_node_t *head;
+  /** @brief The parsed arguments, in the order they were found on the command line. */
+  argument_t *items;
+  /** @brief The number of parsed arguments, and the allocated capacity of `items`. */
+  size_t count, size;
   /** @brief The count of command-line arguments that were not parsed as options. */
   int non_option_argc;
   /** @brief A pointer to the start of non-option arguments in the original `argv` vector. */
   char **non_option_argv;
+  /** @brief The arena the arguments are allocated from, released by `builder_free_arguments`.
+    * @note The `arena_t` type is defined in the platform-specific backend. */
+  struct arena_t *arena;
+  /** @brief The arguments indexed by name, used by `builder_get_argument`.
+    * @note The internal `argument_index_t` is defined in the platform-specific backend. */
+  struct argument_index_t *index;
 } arguments_t;
 
 /**
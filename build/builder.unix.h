@@ -16,6 +16,7 @@
 // This is not just a header file, this is a source file within the header.
 #include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -24,16 +25,66 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+/** @brief Spawn backend that forks the build script and calls `execv` in the child. */
+#define BUILDER_SPAWN_FORK 0
+/** @brief Spawn backend built on `posix_spawn` (which uses `clone(CLONE_VFORK)` on Linux). */
+#define BUILDER_SPAWN_POSIX 1
+
+/**
+ * @brief Selects how `run_command` creates processes. Can be defined before including builder.h.
+ * Defaults to `BUILDER_SPAWN_POSIX` when the platform supports it, and `BUILDER_SPAWN_FORK` otherwise.
+ */
+#ifndef BUILDER_SPAWN_BACKEND
+#if defined _POSIX_SPAWN && _POSIX_SPAWN > 0
+#define BUILDER_SPAWN_BACKEND BUILDER_SPAWN_POSIX
+#else
+#define BUILDER_SPAWN_BACKEND BUILDER_SPAWN_FORK
+#endif
+#endif
+
+#if BUILDER_SPAWN_BACKEND == BUILDER_SPAWN_POSIX
+#include <spawn.h>
+
+/**
+ * @brief Set when `posix_spawn_file_actions_addchdir_np` is available to change the child's directory.
+ * glibc (2.29+) only declares it with `_GNU_SOURCE`.
+ */
+#if (defined __GLIBC__ && defined __USE_GNU && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) \
+    || defined __APPLE__
+#define BUILDER_SPAWN_HAS_ADDCHDIR 1
+#else
+#define BUILDER_SPAWN_HAS_ADDCHDIR 0
+#endif
+#endif
+
 /**
  * @brief Prints a formatted error message to stderr, prefixed with the current build context name if available.
  * @param msg The format string for the message.
  * @param ... The variable arguments for the format string.
  */
 #define error(msg, ...)                                                                        \
-  if (build_context)                                                                           \
+  if (builder_progress_clear(), build_context)                                                 \
     fprintf(stderr, "\033[31merr:\033[m %s: " msg "\n", build_context->name, ##__VA_ARGS__);  \
   else                                                                                         \
     fprintf(stderr, "\033[31merr:\033[m " msg "\n", ##__VA_ARGS__)
@@ -44,7 +95,7 @@
  * @param ... The variable arguments for the format string.
  */
 #define warn(msg, ...)                                                                         \
-  if (build_context)                                                                           \
+  if (builder_progress_clear(), build_context)                                                 \
     fprintf(stderr, "\033[33mwarn:\033[m %s: " msg "\n", build_context->name, ##__VA_ARGS__); \
   else                                                                                         \
     fprintf(stderr, "\033[31merr:\033[m " msg "\n", ##__VA_ARGS__)
@@ -55,7 +106,7 @@
  * @param ... The variable arguments for the format string.
  */
 #define info(msg, ...)                                                                     \
-  if (build_context)                                                                       \
+  if (builder_progress_clear(), build_context)                                             \
     printf("\033[34minfo:\033[m %s: " msg "\n", build_context->name, ##__VA_ARGS__);  \
   else                                                                                     \
     printf("\033[34minfo:\033[m " msg "\n", ##__VA_ARGS__)
@@ -63,12 +114,20 @@
 /**
  * @brief Creates a scope for running asynchronous processes and waiting for them to complete.
  * It creates a new process list, waits for all child processes in that list to finish,
- * and then frees the list.
+ * and then frees the list. At most `builder_get_max_jobs()` commands of the group run at
+ * once, the others are queued and started as running ones exit, the ones that took the
+ * longest on their last run first.
  */
 #define SyncGroup()                                                               \
   for (pid_list_t *pid_list = pid_list_create(); pid_list != NULL;                 \
     pid_list_wait_sync(pid_list), pid_list_free(pid_list), pid_list = NULL)
 
+/**
+ * @brief Creates a compound literal of type `spawn_options_t` on the stack.
+ * @param ... The initializers for the `spawn_options_t` struct (e.g., `.stdout_path = "log.txt"`).
+ */
+#define SpawnOptions(...) (&(spawn_options_t){__VA_ARGS__})
+
 /**
  * @brief Creates a compound literal of type `build_context_t` on the stack.
  * @param ... The initializers for the `build_context_t` struct.
@@ -91,66 +150,110 @@
 /**
  * @brief Runs a command synchronously and waits for it to complete.
  * @param ... A list of string arguments for the command, terminated by NULL.
+ * @return The exit status of the command (see `builder_run_sync`).
  * @note Relies on the StringArrayN macro, which is defined elsewhere.
  */
 #define $_sync(...)                                                                   \
-    wait_pid_sync(                                                                    \
-        run_command(StringArrayN(__VA_ARGS__)[0], StringArrayN(__VA_ARGS__)));
+    builder_run_sync(StringArrayN(__VA_ARGS__), NULL)
 
 /**
- * @brief Runs a command asynchronously, adding its process ID to the current `SyncGroup`'s pid_list.
+ * @brief Queues a command on the current `SyncGroup`'s pid_list. It starts as soon as a job slot is free.
  * @param ... A list of string arguments for the command, terminated by NULL.
+ * @return The `job_t *` of the command, valid until the end of the `SyncGroup`, for `job_then` and `job_wait`.
  * @note Relies on the StringArrayN macro, which is defined elsewhere.
  */
 #define $(...)                                                                        \
-    pid_list_add(pid_list, run_command(StringArrayN(__VA_ARGS__)[0],                 \
-        StringArrayN(__VA_ARGS__)));
+    pid_list_enqueue(pid_list, StringArrayN(__VA_ARGS__))
+
+/**
+ * @brief Queues a command on the current `SyncGroup`'s pid_list, spawning it with the given options.
+ * @param options A `spawn_options_t *` (e.g., `SpawnOptions(.stdout_path = "out.txt")`).
+ * @param ... A list of string arguments for the command, terminated by NULL.
+ * @return The `job_t *` of the command, like `$()`.
+ */
+#define $_with(options, ...)                                                          \
+    pid_list_enqueue_ex(pid_list, StringArrayN(__VA_ARGS__), (options))
+
+/**
+ * @brief Runs a command synchronously with the given spawn options and waits for it to complete.
+ * @param options A `spawn_options_t *` (e.g., `SpawnOptions(.cwd = "lib")`).
+ * @param ... A list of string arguments for the command, terminated by NULL.
+ * @return The exit status of the command (see `builder_run_sync`).
+ */
+#define $_sync_with(options, ...)                                                     \
+    builder_run_sync(StringArrayN(__VA_ARGS__), (options))
+
+/**
+ * @brief Queues a command assembled in a `cmd_t` on the current `SyncGroup`'s pid_list.
+ * The command is copied, so the `cmd_t` can be reset and reused right away.
+ * @param cmd A `cmd_t *` with at least one argument.
+ * @return The `job_t *` of the command, like `$()`.
+ */
+#define $_cmd(cmd)                                                                    \
+    pid_list_enqueue(pid_list, cmd_argv(cmd))
+
+/**
+ * @brief Runs a command assembled in a `cmd_t` synchronously and waits for it to complete.
+ * @param cmd A `cmd_t *` with at least one argument.
+ * @return The exit status of the command (see `builder_run_sync`).
+ */
+#define $_sync_cmd(cmd)                                                               \
+    builder_run_sync(cmd_argv(cmd), NULL)
+
+/**
+ * @brief Appends arguments to a `cmd_t`. They are copied.
+ * @param cmd A `cmd_t *`.
+ * @param ... A list of string arguments (e.g., `cmd_append(&cmd, "-I", dir)`).
+ */
+#define cmd_append(cmd, ...)                                                          \
+    cmd_extend((cmd), StringArrayN(__VA_ARGS__))
+
+/**
+ * @brief Checks if a target has to be rebuilt from the contents of its inputs.
+ * The next command queued with `$()` is considered to build the target.
+ * @param target The path of the target (e.g., "build/foo.o").
+ * @param ... The paths of the target's inputs.
+ * @example
+ * if (needs_rebuild("build/foo.o", "src/foo.c")) {
+ *   $("cc", "-c", "src/foo.c", "-o", "build/foo.o");
+ * }
+ */
+#define needs_rebuild(target, ...)                                                    \
+    builder_needs_rebuild((target), StringArrayN(__VA_ARGS__), NULL)
+
+/**
+ * @brief Like `needs_rebuild`, but also rebuilds the target when its command changes.
+ * @param target The path of the target.
+ * @param command The command that builds the target, a NULL-terminated `char *` array.
+ * @param ... The paths of the target's inputs.
+ */
+#define needs_rebuild_cmd(target, command, ...)                                       \
+    builder_needs_rebuild((target), StringArrayN(__VA_ARGS__), (command))
+
+/**
+ * @brief Extra flags used when the build script recompiles itself, as a comma-separated list
+ * of string literals (e.g., `#define BUILDER_SCRIPT_CFLAGS "-O2", "-g"`). Can be defined before
+ * including builder.h. Empty by default, so self-rebuilds stay as fast as possible.
+ *
+ * The other source files of a build script made of several files are listed here as well, with
+ * `-DBUILDER_NO_IMPLEMENTATION` and one of them defining `BUILDER_IMPLEMENTATION` (see `impl`).
+ * The script is recompiled when one of them changes.
+ */
+#ifndef BUILDER_SCRIPT_CFLAGS
+#define BUILDER_SCRIPT_CFLAGS
+#endif
 
 /**
  * @brief Defines the main function body, adding logic to automatically recompile the
- * build script if its source is newer than the executable.
+ * build script if its source, or any header it includes, is newer than the executable.
  * @note This macro is intended to be used as: `int main main_impl`.
  * @note Relies on `builder_entrypoint` and the `arguments` global array, which are defined elsewhere.
  */
 #define main_impl (int argc, char **argv) {                                         \
-  static char *source_file = __FILE__;                                              \
-  if (is_file_older(argv[0], source_file)) {                                        \
-    char host_cc[PATH_MAX] = {0};                                                   \
-    info("build script is newer than the current executable, "                      \
-        "recompiling...");                                                          \
-                                                                                    \
-    /* Find a C compiler to recompile the script*/                                  \
-    find_executable("cc", host_cc);                                                 \
-    *host_cc == 0 && find_executable("clang", host_cc);                             \
-    *host_cc == 0 && find_executable("gcc", host_cc);                               \
-                                                                                    \
-    if (*host_cc == 0) {                                                            \
-      error("Failed to find host C compiler");                                      \
-      return 1;                                                                     \
-    }                                                                               \
-                                                                                    \
-    int code = $_sync(host_cc, "-o", argv[0], (char *)source_file, NULL);            \
-                                                                                    \
-    if (code != 0) {                                                                \
-      error("compilation failed with code %d", code);                               \
-                                                                                    \
-      return 1;                                                                     \
-    }                                                                               \
-                                                                                    \
-    info("re-running build script again...");                                       \
-    info("--------------------------------");                                        \
-                                                                                    \
-    /* Replace our process with the re-compiled build script */                     \
-    execv(argv[0], argv);                                                           \
-  }                                                                                 \
-  struct arguments_t *args = builder_parse_arguments(                             \
-    argc,                                                                           \
-    argv,                                                                           \
-    arguments,                                                                      \
-    sizeof(arguments) / sizeof(arguments[0])                                        \
-  );                                                                                \
-  builder_entrypoint(args);                                                         \
-  builder_free_arguments(args);                                                     \
+  static char *script_cflags[] = { NULL, BUILDER_SCRIPT_CFLAGS };                   \
+  return builder_main(argc, argv, __FILE__,                                         \
+    &script_cflags[1], sizeof(script_cflags) / sizeof(script_cflags[0]) - 1,        \
+    arguments, sizeof(arguments) / sizeof(arguments[0]), builder_entrypoint);       \
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -158,525 +261,9215 @@
 //////////////////////////////////////////////////////////////////////////////
 
 /** @brief The name of the currently executing program. */
-impl(static char *program_name = NULL);
+impl_global(char *program_name, NULL);
 /** @brief The current build mode (e.g., "debug", "release"). */
-impl(static char *build_mode = NULL);
+impl_global(char *build_mode, NULL);
+/** @brief The maximum number of jobs a `SyncGroup` runs at once, or 0 to use the online CPU count. */
+impl_global(long builder_max_jobs, 0);
+/** @brief The memory the running jobs may be expected to use at most in bytes, or 0 for no limit. */
+impl_global(uint64_t builder_max_memory, 0);
+/** @brief The load average above which no new job is started, or 0 for no limit. */
+impl_global(double builder_max_load, 0);
+/** @brief `true` to stop the other jobs of a list once one of them fails (`--fail-fast`). */
+impl_global(bool builder_fail_fast, false);
+/** @brief The time a command may run in milliseconds unless its options or build context say otherwise, or 0 for no limit. */
+impl_global(uint64_t builder_timeout_ms, 0);
+/** @brief `true` if the build script serves builds from a Unix socket instead of building (`--daemon`). */
+impl_global(bool builder_daemon_requested, false);
+/** @brief The backend used by `run_command`, `BUILDER_SPAWN_BACKEND` unless changed at runtime. */
+impl_global(int builder_spawn_backend, BUILDER_SPAWN_BACKEND);
 
 //////////////////////////////////////////////////////////////////////////////
-/////////////////////////////// Build context ////////////////////////////////
+/////////////////////////////////// Arena ////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
-/**
- * @brief Represents a named scope for build operations.
- * @note The BUILDER_CONTEXT_DATA type is defined in a separate header.
- */
-typedef struct build_context_t {
-  /** @brief The name of the context (e.g., "Compiling library"). */
-  char *name,
-  /** @brief The mode this context applies to (e.g., "debug"). If NULL, applies to all modes. */
-       *mode;
-  /** @brief User-defined data associated with the context. */
-  BUILDER_CONTEXT_DATA data;
-} build_context_t;
+/** @brief The size of the chunks arenas allocate from. Larger allocations get a chunk of their own. */
+#ifndef BUILDER_ARENA_CHUNK_SIZE
+#define BUILDER_ARENA_CHUNK_SIZE (64 * 1024)
+#endif
 
-/** @brief The currently active build context. */
-impl(static build_context_t *build_context);
+/** @brief The types with the strictest alignments, arena allocations are aligned for all of them. */
+typedef union arena_align_t {
+  long double ld;
+  uint64_t u64;
+  void *ptr;
+} arena_align_t;
+
+/** @brief The alignment of arena allocations. `max_align_t` would need C11. */
+#define BUILDER_ARENA_ALIGN __alignof__(arena_align_t)
+
+/** @brief A block of memory that an arena allocates from. */
+typedef struct arena_chunk_t {
+  /** @brief The previously filled chunk of the arena, or the next free chunk. */
+  struct arena_chunk_t *next;
+  /** @brief The number of usable bytes in the chunk, and the number of bytes already handed out. */
+  size_t size, used;
+  /** @brief The memory of the chunk. */
+  unsigned char data[] __attribute__((aligned(BUILDER_ARENA_ALIGN)));
+} arena_chunk_t;
+
+/** @brief A bump allocator: allocations are never freed one by one, but all at once with `arena_release`. */
+typedef struct arena_t {
+  /** @brief The chunk allocations come from, linked to the ones filled before it. */
+  arena_chunk_t *head;
+} arena_t;
+
+/** @brief Released chunks of the default size, reused by the next arenas (e.g., the next `SyncGroup`). */
+impl_global(arena_chunk_t *builder_arena_free_chunks, NULL);
 
 /**
- * @brief Pushes a new build context onto the context stack.
- * @param context The new context to make active.
- * @return The previously active context, to be restored later.
+ * @brief Allocates zeroed memory from an arena, aligned for any type.
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes to allocate.
+ * @return The memory, valid until the arena is released.
  */
-build_context_t *build_context_push(build_context_t *context) impl({
-  build_context_t *old = build_context;
+void *arena_alloc(arena_t *arena, size_t size) impl({
+  size = (size + BUILDER_ARENA_ALIGN - 1) & ~(BUILDER_ARENA_ALIGN - 1);
 
-  if (!context->name) {
-    error("Build context created without name");
+  arena_chunk_t *chunk = arena->head;
 
-    context->name = "<unnamed context>";
-  }
+  if (!chunk || chunk->size - chunk->used < size) {
+    if (size <= BUILDER_ARENA_CHUNK_SIZE / 4 && builder_arena_free_chunks) {
+      chunk = builder_arena_free_chunks;
+      builder_arena_free_chunks = chunk->next;
+    } else {
+      size_t chunk_size = size > BUILDER_ARENA_CHUNK_SIZE / 4 ? size : BUILDER_ARENA_CHUNK_SIZE;
 
-  build_context = context;
+      chunk = (arena_chunk_t *)malloc(sizeof(arena_chunk_t) + chunk_size);
 
-  return old;
-});
+      if (!chunk) {
+        perror("Failed to allocate arena memory");
+        abort();
+      }
 
-/**
- * @brief Checks if the current build context should be executed and prints an "entering" message.
- * @param old The previous build context, used to revert if the current one is skipped.
- * @return 1 if the context should proceed, 0 otherwise.
- */
-int build_context_do_begin(build_context_t *old) impl({
-  if (!build_context) {
-    return 0;
-  }
+      chunk->size = chunk_size;
+    }
 
-  if (build_context->mode && strcmp(build_context->mode, build_mode) != 0) {
-    build_context = old;
+    chunk->used = 0;
 
-    return 0;
+    // A large allocation goes below the current chunk, so its free space stays usable
+    if (arena->head && chunk->size != BUILDER_ARENA_CHUNK_SIZE) {
+      chunk->next = arena->head->next;
+      arena->head->next = chunk;
+    } else {
+      chunk->next = arena->head;
+      arena->head = chunk;
+    }
   }
 
-  info("entering \x1b[1m\x1b[34m%s\033[m...", build_context->name);
+  void *memory = chunk->data + chunk->used;
 
-  return 1;
+  chunk->used += size;
+
+  return memset(memory, 0, size);
 });
 
 /**
- * @brief Pops the current build context, restoring the provided one.
- * @param context The context to restore. Can be NULL if it was the top-level context.
+ * @brief Grows an array allocated from an arena, copying it to a larger allocation.
+ * @param arena The arena the array was allocated from.
+ * @param memory The array, or NULL.
+ * @param old_size The current size of the array in bytes.
+ * @param new_size The new size of the array in bytes.
+ * @return The new array. The old one stays allocated until the arena is released.
  */
-void build_context_pop(build_context_t *context) impl({
-  if (context) {
-    info("exiting \x1b[1m\x1b[34m%s\033[m... returning to \x1b[1m\x1b[34m%s\033[m",
-        build_context->name, context->name);
-  } else if (build_context) {
-    info("exiting \x1b[1m\x1b[34m%s\033[m...", build_context->name);
+void *arena_grow(arena_t *arena, void *memory, size_t old_size, size_t new_size) impl({
+  void *grown = arena_alloc(arena, new_size);
+
+  if (memory) {
+    memcpy(grown, memory, old_size < new_size ? old_size : new_size);
   }
 
-  build_context = context;
+  return grown;
 });
 
-//////////////////////////////////////////////////////////////////////////////
-///////////////////////////////// Utilities //////////////////////////////////
-//////////////////////////////////////////////////////////////////////////////
-
 /**
- * @brief Check if `source_file` is older than `target_file`.
- *
- * If one of the files doesn't exist, this function will return false.
- * @param source_file Path to the first file to compare.
- * @param target_file Path to the second file to compare.
- * @return `true` if `source_file` has an older modification time than `target_file`, `false` otherwise.
+ * @brief Copies a string into an arena.
+ * @param arena The arena to allocate from.
+ * @param string The string to copy, or NULL.
+ * @return The copy, or NULL if `string` is NULL.
  */
-bool is_file_older(char *source_file, char *target_file) impl({
-  time_t source_time, target_time;
-  struct stat st;
-
-  if (stat(source_file, &st) != 0) {
-    return false;
-  }
-
-  source_time = st.st_mtim.tv_sec;
-
-  if (stat(target_file, &st) != 0) {
-    return false;
+char *arena_strdup(arena_t *arena, const char *string) impl({
+  if (!string) {
+    return NULL;
   }
 
-  target_time = st.st_mtim.tv_sec;
+  size_t length = strlen(string) + 1;
 
-  return source_time < target_time;
+  return (char *)memcpy(arena_alloc(arena, length), string, length);
 });
 
 /**
- * @brief Searches for an executable in the system's PATH environment variable.
- * @param name The name of the executable to find.
- * @param output_buffer A buffer of at least `PATH_MAX` size to store the full path if found.
- * @return `true` if the executable was found, `false` otherwise.
+ * @brief Frees everything allocated from an arena at once. The arena can be used again afterwards.
+ * @param arena The arena to release.
  */
-bool find_executable(const char *name, char output_buffer[PATH_MAX]) impl({
-  char *path_env = getenv("PATH");
-
-  struct stat st = {0};
-  char *current_path = path_env;
-  size_t name_len = strlen(name);
+void arena_release(arena_t *arena) impl({
+  arena_chunk_t *chunk = arena->head;
 
-  while (current_path) {
-    char *next_colon = strchr(current_path, ':');
-
-    size_t current_path_len = next_colon
-                                ? (size_t)((uintptr_t)next_colon - (uintptr_t)current_path)
-                                : strlen(current_path);
+  while (chunk) {
+    arena_chunk_t *next = chunk->next;
 
-    memset(output_buffer, 0, sizeof(char[PATH_MAX]));
+    if (chunk->size == BUILDER_ARENA_CHUNK_SIZE) {
+      chunk->next = builder_arena_free_chunks;
+      builder_arena_free_chunks = chunk;
+    } else {
+      free(chunk);
+    }
 
-    memcpy(output_buffer, current_path, current_path_len);
-    output_buffer[current_path_len] = '/';
-    memcpy(&output_buffer[current_path_len + 1], name, name_len);
+    chunk = next;
+  }
 
-    output_buffer[current_path_len + name_len + 2] = '\0';
+  arena->head = NULL;
+});
 
-    if (stat(output_buffer, &st) == 0) {
-      bool is_executable =
-        (S_ISREG(st.st_mode) ||
-         S_ISLNK(st.st_mode)) && // Check if it is a regular file
-        (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0; // Check if it has executable permissions
+/**
+ * @brief Frees the chunks kept for reuse by released arenas.
+ */
+void arena_trim() impl({
+  while (builder_arena_free_chunks) {
+    arena_chunk_t *next = builder_arena_free_chunks->next;
 
-      if (is_executable) {
-        return true;
-      }
-    }
+    free(builder_arena_free_chunks);
 
-    current_path = (char *)((uintptr_t)next_colon + (uintptr_t)1);
+    builder_arena_free_chunks = next;
   }
-
-  *output_buffer = 0;
-
-  return false;
 });
 
 //////////////////////////////////////////////////////////////////////////////
-///////////////////////////////// Processes //////////////////////////////////
+////////////////////////////////// Tracing ///////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
-/** @brief A dynamic list to store process IDs (pid_t). */
-typedef struct pid_list_t {
+/** @brief A complete event of the build trace, written in Chrome's trace event format. */
+typedef struct trace_event_t {
+  /** @brief The name of the event (a context name or a command's executable). */
+  char *name;
+  /** @brief The category of the event ("context" or "command"). */
+  const char *category;
+  /** @brief The start time and the duration of the event, in nanoseconds. */
+  uint64_t start_ns, duration_ns;
+  /** @brief The lane the event is displayed in (0 for contexts, one per job slot for commands). */
+  int lane;
+  /** @brief The JSON object with the arguments of the event, or NULL. */
+  char *args;
+} trace_event_t;
+
+/** @brief The recorded trace events. */
+typedef struct trace_t {
   /** @brief The allocated capacity of the list. */
   size_t size,
   /** @brief The current number of items in the list. */
          current;
-  /** @brief The array of process IDs. */
-  pid_t *items;
-} pid_list_t;
+  /** @brief The array of events. */
+  trace_event_t *items;
+  /** @brief The file the trace is written to, or NULL if tracing is disabled. */
+  char *path;
+  /** @brief The start of the build, which trace timestamps are relative to. */
+  uint64_t origin_ns;
+} trace_t;
+
+/** @brief The trace of this run, enabled with `--trace <file>`. */
+impl_global(trace_t builder_trace, {0});
 
 /**
- * @brief Creates and initializes a new, empty process ID list.
- * @return A pointer to the newly allocated `pid_list_t`. Must be freed with `pid_list_free`.
+ * @brief Gets the current time of the monotonic clock.
+ * @return The current time, in nanoseconds.
  */
-pid_list_t *pid_list_create()
-  impl({ return (pid_list_t *)calloc(1, sizeof(pid_list_t)); });
+uint64_t builder_now_ns() impl({
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+});
 
 /**
- * @brief Adds a process ID to the list, resizing if necessary.
- * @param list The PID list to add to.
- * @param pid The process ID to add. If -1, it is ignored.
+ * @brief Enables tracing. The trace is written to `path` when the build ends.
+ * @param path The file to write the trace to.
  */
-void pid_list_add(pid_list_t *list, pid_t pid) impl({
-  if (pid == -1)
-    return;
+void builder_trace_enable(const char *path) impl({
+  free(builder_trace.path);
 
-  if (list->size <= list->current) {
-    list->size = (list->size + 1) * 2;
+  builder_trace.path = strdup(path);
+  builder_trace.origin_ns = builder_now_ns();
+});
 
-    list->items = (pid_t *)realloc(list->items, sizeof(pid_t) * list->size);
+/**
+ * @brief Disables tracing and drops the recorded events, e.g. once the trace was written.
+ */
+void builder_trace_disable() impl({
+  for (size_t i = 0; i < builder_trace.current; i++) {
+    free(builder_trace.items[i].name);
+    free(builder_trace.items[i].args);
   }
 
-  list->items[list->current++] = pid;
+  free(builder_trace.items);
+  free(builder_trace.path);
+
+  builder_trace = (trace_t){0};
 });
 
 /**
- * @brief Frees the memory used by a process ID list.
- * @param list The list to free.
+ * @brief Checks if tracing is enabled.
+ * @return `true` if events are being recorded.
  */
-void pid_list_free(pid_list_t *list) impl({
-  list->size = list->current = 0;
-
-  free(list->items);
-  free(list);
+bool builder_trace_enabled() impl({
+  return builder_trace.path != NULL;
 });
 
 /**
- * @brief Waits for a single process to terminate and returns its exit code.
- * @param pid The ID of the process to wait for.
- * @return The exit status of the process, or the signal number if it was terminated by a signal.
+ * @brief Appends raw text to a growing buffer.
+ * @param buffer The buffer, reallocated as needed.
+ * @param len The length of the string in the buffer.
+ * @param size The allocated size of the buffer.
+ * @param text The text to append.
  */
-int wait_pid_sync(pid_t pid) impl({
-  int status;
-
-  while (-1 != waitpid(pid, &status, 0)) {
-    if (WIFSIGNALED(status)) {
-      error("process %d received signal '%s'", pid, strsignal(WTERMSIG(status)));
-
-      return WTERMSIG(status);
-    }
+void builder_buffer_append(char **buffer, size_t *len, size_t *size, const char *text) impl({
+  size_t text_len = strlen(text);
 
-    if (WIFEXITED(status)) {
-      return WEXITSTATUS(status);
-    }
+  if (*size < *len + text_len + 1) {
+    *size = (*len + text_len + 1) * 2;
+    *buffer = (char *)realloc(*buffer, *size);
   }
 
-  return -1;
+  memcpy(*buffer + *len, text, text_len + 1);
+  *len += text_len;
 });
 
 /**
- * @brief Waits for all processes in a PID list to terminate.
- * @param pids The list of process IDs to wait for.
- * @return A bitwise-OR combination of all process exit statuses.
+ * @brief Appends a string to a growing buffer as a JSON string literal (with quotes).
+ * @param buffer The buffer, reallocated as needed.
+ * @param len The length of the string in the buffer.
+ * @param size The allocated size of the buffer.
+ * @param string The string to append.
  */
-int pid_list_wait_sync(pid_list_t *pids) impl({
-  int status = 0;
+void builder_json_append_string(char **buffer, size_t *len, size_t *size, const char *string) impl({
+  size_t needed = *len + strlen(string) * 6 + 3;
 
-  for (size_t i = 0; i < pids->size; i++) {
-    pid_t pid = pids->items[i];
+  if (*size < needed) {
+    *size = needed * 2;
+    *buffer = (char *)realloc(*buffer, *size);
+  }
 
-    while (-1 != waitpid(pid, &status, 0)) {
-      if (WIFSIGNALED(status)) {
-        error("process %d received signal '%s'", pid, strsignal(WTERMSIG(status)));
+  char *out = *buffer + *len;
 
-        status |= WTERMSIG(status);
-      }
+  *out++ = '"';
 
-      if (WIFEXITED(status)) {
-        status |= WEXITSTATUS(status);
-      }
+  for (const unsigned char *in = (const unsigned char *)string; *in; in++) {
+    if (*in == '"' || *in == '\\') {
+      *out++ = '\\';
+      *out++ = (char)*in;
+    } else if (*in < 0x20) {
+      out += sprintf(out, "\\u%04x", *in);
+    } else {
+      *out++ = (char)*in;
     }
   }
 
-  return status;
+  *out++ = '"';
+  *out = '\0';
+
+  *len = (size_t)(out - *buffer);
 });
 
 /**
- * @brief Creates a new child process to run a command.
- * @param path The name or path of the executable to run.
- * @param argv The argument vector (list of strings) for the new process, ending with NULL.
- * @return The process ID of the child on success, or -1 on failure.
+ * @brief Records a complete event in the trace. Does nothing if tracing is disabled.
+ * @param name The name of the event. It is copied.
+ * @param category The category of the event, a string literal.
+ * @param start_ns The start time of the event, from `builder_now_ns`.
+ * @param end_ns The end time of the event, from `builder_now_ns`.
+ * @param lane The lane of the event.
+ * @param args The JSON object with the arguments of the event, or NULL. The trace takes ownership of it.
  */
-pid_t run_command(const char *path, char **argv) impl({
-  char executable_path[PATH_MAX];
+void builder_trace_event(const char *name, const char *category, uint64_t start_ns, uint64_t end_ns,
+                         int lane, char *args) impl({
+  if (!builder_trace.path) {
+    free(args);
 
-  if (*path == '/') {
-    // Name is an absolute path
-    memcpy(executable_path, path, strlen(path) + 1);
-  } else if (!find_executable(path, executable_path)) {
-    error("run_command: couldn't find executable %s in PATH.", path);
+    return;
+  }
 
-    return -1;
+  if (builder_trace.size <= builder_trace.current) {
+    builder_trace.size = (builder_trace.size + 1) * 2;
+    builder_trace.items = (trace_event_t *)realloc(builder_trace.items, sizeof(trace_event_t) * builder_trace.size);
   }
 
-  pid_t pid = fork();
+  builder_trace.items[builder_trace.current++] = (trace_event_t){
+    .name = strdup(name),
+    .category = category,
+    .start_ns = start_ns,
+    .duration_ns = end_ns > start_ns ? end_ns - start_ns : 0,
+    .lane = lane,
+    .args = args,
+  };
+});
 
-  if (pid == 0) {
-    if (-1 == execv(executable_path, (char *const *)argv)) {
-      error("execv failed: %s", strerror(errno));
-    }
+/**
+ * @brief Records a finished command in the trace, with its process ID, argv and exit status.
+ * @param argv The command, ending with NULL.
+ * @param pid The process ID of the command.
+ * @param status The exit status of the command.
+ * @param start_ns The time the command was started.
+ * @param lane The job slot the command ran in.
+ */
+void builder_trace_command(char **argv, pid_t pid, int status, uint64_t start_ns, int lane) impl({
+  char *args = NULL, header[64];
+  size_t len = 0, size = 0;
 
-    exit(127);
+  if (!builder_trace.path || !argv) {
+    return;
   }
 
-  if (pid == -1) {
-    error("fork() failed: %s", strerror(errno));
+  const char *name = strrchr(argv[0], '/');
 
-    return -1;
+  snprintf(header, sizeof(header), "{\"pid\":%d,\"status\":%d,\"argv\":[", (int)pid, status);
+  builder_buffer_append(&args, &len, &size, header);
+
+  for (size_t i = 0; argv[i]; i++) {
+    if (i > 0) {
+      builder_buffer_append(&args, &len, &size, ",");
+    }
+
+    builder_json_append_string(&args, &len, &size, argv[i]);
   }
 
-  return pid;
+  builder_buffer_append(&args, &len, &size, "]}");
+
+  builder_trace_event(name ? name + 1 : argv[0], "command", start_ns, builder_now_ns(), lane, args);
 });
 
 //////////////////////////////////////////////////////////////////////////////
-////////////////////////////// Argument parser ///////////////////////////////
+///////////////////////////////// Progress ///////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
+/** @brief The shortest time between two redraws of the progress line, in milliseconds. */
+#ifndef BUILDER_PROGRESS_INTERVAL_MS
+#define BUILDER_PROGRESS_INTERVAL_MS 100
+#endif
+
+/** @brief What a build context and the commands queued in it used, for the summary printed after a build. */
+typedef struct context_stats_t {
+  /** @brief The name of the context. Owned by the stats. */
+  char *name;
+  /** @brief The time spent in the context, in nanoseconds. */
+  uint64_t wall_ns,
+  /** @brief The user and system CPU time of the context's commands, in nanoseconds. */
+           cpu_ns,
+  /** @brief The largest resident set size of one of the context's commands, in bytes. */
+           peak_memory;
+  /** @brief The number of commands queued in the context. */
+  size_t commands;
+} context_stats_t;
+
+/** @brief The progress line shown on a terminal while commands run, and the stats of the build contexts. */
+typedef struct progress_t {
+  /** @brief `false` if the progress line was turned off (`--no-progress`). */
+  bool enabled,
+  /** @brief `true` if the progress line is drawn during this build, i.e. it is enabled and stdout is a terminal. */
+       active,
+  /** @brief `true` while the progress line is on the terminal, it must be cleared before anything else is printed. */
+       visible;
+  /** @brief The number of commands queued during this build, and the number of them that are done. */
+  size_t total, done;
+  /** @brief The last time the line was drawn, in nanoseconds. */
+  uint64_t drawn_ns,
+  /** @brief The timer drawing the line once a throttled update is due, or 0. */
+           timer;
+  /** @brief The command started last, shown on the line. */
+  char current[256];
+  /** @brief The stats of the build contexts entered during this build, in the order they were first entered. */
+  context_stats_t **contexts;
+  /** @brief The number of contexts, and the allocated capacity of `contexts`. */
+  size_t contexts_count, contexts_size;
+} progress_t;
+
+/** @brief The progress of this build. */
+impl_global(progress_t builder_progress, { .enabled = true });
+
 /**
- * @brief Gets the program name.
- * @return The name of the program.
+ * @brief Sets whether a progress line (`[running/done/total] command`) is shown while commands run.
+ * It is only drawn when stdout is a terminal and the output of jobs is captured.
+ * @param enabled `true` to show it from the next build on.
  */
-char *builder_program_name() impl({
-  return program_name;
+void builder_set_progress(bool enabled) impl({
+  builder_progress.enabled = enabled;
 });
 
-impl(
-  /**
-   * @brief A node for the linked list of parsed arguments.
-   */
-  typedef struct argument_node_t {
-    /** @brief The parsed argument data. */
-    struct argument_t *argument;
-    /** @brief Pointer to the next node in the list. */
-    struct argument_node_t *next;
-  } argument_node_t;
-
-  /**
-   * @brief Finds an argument definition by its long name (e.g., "help").
-   * @param name The long name to search for.
-   * @param defs The array of argument definitions.
-   * @param defs_count The number of definitions in the array.
-   * @return A pointer to the matching definition, or NULL if not found.
-   */
-  static const argument_definition_t* builder_find_def_by_long_name(const char *name, const argument_definition_t defs[], size_t defs_count) {
-    for (size_t i = 0; i < defs_count; ++i) {
-      if (defs[i].longName && strcmp(name, defs[i].longName) == 0) {
-        return &defs[i];
-      }
-    }
-    return NULL;
+/**
+ * @brief Erases the progress line from the terminal, so a message can be printed. It is drawn again on the next update.
+ * The `info`, `warn` and `error` macros do this before printing.
+ */
+void builder_progress_clear() impl({
+  if (!builder_progress.visible) {
+    return;
   }
 
-  /**
-   * @brief Finds an argument definition by its short name (e.g., 'h').
-   * @param name The short name character to search for.
-   * @param defs The array of argument definitions.
-   * @param defs_count The number of definitions in the array.
-   * @return A pointer to the matching definition, or NULL if not found.
-   */
-  static const argument_definition_t* builder_find_def_by_short_name(char name, const argument_definition_t defs[], size_t defs_count) {
-    for (size_t i = 0; i < defs_count; ++i) {
-      if (defs[i].shortName != '\0' && defs[i].shortName == name) {
-        return &defs[i];
-      }
-    }
-    return NULL;
+  builder_progress.visible = false;
+
+  fflush(stdout);
+
+  if (write(STDOUT_FILENO, "\r\033[K", 4) == -1) {
+    // The terminal is gone, there's nothing to erase
   }
+});
 
+/**
+ * @brief Draws the progress line now, with a single write.
+ * @param running The number of commands running.
+ */
+void builder_progress_draw(size_t running) impl({
+  char line[512];
+  struct winsize size;
+  int columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+
+  // One column less than the terminal, or writing up to its edge would wrap the line
+  int length = snprintf(line, sizeof(line), "\r[%zu/%zu/%zu] %s", running, builder_progress.done,
+      builder_progress.total, builder_progress.current);
+
+  if (length >= (int)sizeof(line) - 3) {
+    length = (int)sizeof(line) - 4;
+  }
+
+  // Cut by columns rather than bytes, and never in the middle of a UTF-8 character (its continuation bytes
+  // are 0x80-0xBF). Wide characters are counted as one column
+  int cut = 1;
+
+  for (int width = 0; cut < length; cut++) {
+    if (((unsigned char)line[cut] & 0xC0) != 0x80 && width++ == columns - 1) {
+      break;
+    }
+  }
+
+  // The line may also have been cut short of the buffer, then the byte after it tells
+  while (cut > 1 && ((unsigned char)line[cut] & 0xC0) == 0x80) {
+    cut--;
+  }
+
+  length = cut;
+
+  memcpy(line + length, "\033[K", 3);
+
+  fflush(stdout);
+
+  if (write(STDOUT_FILENO, line, (size_t)length + 3) != -1) {
+    builder_progress.visible = true;
+  }
+
+  builder_progress.drawn_ns = builder_now_ns();
+});
+
+/**
+ * @brief Gets the stats of a build context, creating them the first time the context is entered.
+ * @param name The name of the context. Contexts with the same name share their stats.
+ * @return The stats of the context.
+ */
+context_stats_t *builder_context_stats(const char *name) impl({
+  for (size_t i = 0; i < builder_progress.contexts_count; i++) {
+    if (strcmp(builder_progress.contexts[i]->name, name) == 0) {
+      return builder_progress.contexts[i];
+    }
+  }
+
+  if (builder_progress.contexts_size <= builder_progress.contexts_count) {
+    builder_progress.contexts_size = (builder_progress.contexts_size + 1) * 2;
+    builder_progress.contexts = (context_stats_t **)realloc(builder_progress.contexts,
+        sizeof(context_stats_t *) * builder_progress.contexts_size);
+  }
+
+  // Allocated one by one, jobs keep pointing to the stats of their context
+  context_stats_t *stats = (context_stats_t *)calloc(1, sizeof(context_stats_t));
+
+  stats->name = strdup(name);
+  builder_progress.contexts[builder_progress.contexts_count++] = stats;
+
+  return stats;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// Build context ////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Represents a named scope for build operations.
+ * @note The BUILDER_CONTEXT_DATA type is defined in a separate header.
+ */
+typedef struct build_context_t {
+  /** @brief The name of the context (e.g., "Compiling library"). */
+  char *name,
+  /** @brief The mode this context applies to (e.g., "debug"). If NULL, applies to all modes. */
+       *mode;
+  /** @brief User-defined data associated with the context. */
+  BUILDER_CONTEXT_DATA data;
+  /** @brief The time the context was entered, set by the builder. */
+  uint64_t start_ns;
+  /**
+   * @brief The memory each command queued in this context is expected to use, in bytes, or 0 if unknown.
+   * Inherited by nested contexts. Used by the scheduler when `--max-memory` is set.
+   */
+  uint64_t memory;
+  /**
+   * @brief The time each command queued in this context may run in milliseconds, or 0 to use `--timeout`.
+   * Inherited by nested contexts.
+   */
+  uint64_t timeout_ms;
+  /**
+   * @brief The whole environment of the commands queued in this context, as "NAME=value" strings ending
+   * with NULL (e.g., `StringArrayN("PATH=/usr/bin:/bin", "LC_ALL=C")`), or NULL to inherit the build
+   * script's. Inherited by nested contexts. It is part of the action hash of `needs_rebuild` and of the
+   * compiler cache key, so a variable of the developer's shell can't change or invalidate a build.
+   */
+  char **env;
+} build_context_t;
+
+/** @brief The currently active build context. */
+impl_global(build_context_t *build_context, NULL);
+
+/**
+ * @brief Pushes a new build context onto the context stack.
+ * @param context The new context to make active.
+ * @return The previously active context, to be restored later.
+ */
+build_context_t *build_context_push(build_context_t *context) impl({
+  build_context_t *old = build_context;
+
+  if (!context->memory && old) {
+    context->memory = old->memory;
+  }
+
+  if (!context->timeout_ms && old) {
+    context->timeout_ms = old->timeout_ms;
+  }
+
+  if (!context->env && old) {
+    context->env = old->env;
+  }
+
+  if (!context->name) {
+    error("Build context created without name");
+
+    context->name = "<unnamed context>";
+  }
+
+  build_context = context;
+
+  return old;
+});
+
+/**
+ * @brief Checks if the current build context should be executed and prints an "entering" message.
+ * @param old The previous build context, used to revert if the current one is skipped.
+ * @return 1 if the context should proceed, 0 otherwise.
+ */
+int build_context_do_begin(build_context_t *old) impl({
+  if (!build_context) {
+    return 0;
+  }
+
+  if (build_context->mode && strcmp(build_context->mode, build_mode) != 0) {
+    build_context = old;
+
+    return 0;
+  }
+
+  info("entering \x1b[1m\x1b[34m%s\033[m...", build_context->name);
+
+  build_context->start_ns = builder_now_ns();
+
+  return 1;
+});
+
+/**
+ * @brief Pops the current build context, restoring the provided one.
+ * @param context The context to restore. Can be NULL if it was the top-level context.
+ */
+void build_context_pop(build_context_t *context) impl({
+  if (build_context) {
+    uint64_t now = builder_now_ns();
+
+    builder_trace_event(build_context->name, "context", build_context->start_ns, now, 0, NULL);
+
+    // The time of nested contexts counts in their parents' as well
+    builder_context_stats(build_context->name)->wall_ns += now - build_context->start_ns;
+  }
+
+  if (context) {
+    info("exiting \x1b[1m\x1b[34m%s\033[m... returning to \x1b[1m\x1b[34m%s\033[m",
+        build_context->name, context->name);
+  } else if (build_context) {
+    info("exiting \x1b[1m\x1b[34m%s\033[m...", build_context->name);
+  }
+
+  build_context = context;
+});
+
+/**
+ * @brief Writes the recorded trace as Chrome trace event JSON (loadable in Perfetto or chrome://tracing).
+ * Does nothing if tracing is disabled.
+ * @return `true` on success, `false` if the file couldn't be written.
+ */
+bool builder_trace_write() impl({
+  char *buffer = NULL;
+  size_t len = 0, size = 0;
+  int max_lane = 0;
+
+  if (!builder_trace.path) {
+    return true;
+  }
+
+  FILE *file = fopen(builder_trace.path, "w");
+
+  if (!file) {
+    error("couldn't write trace to %s: %s", builder_trace.path, strerror(errno));
+
+    return false;
+  }
+
+  fputs("{\"traceEvents\":[\n", file);
+
+  for (size_t i = 0; i < builder_trace.current; i++) {
+    trace_event_t *event = &builder_trace.items[i];
+
+    len = 0;
+    builder_json_append_string(&buffer, &len, &size, event->name);
+
+    fprintf(file, "{\"name\":%s,\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+        buffer, event->category, event->lane,
+        (double)(event->start_ns - builder_trace.origin_ns) / 1000.0, (double)event->duration_ns / 1000.0);
+
+    if (event->args) {
+      fprintf(file, ",\"args\":%s", event->args);
+    }
+
+    fputs("},\n", file);
+
+    if (event->lane > max_lane) {
+      max_lane = event->lane;
+    }
+  }
+
+  // Name the lanes, so the viewer shows "contexts" and one row per job slot
+  fputs("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"contexts\"}}", file);
+
+  for (int lane = 1; lane <= max_lane; lane++) {
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"job %d\"}}",
+        lane, lane);
+  }
+
+  fputs("\n]}\n", file);
+  free(buffer);
+
+  if (fclose(file) != 0) {
+    error("couldn't write trace to %s: %s", builder_trace.path, strerror(errno));
+
+    return false;
+  }
+
+  return true;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Utilities //////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Gets the modification time of a file in nanoseconds.
+ * @param st The result of a `stat` call on the file.
+ * @return The modification time, in nanoseconds since the epoch.
+ */
+uint64_t builder_stat_mtime_ns(const struct stat *st) impl({
+  return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + (uint64_t)st->st_mtim.tv_nsec;
+});
+
+/**
+ * @brief Hashes a NUL-terminated string with 64-bit FNV-1a.
+ * @param string The string to hash.
+ * @return The hash of the string.
+ */
+uint64_t builder_hash_string(const char *string) impl({
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (; *string; string++) {
+    hash ^= (unsigned char)*string;
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+});
+
+/** @brief A memoized `stat` result. */
+typedef struct stat_entry_t {
+  /** @brief The path that was stat'ed, or NULL if the slot is empty. */
+  char *path;
+  /** @brief The value of `builder_stat_generation` when the entry was filled, it is stale otherwise. */
+  uint64_t generation;
+  /** @brief `true` if the file exists. */
+  bool exists;
+  /** @brief The result of `stat`, if the file exists. */
+  struct stat st;
+} stat_entry_t;
+
+/** @brief The open addressing table of memoized `stat` results for this run. */
+typedef struct stat_cache_t {
+  /** @brief The allocated capacity of the table, a power of two. */
+  size_t size,
+  /** @brief The number of used slots. */
+         count;
+  /** @brief The slots of the table. */
+  stat_entry_t *items;
+  /** @brief The arena the paths are copied to. */
+  arena_t arena;
+} stat_cache_t;
+
+/** @brief The `stat` results of this run, see `builder_stat`. */
+impl_global(stat_cache_t builder_stat_cache, {0});
+/** @brief Bumped by `builder_stat_invalidate_all`, which makes every memoized result stale at once. */
+impl_global(uint64_t builder_stat_generation, 1);
+
+/**
+ * @brief Finds the slot of a path in the stat cache, growing the table if needed.
+ * @param path The path to look up.
+ * @return The slot of the path, with a NULL `path` if it isn't in the table yet.
+ */
+stat_entry_t *builder_stat_slot(const char *path) impl({
+  stat_cache_t *cache = &builder_stat_cache;
+
+  // At most half full, so probe sequences stay short
+  if (cache->size <= cache->count * 2) {
+    stat_entry_t *old = cache->items;
+    size_t old_size = cache->size;
+
+    cache->size = cache->size ? cache->size * 2 : 256;
+    cache->items = (stat_entry_t *)calloc(cache->size, sizeof(stat_entry_t));
+
+    for (size_t i = 0; i < old_size; i++) {
+      if (!old[i].path) continue;
+
+      size_t slot = builder_hash_string(old[i].path) & (cache->size - 1);
+
+      while (cache->items[slot].path) {
+        slot = (slot + 1) & (cache->size - 1);
+      }
+
+      cache->items[slot] = old[i];
+    }
+
+    free(old);
+  }
+
+  size_t slot = builder_hash_string(path) & (cache->size - 1);
+
+  while (cache->items[slot].path && strcmp(cache->items[slot].path, path) != 0) {
+    slot = (slot + 1) & (cache->size - 1);
+  }
+
+  return &cache->items[slot];
+});
+
+/**
+ * @brief Records the `stat` result of a path in the stat cache.
+ * @param path The path.
+ * @param st The result of `stat`, or NULL if the file doesn't exist.
+ */
+void builder_stat_store(const char *path, const struct stat *st) impl({
+  stat_entry_t *entry = builder_stat_slot(path);
+
+  if (!entry->path) {
+    entry->path = arena_strdup(&builder_stat_cache.arena, path);
+    builder_stat_cache.count++;
+  }
+
+  entry->generation = builder_stat_generation;
+  entry->exists = st != NULL;
+
+  if (st) {
+    entry->st = *st;
+  }
+});
+
+/**
+ * @brief Like `stat`, but memoized for the rest of the run.
+ *
+ * The results of the outputs of finished jobs are dropped (all of them when a job's outputs
+ * aren't known), so the build script sees what its commands wrote. Files written by the
+ * build script itself must be dropped with `builder_stat_invalidate`.
+ * @param path The path of the file.
+ * @param st Where to store the result.
+ * @return `true` if the file exists, `false` otherwise.
+ */
+bool builder_stat(const char *path, struct stat *st) impl({
+  stat_entry_t *entry = builder_stat_slot(path);
+
+  if (!entry->path || entry->generation != builder_stat_generation) {
+    struct stat result;
+    bool exists = stat(path, &result) == 0;
+
+    builder_stat_store(path, exists ? &result : NULL);
+
+    // Storing may have grown the table
+    entry = builder_stat_slot(path);
+  }
+
+  if (entry->exists) {
+    *st = entry->st;
+  }
+
+  return entry->exists;
+});
+
+/**
+ * @brief Drops the memoized `stat` result of a file, after it was written.
+ * @param path The path of the file.
+ */
+void builder_stat_invalidate(const char *path) impl({
+  if (!builder_stat_cache.items) return;
+
+  stat_entry_t *entry = builder_stat_slot(path);
+
+  if (entry->path) {
+    entry->generation = 0;
+  }
+});
+
+/**
+ * @brief Drops all memoized `stat` results, e.g. after a command that may have written anywhere.
+ */
+void builder_stat_invalidate_all() impl({
+  builder_stat_generation++;
+});
+
+/**
+ * @brief Check if `source_file` is older than `target_file`.
+ *
+ * If one of the files doesn't exist, this function will return false.
+ * Modification times are compared with nanosecond precision.
+ * @param source_file Path to the first file to compare.
+ * @param target_file Path to the second file to compare.
+ * @return `true` if `source_file` has an older modification time than `target_file`, `false` otherwise.
+ */
+bool is_file_older(char *source_file, char *target_file) impl({
+  uint64_t source_time, target_time;
+  struct stat st;
+
+  if (!builder_stat(source_file, &st)) {
+    return false;
+  }
+
+  source_time = builder_stat_mtime_ns(&st);
+
+  if (!builder_stat(target_file, &st)) {
+    return false;
+  }
+
+  target_time = builder_stat_mtime_ns(&st);
+
+  return source_time < target_time;
+});
+
+/** @brief The streaming state of a 64-bit xxHash (XXH64) computation. */
+typedef struct hash_state_t {
+  /** @brief The four accumulation lanes. */
+  uint64_t lanes[4],
+  /** @brief The total number of bytes hashed so far. */
+           total_len,
+  /** @brief The seed the hash was started with. */
+           seed;
+  /** @brief Bytes that didn't fill a 32-byte stripe yet. */
+  unsigned char buffer[32];
+  /** @brief The number of bytes in `buffer`. */
+  size_t buffered;
+} hash_state_t;
+
+impl(
+  /** @brief The XXH64 primes. */
+  static const uint64_t builder_xxh_p1 = 11400714785074694791ULL, builder_xxh_p2 = 14029467366897019727ULL,
+                        builder_xxh_p3 = 1609587929392839161ULL, builder_xxh_p4 = 9650029242287828579ULL,
+                        builder_xxh_p5 = 2870177450012600261ULL;
+
+  /** @brief Rotates a 64-bit integer left. */
+  static inline uint64_t builder_xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  /** @brief Reads a little-endian 64-bit integer, whatever the host byte order is. */
+  static inline uint64_t builder_xxh_read64(const unsigned char *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+  }
+
+  /** @brief Reads a little-endian 32-bit integer, whatever the host byte order is. */
+  static inline uint64_t builder_xxh_read32(const unsigned char *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+  }
+
+  /** @brief Mixes one 8-byte input into an accumulation lane. */
+  static inline uint64_t builder_xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * builder_xxh_p2;
+    acc = builder_xxh_rotl(acc, 31);
+
+    return acc * builder_xxh_p1;
+  }
+
+  /** @brief Merges an accumulation lane into the final hash. */
+  static inline uint64_t builder_xxh_merge(uint64_t hash, uint64_t lane) {
+    hash ^= builder_xxh_round(0, lane);
+
+    return hash * builder_xxh_p1 + builder_xxh_p4;
+  }
+)
+
+/**
+ * @brief Starts a new streaming hash.
+ * @param state The hash state to initialize.
+ * @param seed The seed of the hash.
+ */
+void hash_init(hash_state_t *state, uint64_t seed) impl({
+  *state = (hash_state_t){0};
+
+  state->seed = seed;
+  state->lanes[0] = seed + builder_xxh_p1 + builder_xxh_p2;
+  state->lanes[1] = seed + builder_xxh_p2;
+  state->lanes[2] = seed;
+  state->lanes[3] = seed - builder_xxh_p1;
+});
+
+/**
+ * @brief Feeds bytes to a streaming hash.
+ * @param state The hash state.
+ * @param data The bytes to hash.
+ * @param len The number of bytes.
+ */
+void hash_update(hash_state_t *state, const void *data, size_t len) impl({
+  const unsigned char *p = (const unsigned char *)data;
+
+  state->total_len += len;
+
+  if (state->buffered + len < 32) {
+    memcpy(state->buffer + state->buffered, p, len);
+    state->buffered += len;
+
+    return;
+  }
+
+  if (state->buffered) {
+    size_t fill = 32 - state->buffered;
+
+    memcpy(state->buffer + state->buffered, p, fill);
+
+    for (int i = 0; i < 4; i++) {
+      state->lanes[i] = builder_xxh_round(state->lanes[i], builder_xxh_read64(state->buffer + i * 8));
+    }
+
+    p += fill;
+    len -= fill;
+    state->buffered = 0;
+  }
+
+  for (; len >= 32; p += 32, len -= 32) {
+    for (int i = 0; i < 4; i++) {
+      state->lanes[i] = builder_xxh_round(state->lanes[i], builder_xxh_read64(p + i * 8));
+    }
+  }
+
+  memcpy(state->buffer, p, len);
+  state->buffered = len;
+});
+
+/**
+ * @brief Finishes a streaming hash. The state can still be updated afterwards.
+ * @param state The hash state.
+ * @return The hash of every byte fed to the state.
+ */
+uint64_t hash_digest(const hash_state_t *state) impl({
+  const unsigned char *p = state->buffer;
+  size_t len = state->buffered;
+  uint64_t hash;
+
+  if (state->total_len >= 32) {
+    hash = builder_xxh_rotl(state->lanes[0], 1) + builder_xxh_rotl(state->lanes[1], 7) +
+           builder_xxh_rotl(state->lanes[2], 12) + builder_xxh_rotl(state->lanes[3], 18);
+
+    for (int i = 0; i < 4; i++) {
+      hash = builder_xxh_merge(hash, state->lanes[i]);
+    }
+  } else {
+    hash = state->seed + builder_xxh_p5;
+  }
+
+  hash += state->total_len;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    hash ^= builder_xxh_round(0, builder_xxh_read64(p));
+    hash = builder_xxh_rotl(hash, 27) * builder_xxh_p1 + builder_xxh_p4;
+  }
+
+  if (len >= 4) {
+    hash ^= builder_xxh_read32(p) * builder_xxh_p1;
+    hash = builder_xxh_rotl(hash, 23) * builder_xxh_p2 + builder_xxh_p3;
+    p += 4;
+    len -= 4;
+  }
+
+  for (; len > 0; p++, len--) {
+    hash ^= *p * builder_xxh_p5;
+    hash = builder_xxh_rotl(hash, 11) * builder_xxh_p1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= builder_xxh_p2;
+  hash ^= hash >> 29;
+  hash *= builder_xxh_p3;
+  hash ^= hash >> 32;
+
+  return hash;
+});
+
+/**
+ * @brief Hashes a buffer with 64-bit xxHash (XXH64).
+ * @param data The bytes to hash.
+ * @param len The number of bytes.
+ * @param seed The seed of the hash.
+ * @return The hash of the buffer.
+ */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) impl({
+  hash_state_t state;
+
+  hash_init(&state, seed);
+  hash_update(&state, data, len);
+
+  return hash_digest(&state);
+});
+
+/**
+ * @brief Hashes the contents of a file with 64-bit xxHash (XXH64).
+ * @param path The path of the file.
+ * @param hash Where to store the hash of the file.
+ * @return `true` on success, `false` if the file couldn't be read.
+ */
+bool hash_file(const char *path, uint64_t *hash) impl({
+  unsigned char buffer[64 * 1024];
+  hash_state_t state;
+  ssize_t len;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return false;
+  }
+
+  hash_init(&state, 0);
+
+  while ((len = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (len == -1) {
+      if (errno == EINTR)
+        continue;
+
+      close(fd);
+
+      return false;
+    }
+
+    hash_update(&state, buffer, (size_t)len);
+  }
+
+  close(fd);
+
+  *hash = hash_digest(&state);
+
+  return true;
+});
+
+/**
+ * @brief Searches for an executable in a PATH-like list of directories, without using the cache.
+ * @param name The name of the executable to find.
+ * @param path_env A colon-separated list of directories. Can be NULL.
+ * @param output_buffer A buffer of at least `PATH_MAX` size to store the full path if found.
+ * @return `true` if the executable was found, `false` otherwise.
+ */
+bool find_executable_in(const char *name, const char *path_env, char output_buffer[PATH_MAX]) impl({
+  struct stat st = {0};
+  const char *current_path = path_env;
+  size_t name_len = strlen(name);
+
+  while (current_path) {
+    const char *next_colon = strchr(current_path, ':');
+
+    size_t current_path_len = next_colon
+                                ? (size_t)((uintptr_t)next_colon - (uintptr_t)current_path)
+                                : strlen(current_path);
+
+    // An empty entry means the current directory
+    if (current_path_len == 0) {
+      current_path = ".";
+      current_path_len = 1;
+    }
+
+    if (current_path_len + name_len + 2 <= PATH_MAX) {
+      memcpy(output_buffer, current_path, current_path_len);
+      output_buffer[current_path_len] = '/';
+      memcpy(&output_buffer[current_path_len + 1], name, name_len + 1);
+
+      if (stat(output_buffer, &st) == 0) {
+        bool is_executable =
+          S_ISREG(st.st_mode) && // Check if it is a regular file (stat follows symlinks)
+          (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0; // Check if it has executable permissions
+
+        if (is_executable) {
+          return true;
+        }
+      }
+    }
+
+    current_path = next_colon ? next_colon + 1 : NULL;
+  }
+
+  *output_buffer = 0;
+
+  return false;
+});
+
+/** @brief An entry of the executable cache, mapping a name to its resolved path. */
+typedef struct path_cache_entry_t {
+  /** @brief The name of the executable, or NULL if the slot is empty. */
+  char *name;
+  /** @brief The full path of the executable, or NULL if it wasn't found in PATH. */
+  char *path;
+} path_cache_entry_t;
+
+/** @brief An open-addressing hash table of resolved executables. */
+typedef struct path_cache_t {
+  /** @brief The number of slots in the table, always a power of two. */
+  size_t size,
+  /** @brief The number of used slots. */
+         current;
+  /** @brief The slots of the table. */
+  path_cache_entry_t *items;
+  /** @brief The value of PATH the entries were resolved with, or NULL if PATH was unset. */
+  char *path_env;
+} path_cache_t;
+
+/** @brief The process-wide cache used by `find_executable`. */
+impl_global(path_cache_t builder_path_cache, {0});
+
+/**
+ * @brief Removes every resolved executable from the cache.
+ * This is done automatically when PATH changes.
+ */
+void builder_path_cache_clear() impl({
+  for (size_t i = 0; i < builder_path_cache.size; i++) {
+    free(builder_path_cache.items[i].name);
+    free(builder_path_cache.items[i].path);
+  }
+
+  free(builder_path_cache.items);
+  free(builder_path_cache.path_env);
+
+  builder_path_cache = (path_cache_t){0};
+});
+
+/**
+ * @brief Finds the cache slot of an executable name.
+ * @param name The name of the executable.
+ * @return The slot holding `name`, or the empty slot where it should be inserted.
+ */
+path_cache_entry_t *builder_path_cache_slot(const char *name) impl({
+  size_t mask = builder_path_cache.size - 1;
+  size_t i = builder_hash_string(name) & mask;
+
+  while (builder_path_cache.items[i].name && strcmp(builder_path_cache.items[i].name, name) != 0) {
+    i = (i + 1) & mask;
+  }
+
+  return &builder_path_cache.items[i];
+});
+
+/**
+ * @brief Searches for an executable in the system's PATH environment variable.
+ *
+ * Results (including misses) are cached per name for the whole run, and the cache is
+ * dropped whenever PATH no longer has the value it was filled with.
+ * @param name The name of the executable to find.
+ * @param output_buffer A buffer of at least `PATH_MAX` size to store the full path if found.
+ * @return `true` if the executable was found, `false` otherwise.
+ */
+bool find_executable(const char *name, char output_buffer[PATH_MAX]) impl({
+  const char *path_env = getenv("PATH");
+  const char *cached_env = builder_path_cache.path_env;
+
+  if (builder_path_cache.items &&
+      (path_env ? !cached_env || strcmp(path_env, cached_env) != 0 : cached_env != NULL)) {
+    builder_path_cache_clear();
+  }
+
+  if (!builder_path_cache.items) {
+    builder_path_cache.size = 64;
+    builder_path_cache.items = (path_cache_entry_t *)calloc(builder_path_cache.size, sizeof(path_cache_entry_t));
+    builder_path_cache.path_env = path_env ? strdup(path_env) : NULL;
+  }
+
+  path_cache_entry_t *entry = builder_path_cache_slot(name);
+
+  if (!entry->name) {
+    bool found = find_executable_in(name, path_env, output_buffer);
+
+    // Keep the table at most half full so probe sequences stay short
+    if ((builder_path_cache.current + 1) * 2 > builder_path_cache.size) {
+      path_cache_t old = builder_path_cache;
+
+      builder_path_cache.size *= 2;
+      builder_path_cache.items = (path_cache_entry_t *)calloc(builder_path_cache.size, sizeof(path_cache_entry_t));
+
+      for (size_t i = 0; i < old.size; i++) {
+        if (old.items[i].name) {
+          *builder_path_cache_slot(old.items[i].name) = old.items[i];
+        }
+      }
+
+      free(old.items);
+
+      entry = builder_path_cache_slot(name);
+    }
+
+    entry->name = strdup(name);
+    entry->path = found ? strdup(output_buffer) : NULL;
+
+    builder_path_cache.current++;
+
+    return found;
+  }
+
+  if (!entry->path) {
+    *output_buffer = 0;
+
+    return false;
+  }
+
+  memcpy(output_buffer, entry->path, strlen(entry->path) + 1);
+
+  return true;
+});
+
+/**
+ * @brief Resolves a list of executables ahead of time (e.g., the toolchain at startup),
+ * so later commands don't search PATH.
+ * @param names The names of the executables, ending with NULL (e.g., `StringArrayN("cc", "ar")`).
+ * @return The number of executables that weren't found in PATH.
+ */
+size_t builder_preresolve(char **names) impl({
+  char path[PATH_MAX];
+  size_t missing = 0;
+
+  for (size_t i = 0; names[i]; i++) {
+    if (!find_executable(names[i], path)) {
+      warn("%s wasn't found in PATH", names[i]);
+
+      missing++;
+    }
+  }
+
+  return missing;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////// Files ////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief A list of paths, e.g. the result of `glob_files`, allocated from one arena. */
+typedef struct path_list_t {
+  /** @brief The paths, ending with NULL once something was added. */
+  char **items;
+  /** @brief The number of paths. */
+  size_t count,
+  /** @brief The allocated capacity of `items`. */
+         size;
+  /** @brief The arena the paths and `items` are allocated from. */
+  arena_t arena;
+} path_list_t;
+
+/**
+ * @brief Appends a path to a list. It is copied.
+ * @param list The list to append to.
+ * @param path The path.
+ */
+void path_list_push(path_list_t *list, const char *path) impl({
+  // One more for the NULL terminator
+  if (list->size <= list->count + 1) {
+    size_t size = list->size ? list->size * 2 : 64;
+
+    list->items = (char **)arena_grow(&list->arena, list->items, sizeof(char *) * list->size, sizeof(char *) * size);
+    list->size = size;
+  }
+
+  list->items[list->count++] = arena_strdup(&list->arena, path);
+  list->items[list->count] = NULL;
+});
+
+/**
+ * @brief Frees a list of paths. It can be used again afterwards.
+ * @param list The list.
+ */
+void path_list_free(path_list_t *list) impl({
+  arena_release(&list->arena);
+
+  *list = (path_list_t){0};
+});
+
+/** @brief `true` if the build script keeps running and rebuilds when its inputs change (`--watch`). */
+impl_global(bool builder_watch_requested, false);
+
+/** @brief The directories read by `glob_files` and `list_files` during this run, recorded in watch mode. */
+impl_global(path_list_t builder_watch_dirs, {0});
+
+impl(
+  /**
+   * @brief The state of a directory walk, shared by the recursive calls.
+   */
+  typedef struct builder_walk_t {
+    /** @brief The list that matching files are added to. */
+    path_list_t *list;
+    /** @brief The components of the pattern below the directory the walk started in. */
+    char **components;
+    /** @brief The number of components. */
+    size_t count;
+    /** @brief The path of the current directory, as given to the walk. */
+    char path[PATH_MAX];
+  } builder_walk_t;
+
+  /**
+   * @brief Appends a name to the path of the walk.
+   * @return The length of the path before the name was appended, to be restored, or -1 if the path is too long.
+   */
+  static int builder_walk_enter(builder_walk_t *walk, const char *name) {
+    size_t length = strlen(walk->path);
+    int written = snprintf(walk->path + length, sizeof(walk->path) - length, "%s%s",
+        length == 0 || walk->path[length - 1] == '/' ? "" : "/", name);
+
+    if (written < 0 || (size_t)written >= sizeof(walk->path) - length) {
+      walk->path[length] = '\0';
+
+      return -1;
+    }
+
+    return (int)length;
+  }
+
+  /**
+   * @brief Checks whether a directory entry is a directory, without following symbolic links.
+   */
+  static bool builder_walk_is_dir(int dirfd, const struct dirent *entry) {
+    struct stat st;
+
+#ifdef DT_DIR
+    if (entry->d_type != DT_UNKNOWN)
+      return entry->d_type == DT_DIR;
+#endif
+
+    return fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+  }
+
+  static void builder_walk_dir(builder_walk_t *walk, int dirfd, size_t index);
+
+  /**
+   * @brief Matches the components of the pattern from `index` on in a subdirectory of the walk.
+   */
+  static void builder_walk_subdir(builder_walk_t *walk, int dirfd, const char *name, size_t index) {
+    int length = builder_walk_enter(walk, name);
+
+    if (length < 0)
+      return;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd != -1) {
+      builder_walk_dir(walk, fd, index);
+      close(fd);
+    }
+
+    walk->path[length] = '\0';
+  }
+
+  /**
+   * @brief Adds a file of the walk's current directory to the results, and memoizes its `stat`.
+   */
+  static void builder_walk_file(builder_walk_t *walk, int dirfd, const char *name) {
+    struct stat st;
+    int length = builder_walk_enter(walk, name);
+
+    if (length < 0)
+      return;
+
+    // Stat'ed relative to the open directory, the staleness checks that follow reuse the result
+    if (fstatat(dirfd, name, &st, 0) == 0 && !S_ISDIR(st.st_mode)) {
+      builder_stat_store(walk->path, &st);
+      path_list_push(walk->list, walk->path);
+    }
+
+    walk->path[length] = '\0';
+  }
+
+  /**
+   * @brief Matches the components of the pattern from `index` on in a directory.
+   */
+  static void builder_walk_dir(builder_walk_t *walk, int dirfd, size_t index) {
+    const char *component = walk->components[index];
+    bool last = index + 1 == walk->count;
+
+    // Names without wildcards are opened directly, there's no need to read the directory
+    if (strcmp(component, "**") != 0 && !strpbrk(component, "*?[")) {
+      if (last) {
+        builder_walk_file(walk, dirfd, component);
+      } else {
+        builder_walk_subdir(walk, dirfd, component, index + 1);
+      }
+
+      return;
+    }
+
+    // "**" matches no directory at all as well
+    if (strcmp(component, "**") == 0 && !last) {
+      builder_walk_dir(walk, dirfd, index + 1);
+    }
+
+    // A file created here later changes what the pattern matches
+    if (builder_watch_requested) {
+      path_list_push(&builder_watch_dirs, walk->path[0] ? walk->path : ".");
+    }
+
+    // A descriptor of its own, so the recursion above doesn't share its read position
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+
+    if (!dir) {
+      if (fd != -1) close(fd);
+
+      return;
+    }
+
+    struct dirent *entry;
+
+    // The directory streams read the entries in batches (getdents64 on Linux)
+    while ((entry = readdir(dir))) {
+      const char *name = entry->d_name;
+
+      // Hidden files are skipped unless the component asks for them, like in the shell
+      if (name[0] == '.' && (component[0] != '.' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+        continue;
+
+      if (strcmp(component, "**") == 0) {
+        // A trailing "**" matches every file below the directory
+        if (last && !builder_walk_is_dir(dirfd, entry)) {
+          builder_walk_file(walk, dirfd, name);
+        } else if (builder_walk_is_dir(dirfd, entry)) {
+          builder_walk_subdir(walk, dirfd, name, index);
+        }
+      } else if (fnmatch(component, name, FNM_PERIOD) == 0) {
+        if (last) {
+          builder_walk_file(walk, dirfd, name);
+        } else {
+          builder_walk_subdir(walk, dirfd, name, index + 1);
+        }
+      }
+    }
+
+    closedir(dir);
+  }
+
+  /**
+   * @brief Orders paths for `qsort`.
+   */
+  static int builder_path_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+  }
+
+  /**
+   * @brief Sorts the paths of a list from `start` on and removes the duplicates among them.
+   */
+  static void builder_path_list_sort(path_list_t *list, size_t start) {
+    qsort(list->items + start, list->count - start, sizeof(char *), builder_path_compare);
+
+    size_t kept = start;
+
+    for (size_t i = start; i < list->count; i++) {
+      if (kept == start || strcmp(list->items[kept - 1], list->items[i]) != 0) {
+        list->items[kept++] = list->items[i];
+      }
+    }
+
+    list->count = kept;
+
+    if (list->items) {
+      list->items[list->count] = NULL;
+    }
+  }
+
+  /**
+   * @brief Walks a directory, adding the files matching the pattern components to a list.
+   * @return The number of paths added.
+   */
+  static size_t builder_walk(path_list_t *list, const char *root, char **components, size_t count) {
+    builder_walk_t walk = { .list = list, .components = components, .count = count };
+    size_t start = list->count;
+
+    snprintf(walk.path, sizeof(walk.path), "%s", root);
+
+    int fd = open(root[0] ? root : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1) {
+      return 0;
+    }
+
+    builder_walk_dir(&walk, fd, 0);
+    close(fd);
+
+    // Sorted, so the order of commands doesn't depend on the directory order of the file system.
+    // Patterns with several "**" can match a path more than once
+    builder_path_list_sort(list, start);
+
+    return list->count - start;
+  }
+)
+
+/**
+ * @brief Adds the files matching a glob pattern to a list, sorted.
+ *
+ * Each component of the pattern is matched with `fnmatch` (`*`, `?`, `[...]`), and a `**`
+ * component matches any number of directories (e.g., to find the C files in every subdirectory
+ * of src, at any depth). Hidden files and directories are only matched by components starting
+ * with a dot, symbolic links to directories aren't followed by `**`, and only files that aren't
+ * directories are returned. The files found are stat'ed once and memoized for `builder_stat`.
+ * @param list The list to add the paths to.
+ * @param pattern The pattern, relative to the working directory or absolute.
+ * @return The number of paths added.
+ */
+size_t glob_files(path_list_t *list, const char *pattern) impl({
+  char buffer[PATH_MAX], *components[PATH_MAX / 2], root[PATH_MAX] = "";
+  size_t count = 0, literal = 0;
+
+  if (snprintf(buffer, sizeof(buffer), "%s", pattern) >= (int)sizeof(buffer)) {
+    return 0;
+  }
+
+  if (buffer[0] == '/') {
+    strcpy(root, "/");
+  }
+
+  char *saveptr = NULL;
+
+  // Reentrant, so callers can glob while splitting their own strings
+  for (char *component = strtok_r(buffer, "/", &saveptr); component; component = strtok_r(NULL, "/", &saveptr)) {
+    components[count++] = component;
+  }
+
+  // The leading components without wildcards are where the walk starts
+  while (literal + 1 < count && strcmp(components[literal], "**") != 0 && !strpbrk(components[literal], "*?[")) {
+    size_t length = strlen(root);
+
+    snprintf(root + length, sizeof(root) - length, "%s%s", length == 0 || root[length - 1] == '/' ? "" : "/", components[literal]);
+
+    literal++;
+  }
+
+  if (count == 0) {
+    return 0;
+  }
+
+  return builder_walk(list, root, components + literal, count - literal);
+});
+
+/**
+ * @brief Adds the files of a directory to a list, sorted. Hidden files are skipped.
+ * @param list The list to add the paths to.
+ * @param dir The directory.
+ * @param recursive `true` to add the files of its subdirectories as well.
+ * @return The number of paths added.
+ */
+size_t list_files(path_list_t *list, const char *dir, bool recursive) impl({
+  static char *all[] = { "*" }, *below[] = { "**" };
+
+  return builder_walk(list, dir, recursive ? below : all, 1);
+});
+
+/** @brief A file written through a temporary file next to it, see `atomic_file_open`. */
+typedef struct atomic_file_t {
+  /** @brief The temporary file to write to. */
+  FILE *file;
+  /** @brief The path of the file to replace. */
+  char path[PATH_MAX],
+  /** @brief The path of the temporary file, in the same directory. */
+       tmp[PATH_MAX];
+} atomic_file_t;
+
+impl(
+  /**
+   * @brief Checks whether an open file has the same contents as a path.
+   * @return `true` if both have the same size and bytes, `false` if they differ or the path can't be read.
+   */
+  static bool builder_file_equals(int fd, const char *path) {
+    char a[16 * 1024], b[sizeof(a)];
+    struct stat st_a, st_b;
+    bool equal = false;
+    int other = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (other == -1) {
+      return false;
+    }
+
+    if (fstat(fd, &st_a) == 0 && fstat(other, &st_b) == 0 && st_a.st_size == st_b.st_size &&
+        lseek(fd, 0, SEEK_SET) == 0) {
+      ssize_t len = 0;
+
+      equal = true;
+
+      while (equal && (len = read(fd, a, sizeof(a))) > 0) {
+        equal = read(other, b, (size_t)len) == len && memcmp(a, b, (size_t)len) == 0;
+      }
+
+      equal = equal && len == 0;
+    }
+
+    close(other);
+
+    return equal;
+  }
+)
+
+/**
+ * @brief Starts writing a file atomically: the data goes to a temporary file in the same
+ * directory, which replaces the file only once `atomic_file_commit` is called.
+ * @param file The atomic file to set up.
+ * @param path The path of the file to write.
+ * @return `true` on success, `false` if the temporary file couldn't be created.
+ * @example
+ * atomic_file_t out;
+ *
+ * if (atomic_file_open(&out, "build/gen/version.h")) {
+ *   fprintf(out.file, "#define VERSION \"%s\"\n", version);
+ *   atomic_file_commit(&out);
+ * }
+ */
+bool atomic_file_open(atomic_file_t *file, const char *path) impl({
+  struct stat st;
+  mode_t mode;
+
+  *file = (atomic_file_t){0};
+
+  if (snprintf(file->path, sizeof(file->path), "%s", path) >= (int)sizeof(file->path) ||
+      snprintf(file->tmp, sizeof(file->tmp), "%s.XXXXXX", path) >= (int)sizeof(file->tmp)) {
+    error("couldn't write %s: path too long", path);
+
+    return false;
+  }
+
+  int fd = mkstemp(file->tmp);
+
+  if (fd == -1) {
+    error("couldn't write %s: %s", file->tmp, strerror(errno));
+
+    return false;
+  }
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // mkstemp creates the file private, give it the mode a plain fopen would (or the replaced file's)
+  if (stat(path, &st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode = umask(0);
+    umask(mode);
+    mode = 0666 & ~mode;
+  }
+
+  fchmod(fd, mode);
+
+  if (!(file->file = fdopen(fd, "w+b"))) {
+    error("couldn't write %s: %s", file->tmp, strerror(errno));
+
+    close(fd);
+    unlink(file->tmp);
+
+    return false;
+  }
+
+  return true;
+});
+
+/**
+ * @brief Discards a file started with `atomic_file_open`, leaving the original file as it was.
+ * @param file The atomic file.
+ */
+void atomic_file_abort(atomic_file_t *file) impl({
+  if (file->file) {
+    fclose(file->file);
+    unlink(file->tmp);
+
+    file->file = NULL;
+  }
+});
+
+/**
+ * @brief Replaces the file with what was written to an atomic file.
+ *
+ * When the new contents are the same as the file's, the file is left untouched, so its
+ * modification time doesn't move and nothing reading it is considered out of date.
+ * @param file The atomic file, closed by this call.
+ * @return `true` on success, `false` if the file couldn't be written (it is left as it was).
+ */
+bool atomic_file_commit(atomic_file_t *file) impl({
+  if (!file->file) {
+    return false;
+  }
+
+  if (fflush(file->file) != 0 || ferror(file->file)) {
+    error("couldn't write %s: %s", file->tmp, strerror(errno));
+    atomic_file_abort(file);
+
+    return false;
+  }
+
+  if (builder_file_equals(fileno(file->file), file->path)) {
+    atomic_file_abort(file);
+
+    return true;
+  }
+
+  bool ok = fclose(file->file) == 0 && rename(file->tmp, file->path) == 0;
+
+  file->file = NULL;
+
+  if (!ok) {
+    error("couldn't write %s: %s", file->path, strerror(errno));
+    unlink(file->tmp);
+  }
+
+  builder_stat_invalidate(file->path);
+
+  return ok;
+});
+
+/**
+ * @brief Writes a file atomically, unless it already has these contents (see `atomic_file_commit`).
+ * @param path The path of the file.
+ * @param data The new contents of the file.
+ * @param len The length of `data`, in bytes.
+ * @return `true` on success, `false` if the file couldn't be written.
+ */
+bool write_file(const char *path, const void *data, size_t len) impl({
+  atomic_file_t file;
+
+  if (!atomic_file_open(&file, path)) {
+    return false;
+  }
+
+  if (fwrite(data, 1, len, file.file) != len) {
+    error("couldn't write %s: %s", file.tmp, strerror(errno));
+    atomic_file_abort(&file);
+
+    return false;
+  }
+
+  return atomic_file_commit(&file);
+});
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////// Build state /////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief The directory where the builder keeps its state between runs, relative to the
+ * directory the build script runs in. Can be defined before including builder.h.
+ */
+#ifndef BUILDER_STATE_DIR
+#define BUILDER_STATE_DIR ".builder"
+#endif
+
+/** @brief The version of the state database format, bumped whenever records change meaning. */
+#define BUILDER_STATE_VERSION 2
+
+/** @brief The magic number at the start of the state database ("BDB1"). */
+#define BUILDER_DB_MAGIC 0x31424442u
+
+/**
+ * @brief How many bytes of replaced records the state database may hold before it is compacted,
+ * on top of as many as its current records take. Can be defined before including builder.h.
+ */
+#ifndef BUILDER_DB_SLACK
+#define BUILDER_DB_SLACK (64 * 1024)
+#endif
+
+/** @brief State record kind: the signature of an input file (mtime in ns, size, content hash, inode). */
+#define STATE_FILE 'F'
+/** @brief State record kind: the last successful build of a target (action hash, mtime in ns, size, deps hash). */
+#define STATE_TARGET 'T'
+/** @brief State record kind: the last successful run of a command (peak memory in bytes, wall and user CPU time in ns). */
+#define STATE_COMMAND 'C'
+
+/** @brief A record of the persistent build state, identified by its kind and key. */
+typedef struct state_record_t {
+  /** @brief The kind of the record (e.g., `STATE_FILE`), or 0 if the slot is empty. */
+  char kind;
+  /** @brief The key of the record, usually a path. */
+  char *key;
+  /** @brief The values of the record, their meaning depends on `kind`. */
+  uint64_t values[4];
+  /** @brief `true` if the record changed since it was last written to the state database. */
+  bool dirty;
+} state_record_t;
+
+/** @brief The persistent build state, an open-addressing hash table of records. */
+typedef struct build_state_t {
+  /** @brief The number of slots in the table, always a power of two. */
+  size_t size,
+  /** @brief The number of used slots. */
+         current;
+  /** @brief The slots of the table. */
+  state_record_t *items;
+  /** @brief The state database as it was when it was loaded, mapped read-only, or NULL. Keys point into it. */
+  char *map;
+  /** @brief The size of `map`, in bytes. */
+  size_t map_size,
+  /** @brief The size of the valid part of the state database, where new records are appended. */
+         file_size;
+  /** @brief `true` once the state database was read. */
+  bool loaded,
+  /** @brief `true` if a record changed since the state database was written. */
+       dirty;
+} build_state_t;
+
+/** @brief The build state of this run, loaded on first use and saved when the build ends. */
+impl_global(build_state_t builder_state, {0});
+
+/**
+ * @brief Checks whether a pointer points into the mapping of the state database.
+ * @param pointer The pointer, e.g. the key of a record.
+ * @return `true` if it does, so it must not be freed.
+ */
+bool builder_state_mapped(const void *pointer) impl({
+  return builder_state.map && (const char *)pointer >= builder_state.map &&
+         (const char *)pointer < builder_state.map + builder_state.map_size;
+});
+
+/**
+ * @brief Finds the slot of a record in the state table.
+ * @param kind The kind of the record.
+ * @param key The key of the record.
+ * @return The slot holding the record, or the empty slot where it should be inserted.
+ */
+state_record_t *builder_state_slot(char kind, const char *key) impl({
+  size_t mask = builder_state.size - 1;
+  size_t i = (builder_hash_string(key) ^ (uint64_t)(unsigned char)kind) & mask;
+
+  while (builder_state.items[i].kind &&
+         (builder_state.items[i].kind != kind || strcmp(builder_state.items[i].key, key) != 0)) {
+    i = (i + 1) & mask;
+  }
+
+  return &builder_state.items[i];
+});
+
+/**
+ * @brief Inserts a record in the state table, without marking the state as changed.
+ * @param kind The kind of the record.
+ * @param key The key of the record. It is copied, unless it points into the state database.
+ * @return The new or existing record with that kind and key.
+ */
+state_record_t *builder_state_insert(char kind, const char *key) impl({
+  if (!builder_state.items || (builder_state.current + 1) * 2 > builder_state.size) {
+    build_state_t old = builder_state;
+
+    builder_state.size = old.size ? old.size * 2 : 256;
+    builder_state.items = (state_record_t *)calloc(builder_state.size, sizeof(state_record_t));
+
+    for (size_t i = 0; i < old.size; i++) {
+      if (old.items[i].kind) {
+        *builder_state_slot(old.items[i].kind, old.items[i].key) = old.items[i];
+      }
+    }
+
+    free(old.items);
+  }
+
+  state_record_t *record = builder_state_slot(kind, key);
+
+  if (!record->kind) {
+    record->kind = kind;
+    record->key = builder_state_mapped(key) ? (char *)key : strdup(key);
+
+    builder_state.current++;
+  }
+
+  return record;
+});
+
+/** @brief The dependencies of a target, as read from its depfile. */
+typedef struct deps_entry_t {
+  /** @brief The path of the target, or NULL if the slot is empty. */
+  char *target;
+  /** @brief The dependencies, NUL-separated in a single allocation. */
+  char *blob;
+  /** @brief The size of `blob`, in bytes. */
+  uint32_t blob_len,
+  /** @brief The number of dependencies in `blob`. */
+           count;
+  /** @brief `true` if the entry changed since it was last written to the state database. */
+  bool dirty;
+} deps_entry_t;
+
+/** @brief The dependency database, an open-addressing hash table of targets. */
+typedef struct deps_db_t {
+  /** @brief The number of slots in the table, always a power of two. */
+  size_t size,
+  /** @brief The number of used slots. */
+         current;
+  /** @brief The slots of the table. */
+  deps_entry_t *items;
+  /** @brief `true` if an entry changed since the state database was written. */
+  bool dirty;
+} deps_db_t;
+
+/** @brief The dependency database of this run, kept in the state database with the build state. */
+impl_global(deps_db_t builder_deps, {0});
+
+/**
+ * @brief Finds the slot of a target in the dependency database.
+ * @param target The path of the target.
+ * @return The slot holding the target, or the empty slot where it should be inserted.
+ */
+deps_entry_t *builder_deps_slot(const char *target) impl({
+  size_t mask = builder_deps.size - 1;
+  size_t i = builder_hash_string(target) & mask;
+
+  while (builder_deps.items[i].target && strcmp(builder_deps.items[i].target, target) != 0) {
+    i = (i + 1) & mask;
+  }
+
+  return &builder_deps.items[i];
+});
+
+/**
+ * @brief Replaces the dependencies of a target in the database.
+ * @param target The path of the target. It is copied, unless it points into the state database.
+ * @param blob The NUL-separated dependencies. The database takes ownership of it, unless it points
+ * into the state database.
+ * @param blob_len The size of `blob`, in bytes.
+ * @param count The number of dependencies in `blob`.
+ */
+void builder_deps_store(const char *target, char *blob, uint32_t blob_len, uint32_t count) impl({
+  if (!builder_deps.items || (builder_deps.current + 1) * 2 > builder_deps.size) {
+    deps_db_t old = builder_deps;
+
+    builder_deps.size = old.size ? old.size * 2 : 256;
+    builder_deps.items = (deps_entry_t *)calloc(builder_deps.size, sizeof(deps_entry_t));
+
+    for (size_t i = 0; i < old.size; i++) {
+      if (old.items[i].target) {
+        *builder_deps_slot(old.items[i].target) = old.items[i];
+      }
+    }
+
+    free(old.items);
+  }
+
+  deps_entry_t *entry = builder_deps_slot(target);
+
+  if (!entry->target) {
+    entry->target = builder_state_mapped(target) ? (char *)target : strdup(target);
+    builder_deps.current++;
+  } else if (!builder_state_mapped(entry->blob)) {
+    free(entry->blob);
+  }
+
+  entry->blob = blob;
+  entry->blob_len = blob_len;
+  entry->count = count;
+});
+
+/** @brief Record kind of the state database for the dependencies of a target (see `builder_deps_ingest`). */
+#define BUILDER_DB_DEPS 'D'
+
+/**
+ * @brief A record of the state database, followed by its key, its data and zeros up to a multiple of 8 bytes.
+ *
+ * The database (`BUILDER_STATE_DIR/db`) starts with `BUILDER_DB_MAGIC` and `BUILDER_STATE_VERSION`
+ * as two 32-bit words. Records are only appended to it, a later record replacing an earlier one
+ * with the same kind and key, until the file is compacted.
+ */
+typedef struct db_record_t {
+  /** @brief The kind of the record, a `STATE_*` kind or `BUILDER_DB_DEPS`. */
+  uint32_t kind,
+  /** @brief The length of the key, including its NUL terminator. */
+           key_len,
+  /** @brief The length of the data following the key: the values of a state record, or the blob of a deps entry. */
+           data_len,
+  /** @brief The number of dependencies of a deps entry, 0 for state records. */
+           count;
+} db_record_t;
+
+/**
+ * @brief Reads the state database of the previous run, if there is one.
+ *
+ * The file is mapped read-only and indexed in place: keys and dependency lists point into the
+ * mapping, which stays valid for the rest of the run. A record cut short by an interrupted run
+ * ends the database, it is overwritten by the next save. This is done automatically the first
+ * time the state is used.
+ */
+void builder_state_load() impl({
+  struct stat st;
+  uint32_t header[2];
+
+  if (builder_state.loaded) {
+    return;
+  }
+
+  builder_state.loaded = true;
+
+  int fd = open(BUILDER_STATE_DIR "/db", O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return;
+  }
+
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header)) {
+    close(fd);
+
+    return;
+  }
+
+  char *map = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  memcpy(header, map, sizeof(header));
+
+  if (header[0] != BUILDER_DB_MAGIC || header[1] != BUILDER_STATE_VERSION) {
+    // Unknown format, start over with an empty state that replaces it on save
+    munmap(map, (size_t)st.st_size);
+
+    return;
+  }
+
+  builder_state.map = map;
+  builder_state.map_size = (size_t)st.st_size;
+
+  size_t offset = sizeof(header);
+
+  while (offset + sizeof(db_record_t) <= builder_state.map_size) {
+    db_record_t record;
+
+    memcpy(&record, map + offset, sizeof(record));
+
+    const char *key = map + offset + sizeof(record);
+    char *data = (char *)key + record.key_len;
+    size_t end = (offset + sizeof(record) + record.key_len + record.data_len + 7) & ~(size_t)7;
+
+    if (end > builder_state.map_size || record.key_len == 0 || key[record.key_len - 1] != '\0') {
+      break;
+    }
+
+    if (record.kind == BUILDER_DB_DEPS) {
+      builder_deps_store(key, data, record.data_len, record.count);
+    } else if (record.data_len == sizeof(((state_record_t *)NULL)->values)) {
+      memcpy(builder_state_insert((char)record.kind, key)->values, data, record.data_len);
+    }
+
+    offset = end;
+  }
+
+  builder_state.file_size = offset;
+});
+
+/**
+ * @brief Gets a record of the build state.
+ * @param kind The kind of the record (e.g., `STATE_FILE`).
+ * @param key The key of the record.
+ * @return The record, or NULL if there is none.
+ */
+state_record_t *builder_state_get(char kind, const char *key) impl({
+  builder_state_load();
+
+  if (!builder_state.items) {
+    return NULL;
+  }
+
+  state_record_t *record = builder_state_slot(kind, key);
+
+  return record->kind ? record : NULL;
+});
+
+/**
+ * @brief Creates or replaces a record of the build state. It is saved by `builder_state_save`.
+ * @param kind The kind of the record (e.g., `STATE_FILE`).
+ * @param key The key of the record. It is copied.
+ * @param values The values of the record.
+ * @return The stored record.
+ */
+state_record_t *builder_state_put(char kind, const char *key, const uint64_t values[4]) impl({
+  builder_state_load();
+
+  state_record_t *record = builder_state_insert(kind, key);
+
+  memcpy(record->values, values, sizeof(record->values));
+  record->dirty = true;
+  builder_state.dirty = true;
+
+  return record;
+});
+
+/**
+ * @brief Gets the content hash of a file, reusing the recorded one if the file's
+ * modification time (in nanoseconds), size and inode didn't change.
+ * @param path The path of the file.
+ * @param hash Where to store the hash of the file.
+ * @return `true` on success, `false` if the file doesn't exist or couldn't be read.
+ */
+bool builder_file_hash(const char *path, uint64_t *hash) impl({
+  struct stat st;
+
+  if (!builder_stat(path, &st)) {
+    return false;
+  }
+
+  uint64_t values[4] = { builder_stat_mtime_ns(&st), (uint64_t)st.st_size, 0, (uint64_t)st.st_ino };
+  state_record_t *record = builder_state_get(STATE_FILE, path);
+
+  if (record && record->values[0] == values[0] && record->values[1] == values[1] &&
+      record->values[3] == values[3]) {
+    *hash = record->values[2];
+
+    return true;
+  }
+
+  if (!hash_file(path, &values[2])) {
+    return false;
+  }
+
+  builder_state_put(STATE_FILE, path, values);
+
+  *hash = values[2];
+
+  return true;
+});
+
+/**
+ * @brief Called by `depfile_parse` for every target of the rules of a depfile.
+ * @param target The target.
+ * @param deps The dependencies of the target, valid only during the call.
+ * @param deps_count The number of dependencies.
+ * @param data The user data given to `depfile_parse`.
+ */
+typedef void (*depfile_rule_fn)(const char *target, char **deps, size_t deps_count, void *data);
+
+/**
+ * @brief Parses a Makefile-style depfile, as written by GCC and Clang with `-MD`/`-MMD`.
+ *
+ * The file is streamed in fixed-size chunks. Escaped spaces (`\ `), `\#`, `$$` and line
+ * continuations are handled, and each rule is reported once all its dependencies were read,
+ * once for each of its targets.
+ * @param path The path of the depfile.
+ * @param on_rule The function called for every target of every rule.
+ * @param data User data passed to `on_rule`.
+ * @return `true` on success, `false` if the file couldn't be read.
+ */
+bool depfile_parse(const char *path, depfile_rule_fn on_rule, void *data) impl({
+  char chunk[16 * 1024];
+  char *token = NULL;
+  size_t token_len = 0, token_size = 0;
+  char **targets = NULL, **deps = NULL;
+  size_t targets_count = 0, targets_size = 0, deps_count = 0, deps_size = 0;
+  bool escaped = false, dollar = false, continued_cr = false, eof = false, ok = true;
+  // `true` once the ':' of the current rule was read, the next tokens are dependencies
+  bool in_deps = false;
+  ssize_t len = 0, pos = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return false;
+  }
+
+  while (!eof) {
+    int c;
+
+    if (pos == len) {
+      len = read(fd, chunk, sizeof(chunk));
+      pos = 0;
+
+      if (len == -1 && errno == EINTR) {
+        len = 0;
+        continue;
+      }
+
+      if (len <= 0) {
+        ok = len == 0;
+        eof = true;
+        len = 0;
+      }
+    }
+
+    // A NUL stands for the end of the file, so the last token and rule are flushed
+    c = eof ? '\0' : chunk[pos++];
+
+    if (continued_cr) {
+      continued_cr = false;
+
+      // The '\n' of a "\\\r\n" continuation
+      if (c == '\n') {
+        continue;
+      }
+    }
+
+    if (escaped) {
+      escaped = false;
+
+      if (c == '\n' || c == '\r') {
+        // Line continuation, acts as whitespace
+        continued_cr = c == '\r';
+        c = ' ';
+      } else if (c == ' ' || c == '#' || c == '\\') {
+        goto append;
+      } else {
+        // Not an escape sequence, keep the backslash
+        if (token_len + 1 >= token_size) {
+          token_size = (token_size + 16) * 2;
+          token = (char *)realloc(token, token_size);
+        }
+
+        token[token_len++] = '\\';
+      }
+    } else if (dollar) {
+      dollar = false;
+
+      if (c == '$') {
+        goto append;
+      }
+
+      if (token_len + 1 >= token_size) {
+        token_size = (token_size + 16) * 2;
+        token = (char *)realloc(token, token_size);
+      }
+
+      token[token_len++] = '$';
+    }
+
+    if (c == '\\') {
+      escaped = true;
+      continue;
+    }
+
+    if (c == '$') {
+      dollar = true;
+      continue;
+    }
+
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\0') {
+      if (token_len > 0) {
+        token[token_len] = '\0';
+
+        if (!in_deps) {
+          if (targets_size <= targets_count) {
+            targets_size = (targets_size + 1) * 2;
+            targets = (char **)realloc(targets, sizeof(char *) * targets_size);
+          }
+
+          targets[targets_count++] = strdup(token);
+        } else {
+          if (deps_size <= deps_count) {
+            deps_size = (deps_size + 1) * 2;
+            deps = (char **)realloc(deps, sizeof(char *) * deps_size);
+          }
+
+          deps[deps_count++] = strdup(token);
+        }
+
+        token_len = 0;
+      }
+
+      if ((c == '\n' || c == '\0') && targets_count > 0) {
+        // Every target of a rule (e.g. "a.o b.o: x.c") depends on all of its dependencies
+        for (size_t i = 0; i < targets_count; i++) {
+          on_rule(targets[i], deps, deps_count, data);
+          free(targets[i]);
+        }
+
+        for (size_t i = 0; i < deps_count; i++) {
+          free(deps[i]);
+        }
+
+        targets_count = 0;
+        deps_count = 0;
+      }
+
+      if (c == '\n' || c == '\0') {
+        in_deps = false;
+      }
+
+      continue;
+    }
+
+    if (c == ':' && !in_deps) {
+      // A ':' ends the targets, the token before it is the last one
+      if (token_len > 0) {
+        token[token_len] = '\0';
+
+        if (targets_size <= targets_count) {
+          targets_size = (targets_size + 1) * 2;
+          targets = (char **)realloc(targets, sizeof(char *) * targets_size);
+        }
+
+        targets[targets_count++] = strdup(token);
+        token_len = 0;
+      }
+
+      in_deps = true;
+
+      continue;
+    }
+
+append:
+    if (token_len + 1 >= token_size) {
+      token_size = (token_size + 16) * 2;
+      token = (char *)realloc(token, token_size);
+    }
+
+    token[token_len++] = (char)c;
+  }
+
+  free(token);
+  free(targets);
+  free(deps);
+  close(fd);
+
+  return ok;
+});
+
+/**
+ * @brief Gets the dependencies of a target recorded from its depfile.
+ * @param target The path of the target.
+ * @return The entry of the target, or NULL if none was recorded.
+ */
+deps_entry_t *builder_deps_get(const char *target) impl({
+  builder_state_load();
+
+  if (!builder_deps.items) {
+    return NULL;
+  }
+
+  deps_entry_t *entry = builder_deps_slot(target);
+
+  return entry->target ? entry : NULL;
+});
+
+impl(
+  /** @brief The targets of a depfile being read, with the dependencies of all their rules so far. */
+  typedef struct deps_ingest_t {
+    /** @brief The targets, with their NUL-separated dependencies. */
+    deps_entry_t *items;
+    /** @brief The number of targets, and the capacity of `items`. */
+    size_t count, size;
+  } deps_ingest_t;
+
+  /**
+   * @brief Adds the dependencies of a depfile rule to its target, like make does for a target listed in several rules.
+   */
+  static void builder_deps_on_rule(const char *target, char **deps, size_t deps_count, void *data) {
+    deps_ingest_t *ingest = (deps_ingest_t *)data;
+    deps_entry_t *entry = NULL;
+    uint32_t blob_len = 0;
+
+    // Phony rules from -MP have no dependencies and don't describe a target
+    if (deps_count == 0) {
+      return;
+    }
+
+    for (size_t i = 0; i < ingest->count && !entry; i++) {
+      if (strcmp(ingest->items[i].target, target) == 0) {
+        entry = &ingest->items[i];
+      }
+    }
+
+    if (!entry) {
+      if (ingest->size <= ingest->count) {
+        ingest->size = (ingest->size + 1) * 2;
+        ingest->items = (deps_entry_t *)realloc(ingest->items, sizeof(deps_entry_t) * ingest->size);
+      }
+
+      entry = &ingest->items[ingest->count++];
+      *entry = (deps_entry_t){ .target = strdup(target) };
+    }
+
+    for (size_t i = 0; i < deps_count; i++) {
+      blob_len += (uint32_t)strlen(deps[i]) + 1;
+    }
+
+    entry->blob = (char *)realloc(entry->blob, entry->blob_len + blob_len);
+
+    char *out = entry->blob + entry->blob_len;
+
+    for (size_t i = 0; i < deps_count; i++) {
+      size_t len = strlen(deps[i]) + 1;
+
+      memcpy(out, deps[i], len);
+      out += len;
+    }
+
+    entry->blob_len += blob_len;
+    entry->count += (uint32_t)deps_count;
+  }
+)
+
+/**
+ * @brief Reads a depfile and records the dependencies of each of its targets.
+ * @param depfile The path of the depfile (e.g., "build/foo.d").
+ * @return `true` on success, `false` if the depfile couldn't be read.
+ */
+bool builder_deps_ingest(const char *depfile) impl({
+  deps_ingest_t ingest = {0};
+
+  builder_state_load();
+
+  bool ok = depfile_parse(depfile, builder_deps_on_rule, &ingest);
+
+  // Stored once all the rules of a target were read, and only if they changed
+  for (size_t i = 0; i < ingest.count; i++) {
+    deps_entry_t *item = &ingest.items[i], *entry = builder_deps_get(item->target);
+
+    if (entry && entry->blob_len == item->blob_len && memcmp(entry->blob, item->blob, item->blob_len) == 0) {
+      free(item->blob);
+    } else {
+      builder_deps_store(item->target, item->blob, item->blob_len, item->count);
+      builder_deps_get(item->target)->dirty = true;
+      builder_deps.dirty = true;
+    }
+
+    free(item->target);
+  }
+
+  free(ingest.items);
+
+  return ok;
+});
+
+/**
+ * @brief Finds the depfile a compiler command writes, from its `-MF`, `-MD`/`-MMD` and `-o` flags.
+ * @param argv The argument vector of the command, ending with NULL.
+ * @param output_buffer A buffer of at least `PATH_MAX` size to store the path of the depfile.
+ * @return `true` if the command writes a depfile, `false` otherwise.
+ */
+bool builder_command_depfile(char **argv, char output_buffer[PATH_MAX]) impl({
+  const char *output = NULL, *depfile = NULL;
+  bool writes_deps = false;
+
+  for (size_t i = 1; argv[i]; i++) {
+    if (strcmp(argv[i], "-MD") == 0 || strcmp(argv[i], "-MMD") == 0) {
+      writes_deps = true;
+    } else if (strncmp(argv[i], "-MF", 3) == 0) {
+      depfile = argv[i][3] ? &argv[i][3] : argv[i + 1];
+    } else if (strncmp(argv[i], "-o", 2) == 0) {
+      output = argv[i][2] ? &argv[i][2] : argv[i + 1];
+    }
+  }
+
+  if (depfile) {
+    return snprintf(output_buffer, PATH_MAX, "%s", depfile) < PATH_MAX;
+  }
+
+  if (!writes_deps || !output) {
+    return false;
+  }
+
+  // Without -MF, the compiler replaces the output's suffix with ".d"
+  const char *slash = strrchr(output, '/');
+  const char *dot = strrchr(output, '.');
+  int stem = dot && (!slash || dot > slash) ? (int)(dot - output) : (int)strlen(output);
+
+  return snprintf(output_buffer, PATH_MAX, "%.*s.d", stem, output) < PATH_MAX;
+});
+
+/**
+ * @brief Hashes the contents of the dependencies recorded for a target.
+ * @param target The path of the target.
+ * @param hash Where to store the hash, 0 if the target has no recorded dependencies.
+ * @return `true` on success, `false` if a dependency doesn't exist anymore.
+ */
+bool builder_deps_hash(const char *target, uint64_t *hash) impl({
+  deps_entry_t *entry = builder_deps_get(target);
+  hash_state_t state;
+  bool ok = true;
+
+  *hash = 0;
+
+  if (!entry) {
+    return true;
+  }
+
+  hash_init(&state, 0);
+
+  for (const char *dep = entry->blob; dep < entry->blob + entry->blob_len; dep += strlen(dep) + 1) {
+    uint64_t dep_hash = 0;
+
+    if (!builder_file_hash(dep, &dep_hash)) {
+      ok = false;
+    }
+
+    hash_update(&state, dep, strlen(dep) + 1);
+    hash_update(&state, &dep_hash, sizeof(dep_hash));
+  }
+
+  *hash = hash_digest(&state);
+
+  return ok;
+});
+
+/** @brief A target that was found out of date, waiting for its command to finish. */
+typedef struct rebuild_target_t {
+  /** @brief The path of the target. */
+  char *path;
+  /** @brief The hash of the target's inputs and command. */
+  uint64_t action_hash,
+  /** @brief The modification time of the target when it was checked, in nanoseconds. */
+           mtime_ns,
+  /** @brief The size of the target when it was checked. */
+           size,
+  /** @brief The content hash of the target when it was checked, if `hashed`. */
+           content_hash;
+  /** @brief `true` if the target existed when it was checked. */
+  bool existed,
+  /** @brief `true` if the content hash of the target was recorded when it was checked. */
+       hashed,
+  /** @brief `true` once the target was recorded with the same contents it had before its command ran. */
+       unchanged;
+} rebuild_target_t;
+
+/** @brief A list of targets waiting for their command to finish. */
+typedef struct rebuild_target_list_t {
+  /** @brief The allocated capacity of the list. */
+  size_t size,
+  /** @brief The current number of items in the list. */
+         current;
+  /** @brief The array of targets. */
+  rebuild_target_t *items;
+} rebuild_target_list_t;
+
+/** @brief Targets found out of date that weren't claimed by a queued job yet. */
+impl_global(rebuild_target_list_t builder_pending_targets, {0});
+
+/**
+ * @brief Records a target as built by a successful command.
+ *
+ * If the contents of the target were recorded before its command ran, they are compared
+ * with the new ones, like ninja's `restat`. A target rewritten with the same bytes is
+ * marked `unchanged`, and its new signature is recorded, so the targets depending on it
+ * find the same hash without reading it again.
+ * @param target The target, with the action hash computed when it was checked.
+ * @return `true` if the target exists and was recorded.
+ */
+bool builder_target_record(rebuild_target_t *target) impl({
+  struct stat st;
+  uint64_t deps_hash;
+
+  // The command just wrote the target
+  builder_stat_invalidate(target->path);
+
+  if (stat(target->path, &st) != 0) {
+    return false;
+  }
+
+  // If a dependency vanished, leave the deps hash unmatched so the next check rebuilds
+  if (!builder_deps_hash(target->path, &deps_hash)) {
+    deps_hash = ~(uint64_t)0;
+  }
+
+  uint64_t values[4] = { target->action_hash, builder_stat_mtime_ns(&st), (uint64_t)st.st_size, deps_hash };
+
+  builder_state_put(STATE_TARGET, target->path, values);
+
+  // Hashed through the state, the outputs read by the next commands get their new signature
+  if (target->hashed) {
+    uint64_t hash;
+
+    target->unchanged = builder_file_hash(target->path, &hash) && hash == target->content_hash;
+  }
+
+  return true;
+});
+
+/**
+ * @brief Records the targets of a finished command in the build state, and empties the list.
+ * @param targets The targets of the command.
+ * @param success `true` if the command succeeded. Failed targets are left out of date.
+ * @param argv The command, ending with NULL, used to find the depfile it wrote. Can be NULL.
+ * @return `true` if the command succeeded and left the contents of all its targets as they were
+ * (see `builder_target_record`), `false` otherwise or if it had no targets.
+ */
+bool builder_targets_commit(rebuild_target_list_t *targets, bool success, char **argv) impl({
+  char depfile[PATH_MAX];
+  bool unchanged = success && targets->current > 0;
+
+  // The dependencies must be up to date before the targets' deps hash is recorded
+  if (success && targets->current > 0 && argv && builder_command_depfile(argv, depfile)) {
+    builder_deps_ingest(depfile);
+  }
+
+  for (size_t i = 0; i < targets->current; i++) {
+    rebuild_target_t *target = &targets->items[i];
+
+    // Even a failed command may have written the target
+    builder_stat_invalidate(target->path);
+
+    if (success) {
+      builder_target_record(target);
+    }
+
+    unchanged = unchanged && target->unchanged;
+
+    free(target->path);
+  }
+
+  free(targets->items);
+
+  *targets = (rebuild_target_list_t){0};
+
+  return unchanged;
+});
+
+/**
+ * @brief Checks if a target has to be rebuilt from its inputs.
+ *
+ * A target is out of date if it doesn't exist, if it was changed since it was built, or if
+ * the contents of its inputs (or its command) differ from its last successful build. Inputs
+ * are only hashed when their modification time or size changed. The dependencies recorded from the
+ * target's depfile (see `builder_deps_ingest`) are checked as well. When the target is out of date,
+ * the next command queued with `$()` is considered to build it: the target is recorded as up to
+ * date once that command succeeds.
+ * @param target The path of the target.
+ * @param inputs The paths of the inputs, ending with NULL.
+ * @param command The command that builds the target, ending with NULL, or NULL if it isn't tracked.
+ * @return `true` if the target has to be rebuilt, `false` if it is up to date.
+ */
+bool builder_needs_rebuild(const char *target, char **inputs, char **command) impl({
+  hash_state_t action;
+  struct stat st;
+  bool stale = false, exists = builder_stat(target, &st);
+
+  hash_init(&action, 0);
+
+  for (size_t i = 0; inputs[i]; i++) {
+    uint64_t hash;
+
+    if (!builder_file_hash(inputs[i], &hash)) {
+      warn("input %s of %s doesn't exist", inputs[i], target);
+
+      stale = true;
+      hash = 0;
+    }
+
+    hash_update(&action, inputs[i], strlen(inputs[i]) + 1);
+    hash_update(&action, &hash, sizeof(hash));
+  }
+
+  for (size_t i = 0; command && command[i]; i++) {
+    hash_update(&action, command[i], strlen(command[i]) + 1);
+  }
+
+  // The environment the command will run with, the inherited one isn't tracked
+  for (size_t i = 0; build_context && build_context->env && build_context->env[i]; i++) {
+    hash_update(&action, "\0env", 4);
+    hash_update(&action, build_context->env[i], strlen(build_context->env[i]) + 1);
+  }
+
+  uint64_t action_hash = hash_digest(&action), deps_hash;
+  state_record_t *record = builder_state_get(STATE_TARGET, target);
+
+  // Headers found in the target's depfile are inputs too
+  if (!builder_deps_hash(target, &deps_hash)) {
+    stale = true;
+  }
+
+  if (!stale && exists && record && record->values[0] == action_hash &&
+      record->values[1] == builder_stat_mtime_ns(&st) && record->values[2] == (uint64_t)st.st_size &&
+      record->values[3] == deps_hash) {
+    return false;
+  }
+
+  rebuild_target_list_t *pending = &builder_pending_targets;
+
+  if (pending->size <= pending->current) {
+    pending->size = (pending->size + 1) * 2;
+
+    pending->items = (rebuild_target_t *)realloc(pending->items, sizeof(rebuild_target_t) * pending->size);
+  }
+
+  // The recorded hash is only known to match if the target wasn't touched since it was read
+  state_record_t *file = exists ? builder_state_get(STATE_FILE, target) : NULL;
+  bool hashed = file && file->values[0] == builder_stat_mtime_ns(&st) &&
+                file->values[1] == (uint64_t)st.st_size && file->values[3] == (uint64_t)st.st_ino;
+
+  pending->items[pending->current++] = (rebuild_target_t){
+    .path = strdup(target),
+    .action_hash = action_hash,
+    .mtime_ns = exists ? builder_stat_mtime_ns(&st) : 0,
+    .size = exists ? (uint64_t)st.st_size : 0,
+    .content_hash = hashed ? file->values[2] : 0,
+    .existed = exists,
+    .hashed = hashed,
+  };
+
+  return true;
+});
+
+/**
+ * @brief Computes the key of the `STATE_COMMAND` record of a command.
+ * @param argv The argument vector of the command, ending with NULL.
+ * @param key A buffer of at least 17 bytes to store the key.
+ */
+void builder_command_key(char **argv, char *key) impl({
+  hash_state_t state;
+
+  hash_init(&state, 0);
+
+  for (size_t i = 0; argv[i]; i++) {
+    hash_update(&state, argv[i], strlen(argv[i]) + 1);
+  }
+
+  snprintf(key, 17, "%016" PRIx64, hash_digest(&state));
+});
+
+impl(
+  /**
+   * @brief Computes the size a record takes in the state database, padding included.
+   */
+  static size_t builder_db_record_size(size_t key_len, size_t data_len) {
+    return (sizeof(db_record_t) + key_len + data_len + 7) & ~(size_t)7;
+  }
+
+  /**
+   * @brief Writes a record to the state database.
+   */
+  static void builder_db_write_record(FILE *file, char kind, const char *key, const void *data, uint32_t data_len, uint32_t count) {
+    static const char padding[8] = {0};
+    db_record_t record = { (uint32_t)(unsigned char)kind, (uint32_t)strlen(key) + 1, data_len, count };
+    size_t size = builder_db_record_size(record.key_len, data_len);
+
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(key, 1, record.key_len, file);
+    fwrite(data, 1, data_len, file);
+    fwrite(padding, 1, size - sizeof(record) - record.key_len - data_len, file);
+  }
+
+  /**
+   * @brief Writes the records of the build state and the dependency database, all of them or only those that changed.
+   */
+  static void builder_db_write_records(FILE *file, bool all) {
+    for (size_t i = 0; i < builder_state.size; i++) {
+      state_record_t *record = &builder_state.items[i];
+
+      if (record->kind && (all || record->dirty)) {
+        builder_db_write_record(file, record->kind, record->key, record->values, sizeof(record->values), 0);
+      }
+    }
+
+    for (size_t i = 0; i < builder_deps.size; i++) {
+      deps_entry_t *entry = &builder_deps.items[i];
+
+      if (entry->target && (all || entry->dirty)) {
+        builder_db_write_record(file, BUILDER_DB_DEPS, entry->target, entry->blob, entry->blob_len, entry->count);
+      }
+    }
+  }
+)
+
+/**
+ * @brief Writes the build state and the dependency database to `BUILDER_STATE_DIR/db` if they
+ * changed during this run.
+ *
+ * Out of date targets whose command ran outside of a `SyncGroup` (e.g., with `$_sync`) are
+ * recorded here, if they were written since they were checked. Only the records that changed
+ * are appended to the database. Once the records they replaced take more space than the current
+ * ones (plus `BUILDER_DB_SLACK`), the database is compacted instead: it is rewritten with the
+ * current records only, and replaces the old one atomically.
+ * @return `true` on success, `false` if the state couldn't be written.
+ */
+bool builder_state_save() impl({
+  struct stat st;
+  rebuild_target_list_t *pending = &builder_pending_targets;
+
+  for (size_t i = 0; i < pending->current; i++) {
+    rebuild_target_t *target = &pending->items[i];
+
+    if (stat(target->path, &st) == 0 &&
+        (!target->existed || target->mtime_ns != builder_stat_mtime_ns(&st) || target->size != (uint64_t)st.st_size)) {
+      builder_target_record(target);
+    }
+  }
+
+  builder_targets_commit(pending, false, NULL);
+
+  if (!builder_state.dirty && !builder_deps.dirty) {
+    return true;
+  }
+
+  if (mkdir(BUILDER_STATE_DIR, 0755) != 0 && errno != EEXIST) {
+    error("couldn't create " BUILDER_STATE_DIR ": %s", strerror(errno));
+
+    return false;
+  }
+
+  size_t live = sizeof(uint32_t[2]), appended = 0;
+
+  for (size_t i = 0; i < builder_state.size; i++) {
+    state_record_t *record = &builder_state.items[i];
+    size_t size = record->kind ? builder_db_record_size(strlen(record->key) + 1, sizeof(record->values)) : 0;
+
+    live += size;
+    appended += record->dirty ? size : 0;
+  }
+
+  for (size_t i = 0; i < builder_deps.size; i++) {
+    deps_entry_t *entry = &builder_deps.items[i];
+    size_t size = entry->target ? builder_db_record_size(strlen(entry->target) + 1, entry->blob_len) : 0;
+
+    live += size;
+    appended += entry->dirty ? size : 0;
+  }
+
+  bool compact = builder_state.file_size == 0 || builder_state.file_size + appended > live * 2 + BUILDER_DB_SLACK;
+  FILE *file = NULL;
+
+  if (!compact && (file = fopen(BUILDER_STATE_DIR "/db", "r+b"))) {
+    // Whatever follows the valid records was cut short by an interrupted run
+    if (ftruncate(fileno(file), (off_t)builder_state.file_size) != 0 ||
+        fseeko(file, (off_t)builder_state.file_size, SEEK_SET) != 0) {
+      fclose(file);
+      file = NULL;
+    }
+  }
+
+  // Starting over is always possible, even when the database vanished during the run
+  if (!file) {
+    uint32_t header[2] = { BUILDER_DB_MAGIC, BUILDER_STATE_VERSION };
+
+    compact = true;
+
+    if (!(file = fopen(BUILDER_STATE_DIR "/db.tmp", "wb"))) {
+      error("couldn't write " BUILDER_STATE_DIR "/db.tmp: %s", strerror(errno));
+
+      return false;
+    }
+
+    fwrite(header, sizeof(header), 1, file);
+  }
+
+  builder_db_write_records(file, compact);
+
+  bool written = !ferror(file);
+
+  // A compacted database replaces the old one atomically, so an interrupted build never leaves a truncated file
+  if (fclose(file) != 0 || !written || (compact && rename(BUILDER_STATE_DIR "/db.tmp", BUILDER_STATE_DIR "/db") != 0)) {
+    error("couldn't write " BUILDER_STATE_DIR "/db: %s", strerror(errno));
+
+    return false;
+  }
+
+  if (compact) {
+    // The text state and dependency files of older versions are replaced by the database
+    unlink(BUILDER_STATE_DIR "/state");
+    unlink(BUILDER_STATE_DIR "/deps");
+  }
+
+  for (size_t i = 0; i < builder_state.size; i++) {
+    builder_state.items[i].dirty = false;
+  }
+
+  for (size_t i = 0; i < builder_deps.size; i++) {
+    builder_deps.items[i].dirty = false;
+  }
+
+  builder_state.file_size = compact ? live : builder_state.file_size + appended;
+  builder_state.dirty = false;
+  builder_deps.dirty = false;
+
+  return true;
+});
+
+/**
+ * @brief Forgets the build state and the dependency database, and deletes the state database,
+ * so the next checks behave like the first build of the tree.
+ */
+void builder_state_reset() impl({
+  for (size_t i = 0; i < builder_state.size; i++) {
+    if (builder_state.items[i].kind && !builder_state_mapped(builder_state.items[i].key)) {
+      free(builder_state.items[i].key);
+    }
+  }
+
+  for (size_t i = 0; i < builder_deps.size; i++) {
+    deps_entry_t *entry = &builder_deps.items[i];
+
+    if (entry->target && !builder_state_mapped(entry->target)) {
+      free(entry->target);
+    }
+
+    if (entry->target && !builder_state_mapped(entry->blob)) {
+      free(entry->blob);
+    }
+  }
+
+  free(builder_state.items);
+  free(builder_deps.items);
+
+  if (builder_state.map) {
+    munmap(builder_state.map, builder_state.map_size);
+  }
+
+  builder_state = (build_state_t){0};
+  builder_deps = (deps_db_t){0};
+
+  unlink(BUILDER_STATE_DIR "/db");
+});
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Processes //////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Describes how a command's process is set up before it runs.
+ * Zero-initialized fields keep the build script's own settings.
+ */
+typedef struct spawn_options_t {
+  /** @brief The working directory of the process, or NULL to inherit it. */
+  const char *cwd;
+  /** @brief A file opened as the process' stdin, or NULL. */
+  const char *stdin_path,
+  /** @brief A file truncated and opened as the process' stdout, or NULL. */
+             *stdout_path,
+  /** @brief A file truncated and opened as the process' stderr, or NULL. */
+             *stderr_path;
+  /** @brief A descriptor duplicated as the process' stdin, or 0 to inherit it. */
+  int stdin_fd,
+  /** @brief A descriptor duplicated as the process' stdout, or 0 to inherit it. */
+      stdout_fd,
+  /** @brief A descriptor duplicated as the process' stderr, or 0 to inherit it. */
+      stderr_fd;
+  /** @brief `true` to send the process' stderr wherever its stdout goes. */
+  bool stderr_to_stdout;
+  /**
+   * @brief The memory the command is expected to use, in bytes, for the scheduler. 0 to use the
+   * memory of the build context or, failing that, the peak memory of the command's last run.
+   */
+  uint64_t memory;
+  /**
+   * @brief The estimated time until the command and everything waiting on it are done, in nanoseconds.
+   * Queued commands with the highest priority start first. 0 to use the duration of the command's last run.
+   */
+  uint64_t priority;
+  /**
+   * @brief The time the command may run in milliseconds, after which it is sent SIGTERM, then SIGKILL.
+   * 0 to use the timeout of the build context or `--timeout`. Only applies to jobs.
+   */
+  uint64_t timeout_ms;
+  /**
+   * @brief `true` to start the process in a process group of its own, so it is signaled together with
+   * its subprocesses. Jobs always are, the build script forwards them the signals it gets.
+   */
+  bool process_group;
+  /**
+   * @brief The whole environment of the process, as "NAME=value" strings ending with NULL, or NULL to use
+   * the build context's or else inherit the build script's. Its PATH is the one the executable is searched in.
+   * Part of the compiler cache key, but unlike the build context's, not of the action hash of `needs_rebuild`.
+   */
+  char **env;
+} spawn_options_t;
+
+/**
+ * @brief Finds a variable in an environment.
+ * @param env The environment, as "NAME=value" strings ending with NULL.
+ * @param name The name of the variable.
+ * @return The value of the variable, or NULL if it isn't set.
+ */
+const char *builder_env_get(char **env, const char *name) impl({
+  size_t name_len = strlen(name);
+
+  for (size_t i = 0; env[i]; i++) {
+    if (strncmp(env[i], name, name_len) == 0 && env[i][name_len] == '=') {
+      return env[i] + name_len + 1;
+    }
+  }
+
+  return NULL;
+});
+
+/**
+ * @brief Resolves the executable that `run_command` should run.
+ * @param path The name or path of the executable. Names without a `/` are searched in PATH.
+ * @param output_buffer A buffer of at least `PATH_MAX` size to store the resolved path.
+ * @return `true` if the executable was found, `false` otherwise.
+ */
+bool builder_resolve_executable(const char *path, char output_buffer[PATH_MAX]) impl({
+  size_t path_len = strlen(path);
+
+  if (strchr(path, '/')) {
+    if (path_len >= PATH_MAX) {
+      return false;
+    }
+
+    // Name is already a path, absolute or relative to the current directory
+    memcpy(output_buffer, path, path_len + 1);
+
+    return true;
+  }
+
+  return find_executable(path, output_buffer);
+});
+
+/**
+ * @brief Resolves the executable of a command that runs with its own environment.
+ * @param path The name or path of the executable. Names without a `/` are searched in the PATH of `env`.
+ * @param env The environment of the command, or NULL to search the build script's PATH.
+ * @param output_buffer A buffer of at least `PATH_MAX` size to store the resolved path.
+ * @return `true` if the executable was found, `false` otherwise.
+ */
+bool builder_resolve_executable_env(const char *path, char **env, char output_buffer[PATH_MAX]) impl({
+  const char *search_path = env ? builder_env_get(env, "PATH") : NULL, *own_path = getenv("PATH");
+
+  // The lookups of the build script's PATH are cached, most environments keep it
+  if (!env || strchr(path, '/') || (search_path && own_path && strcmp(search_path, own_path) == 0)) {
+    return builder_resolve_executable(path, output_buffer);
+  }
+
+  // Like `execvp`, without a PATH the default search path is used
+  return find_executable_in(path, search_path ? search_path : "/usr/local/bin:/usr/bin:/bin", output_buffer);
+});
+
+/**
+ * @brief Creates a process with `fork()` and `execv`, applying the spawn options in the child.
+ * @param executable_path The resolved path of the executable.
+ * @param argv The argument vector for the new process, ending with NULL.
+ * @param options The spawn options, or NULL.
+ * @return The process ID of the child on success, or -1 on failure.
+ */
+pid_t builder_spawn_fork(const char *executable_path, char **argv, const spawn_options_t *options) impl({
+  extern char **environ;
+  char **env = options && options->env ? options->env : environ;
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    // Only async-signal-safe calls from here on, and `_exit` so we don't flush the parent's stdio buffers
+    if (options) {
+      const char *paths[3] = { options->stdin_path, options->stdout_path, options->stderr_path };
+      int fds[3] = { options->stdin_fd, options->stdout_fd, options->stderr_fd };
+
+      if (options->cwd && chdir(options->cwd) != 0) {
+        _exit(127);
+      }
+
+      if (options->process_group) {
+        setpgid(0, 0);
+      }
+
+      for (int fd = 0; fd < 3; fd++) {
+        if (paths[fd]) {
+          int flags = fd == STDIN_FILENO ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+          int file = open(paths[fd], flags, 0644);
+
+          if (file == -1 || dup2(file, fd) == -1) {
+            _exit(127);
+          }
+
+          close(file);
+        } else if (fds[fd] > 0 && fds[fd] != fd && dup2(fds[fd], fd) == -1) {
+          _exit(127);
+        }
+      }
+
+      if (options->stderr_to_stdout && dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
+        _exit(127);
+      }
+    }
+
+    execve(executable_path, (char *const *)argv, (char *const *)env);
+
+    _exit(127);
+  }
+
+  if (pid == -1) {
+    error("fork() failed: %s", strerror(errno));
+
+    return -1;
+  }
+
+  // Done on both sides, so the group exists by the time it is signaled whichever runs first
+  if (options && options->process_group) {
+    setpgid(pid, pid);
+  }
+
+  return pid;
+});
+
+#if BUILDER_SPAWN_BACKEND == BUILDER_SPAWN_POSIX
+#if BUILDER_SPAWN_HAS_ADDCHDIR
+/**
+ * @brief Adds a change of working directory to a `posix_spawn` file actions object.
+ * @return 0 on success, or an error number.
+ */
+int builder_spawn_addchdir(posix_spawn_file_actions_t *actions, const char *cwd) impl({
+  return posix_spawn_file_actions_addchdir_np(actions, cwd);
+});
+#else
+/**
+ * @brief Adds a change of working directory to a `posix_spawn` file actions object.
+ * @return `ENOSYS`, as this platform can't change directories in `posix_spawn`.
+ */
+int builder_spawn_addchdir(posix_spawn_file_actions_t *actions, const char *cwd) impl({
+  (void)actions;
+  (void)cwd;
+
+  return ENOSYS;
+});
+#endif
+
+/**
+ * @brief Creates a process with `posix_spawn`, translating the spawn options into file actions.
+ * @param executable_path The resolved path of the executable.
+ * @param argv The argument vector for the new process, ending with NULL.
+ * @param options The spawn options, or NULL.
+ * @return The process ID of the child on success, or -1 on failure. If the options can't be
+ * expressed as file actions on this platform, `errno` is set to `ENOSYS`.
+ */
+pid_t builder_spawn_posix(const char *executable_path, char **argv, const spawn_options_t *options) impl({
+  extern char **environ;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attributes;
+  pid_t pid;
+  int result = 0;
+
+  if (options) {
+    posix_spawnattr_init(&attributes);
+
+    if (options->process_group) {
+      posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+      posix_spawnattr_setpgroup(&attributes, 0);
+    }
+
+    const char *paths[3] = { options->stdin_path, options->stdout_path, options->stderr_path };
+    int fds[3] = { options->stdin_fd, options->stdout_fd, options->stderr_fd };
+
+    posix_spawn_file_actions_init(&actions);
+
+    if (options->cwd) {
+      result = builder_spawn_addchdir(&actions, options->cwd);
+    }
+
+    for (int fd = 0; result == 0 && fd < 3; fd++) {
+      if (paths[fd]) {
+        int flags = fd == STDIN_FILENO ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+
+        result = posix_spawn_file_actions_addopen(&actions, fd, paths[fd], flags, 0644);
+      } else if (fds[fd] > 0 && fds[fd] != fd) {
+        result = posix_spawn_file_actions_adddup2(&actions, fds[fd], fd);
+      }
+    }
+
+    if (result == 0 && options->stderr_to_stdout) {
+      result = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+
+    if (result == 0) {
+      result = posix_spawn(&pid, executable_path, &actions, &attributes, argv, options->env ? options->env : environ);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+  } else {
+    result = posix_spawn(&pid, executable_path, NULL, NULL, argv, environ);
+  }
+
+  if (result != 0) {
+    errno = result;
+
+    if (result != ENOSYS) {
+      error("posix_spawn() failed for %s: %s", executable_path, strerror(result));
+    }
+
+    return -1;
+  }
+
+  return pid;
+});
+#else
+/**
+ * @brief Stands in for the `posix_spawn` backend on platforms that don't have it.
+ * @return -1 with `errno` set to `ENOSYS`, so callers fall back to `fork()`.
+ */
+pid_t builder_spawn_posix(const char *executable_path, char **argv, const spawn_options_t *options) impl({
+  (void)executable_path;
+  (void)argv;
+  (void)options;
+
+  errno = ENOSYS;
+
+  return -1;
+});
+#endif
+
+/**
+ * @brief Creates a new child process to run a command, applying the given spawn options.
+ * @param path The name or path of the executable to run.
+ * @param argv The argument vector (list of strings) for the new process, ending with NULL.
+ * @param options How to set up the process (working directory, redirections, environment), or NULL.
+ * @return The process ID of the child on success, or -1 on failure.
+ */
+pid_t run_command_ex(const char *path, char **argv, const spawn_options_t *options) impl({
+  char executable_path[PATH_MAX];
+
+  if (!builder_resolve_executable_env(path, options ? options->env : NULL, executable_path)) {
+    error("run_command: couldn't find executable %s in PATH.", path);
+
+    return -1;
+  }
+
+  if (builder_spawn_backend == BUILDER_SPAWN_POSIX) {
+    pid_t pid = builder_spawn_posix(executable_path, argv, options);
+
+    // Fall back to fork when the options aren't supported by `posix_spawn` here
+    if (pid != -1 || errno != ENOSYS) {
+      return pid;
+    }
+  }
+
+  return builder_spawn_fork(executable_path, argv, options);
+});
+
+/**
+ * @brief Creates a new child process to run a command.
+ * @param path The name or path of the executable to run.
+ * @param argv The argument vector (list of strings) for the new process, ending with NULL.
+ * @return The process ID of the child on success, or -1 on failure.
+ */
+pid_t run_command(const char *path, char **argv) impl({
+  return run_command_ex(path, argv, NULL);
+});
+
+/**
+ * @brief A command assembled at runtime. Zero-initialize it (`cmd_t cmd = {0};`), fill it with
+ * `cmd_append`, `cmd_extend` and `cmd_appendf`, and reuse it with `cmd_reset`.
+ */
+typedef struct cmd_t {
+  /** @brief The argument vector of the command, always ending with NULL once something was appended. */
+  char **items;
+  /** @brief The number of arguments. */
+  size_t count,
+  /** @brief The allocated capacity of `items`. */
+         size;
+  /** @brief The arena the arguments are copied to. */
+  arena_t arena;
+} cmd_t;
+
+/**
+ * @brief Appends an argument that is already allocated from the command's arena.
+ * @param cmd The command to append to.
+ * @param argument The argument.
+ */
+void cmd_push(cmd_t *cmd, char *argument) impl({
+  // One more for the NULL terminator
+  if (cmd->size <= cmd->count + 1) {
+    cmd->size = cmd->size ? cmd->size * 2 : 16;
+    cmd->items = (char **)realloc(cmd->items, sizeof(char *) * cmd->size);
+  }
+
+  cmd->items[cmd->count++] = argument;
+  cmd->items[cmd->count] = NULL;
+});
+
+/**
+ * @brief Appends the arguments of a NULL-terminated array to a command. They are copied.
+ * @param cmd The command to append to.
+ * @param arguments The arguments, ending with NULL (e.g., another command's `items`).
+ */
+void cmd_extend(cmd_t *cmd, char **arguments) impl({
+  for (size_t i = 0; arguments && arguments[i]; i++) {
+    cmd_push(cmd, arena_strdup(&cmd->arena, arguments[i]));
+  }
+});
+
+/**
+ * @brief Appends a formatted argument to a command (e.g., `cmd_appendf(&cmd, "-DVERSION=%d", 3)`).
+ * @param cmd The command to append to.
+ * @param format The `printf` format of the argument.
+ */
+__attribute__((format(printf, 2, 3)))
+void cmd_appendf(cmd_t *cmd, const char *format, ...) impl({
+  va_list args, copy;
+
+  va_start(args, format);
+  va_copy(copy, args);
+
+  int length = vsnprintf(NULL, 0, format, args);
+  char *argument = (char *)arena_alloc(&cmd->arena, (size_t)(length > 0 ? length : 0) + 1);
+
+  vsnprintf(argument, (size_t)(length > 0 ? length : 0) + 1, format, copy);
+
+  va_end(copy);
+  va_end(args);
+
+  cmd_push(cmd, argument);
+});
+
+/**
+ * @brief Gets the argument vector of a command, to run it or pass it where a `char **` is expected.
+ * @param cmd The command.
+ * @return The arguments, ending with NULL. Valid until the command is reset or freed.
+ */
+char **cmd_argv(cmd_t *cmd) impl({
+  static char *empty[] = { NULL };
+
+  return cmd->items ? cmd->items : empty;
+});
+
+/**
+ * @brief Empties a command, keeping its memory for the next one (e.g., in the next loop iteration).
+ * @param cmd The command.
+ */
+void cmd_reset(cmd_t *cmd) impl({
+  cmd->count = 0;
+
+  if (cmd->items) {
+    cmd->items[0] = NULL;
+  }
+
+  arena_release(&cmd->arena);
+});
+
+/**
+ * @brief Frees the memory of a command. It can be used again afterwards.
+ * @param cmd The command.
+ */
+void cmd_free(cmd_t *cmd) impl({
+  arena_release(&cmd->arena);
+  free(cmd->items);
+
+  *cmd = (cmd_t){0};
+});
+
+/**
+ * @brief Creates a new child process to run a command assembled in a `cmd_t`.
+ * @param cmd The command, with at least one argument. Its first argument is the executable.
+ * @param options How to set up the process (working directory, redirections), or NULL.
+ * @return The process ID of the child on success, or -1 on failure.
+ */
+pid_t cmd_run(cmd_t *cmd, const spawn_options_t *options) impl({
+  if (cmd->count == 0) {
+    error("cmd_run: the command is empty.");
+
+    return -1;
+  }
+
+  return run_command_ex(cmd->items[0], cmd->items, options);
+});
+
+/**
+ * @brief Waits for a single process to terminate and returns its exit code.
+ * @param pid The ID of the process to wait for.
+ * @return The exit status of the process, or the signal number if it was terminated by a signal.
+ */
+int wait_pid_sync(pid_t pid) impl({
+  int status;
+
+  // Whatever the process wrote isn't known
+  builder_stat_invalidate_all();
+
+  while (-1 != waitpid(pid, &status, 0)) {
+    if (WIFSIGNALED(status)) {
+      error("process %d received signal '%s'", pid, strsignal(WTERMSIG(status)));
+
+      return WTERMSIG(status);
+    }
+
+    if (WIFEXITED(status)) {
+      return WEXITSTATUS(status);
+    }
+  }
+
+  return -1;
+});
+
+/** @brief The unit of `ru_maxrss` in bytes: bytes on macOS, kilobytes elsewhere. */
+#ifdef __APPLE__
+#define BUILDER_MAXRSS_UNIT 1
+#else
+#define BUILDER_MAXRSS_UNIT 1024
+#endif
+
+/** @brief The lifecycle of a command scheduled inside a `SyncGroup`. */
+typedef enum job_state_t {
+  /** @brief The job is queued and waits for a free job slot. */
+  JOB_PENDING,
+  /** @brief The job's process was started and has not been reaped yet. */
+  JOB_RUNNING,
+  /** @brief The job's process terminated, `status` holds its exit code. */
+  JOB_DONE,
+  /** @brief The job's process could not be started. */
+  JOB_FAILED,
+  /** @brief The job was dropped before it started, because its list was cancelled. `status` is 127. */
+  JOB_CANCELLED,
+} job_state_t;
+
+/** @brief The output of a job, captured so it can be printed in one piece once the job is done. */
+typedef struct job_output_t {
+  /** @brief The read ends of the pipes connected to the job's stdout and stderr, or -1 if not captured. */
+  int fds[2];
+  /** @brief The output read so far from each pipe. */
+  char *data[2];
+  /** @brief The number of bytes in each buffer. */
+  size_t lengths[2],
+  /** @brief The allocated capacity of each buffer. */
+         capacities[2];
+} job_output_t;
+
+/** @brief A single command scheduled by a `SyncGroup`. */
+typedef struct job_t {
+  /** @brief The argument vector of the command, ending with NULL. Allocated from the list's arena. */
+  char **argv;
+  /** @brief The process ID of the command, or -1 if it is not running. */
+  pid_t pid;
+  /** @brief The current state of the job. */
+  job_state_t state;
+  /** @brief The exit status of the process, or the signal number if it was terminated by a signal. */
+  int status;
+  /** @brief The list the job belongs to. */
+  struct pid_list_t *group;
+  /** @brief How the job's process is set up, or NULL for the defaults. Allocated from the list's arena. */
+  spawn_options_t *options;
+  /** @brief The out of date targets the job builds, recorded in the build state when it succeeds. */
+  rebuild_target_list_t targets;
+  /** @brief Called once the job is done or failed to start, or NULL. */
+  void (*on_exit)(struct job_t *job, void *data);
+  /** @brief The user data passed to `on_exit`. */
+  void *on_exit_data;
+  /** @brief The compiler cache lookup of the job, or NULL if its command isn't cached. */
+  struct job_cache_t *cache;
+  /** @brief The time the job's process was started, in nanoseconds. */
+  uint64_t start_ns;
+  /** @brief The job slot the job runs in, starting at 1. */
+  int lane;
+  /** @brief The captured stdout and stderr of the job's process. */
+  job_output_t output;
+  /** @brief The memory the job is expected to use in bytes, counted against `--max-memory` while it runs. */
+  uint64_t memory;
+  /** @brief The largest resident set size of the job's processes so far, in bytes. */
+  uint64_t peak_memory;
+  /** @brief The estimated time until everything waiting on the job is done in nanoseconds, queued jobs with the highest start first. */
+  uint64_t priority;
+  /** @brief The position of the job in its list, so jobs of equal priority start in the order they were queued. */
+  size_t order;
+  /** @brief The executor the job was handed to, or NULL if it runs in a local job slot. */
+  struct executor_t *executor;
+  /** @brief What the executor keeps about the job while it runs. */
+  void *executor_data;
+  /** @brief The callbacks added with `job_then`, called in order once the job is done. */
+  struct job_continuation_t *continuations;
+  /** @brief The time the job may run in milliseconds, or 0 for no limit. */
+  uint64_t timeout_ms;
+  /** @brief The timer stopping the job once its timeout passed, or killing it once it was sent SIGTERM, or 0. */
+  uint64_t timer;
+  /** @brief `true` once the job was stopped, by its timeout or because its list was cancelled. */
+  bool cancelled,
+  /** @brief `true` if the job was stopped because it ran longer than its timeout. */
+       timed_out,
+  /** @brief `true` if the job succeeded without changing the contents of the targets it was found to build. */
+       unchanged;
+  /** @brief The user and system CPU time of the job's processes so far, from `wait4`, in nanoseconds. */
+  uint64_t cpu_ns;
+  /** @brief The stats of the build context the job was queued in, or NULL. */
+  struct context_stats_t *stats;
+} job_t;
+
+/** @brief A callback added to a job with `job_then`. Allocated from the arena of the job's list. */
+typedef struct job_continuation_t {
+  /** @brief The callback. */
+  void (*callback)(job_t *job, void *data);
+  /** @brief The user data passed to `callback`. */
+  void *data;
+  /** @brief The next callback of the job, or NULL. */
+  struct job_continuation_t *next;
+} job_continuation_t;
+
+/** @brief A queue of jobs belonging to a `SyncGroup`. */
+typedef struct pid_list_t {
+  /** @brief The allocated capacity of the list. */
+  size_t size,
+  /** @brief The current number of items in the list. */
+         current,
+  /** @brief The number of jobs of this list that are currently running. */
+         running,
+  /** @brief The number of jobs of this list that failed to start, exited with a non-zero code or were signaled. */
+         failed;
+  /** @brief The array of jobs, in the order they were added. */
+  job_t **items;
+  /** @brief The jobs that weren't started yet, as a heap with the highest priority first. */
+  job_t **pending;
+  /** @brief The number of jobs in `pending`, and its allocated capacity. */
+  size_t pending_count, pending_size;
+  /** @brief The arena the list's arrays, jobs and their commands are allocated from. */
+  arena_t arena;
+  /** @brief `true` once the list was cancelled (see `pid_list_cancel`), jobs queued from then on are dropped. */
+  bool cancelled;
+} pid_list_t;
+
+/** @brief The jobs of every `SyncGroup` that are currently running, used to dispatch reaped children. */
+impl_global(job_t **builder_running_jobs, NULL);
+/** @brief The number of running jobs. */
+impl_global(size_t builder_running_count, 0);
+/** @brief The allocated capacity of `builder_running_jobs`. */
+impl_global(size_t builder_running_size, 0);
+/** @brief The memory the running jobs are expected to use, in bytes. */
+impl_global(uint64_t builder_running_memory, 0);
+/** @brief The number of running jobs handed to an executor, which don't take a local job slot. */
+impl_global(size_t builder_executors_running, 0);
+
+/**
+ * @brief Registers a job as running, so `builder_reap` can find it by its process ID.
+ * @param job The job whose process was just started.
+ */
+void builder_running_add(job_t *job) impl({
+  // Pick the lowest free job slot, so traces show one row per slot
+  if (job->state != JOB_RUNNING) {
+    job->lane = 1;
+
+    for (size_t i = 0; i < builder_running_count; i++) {
+      if (builder_running_jobs[i]->lane == job->lane) {
+        job->lane++;
+        i = (size_t)-1;
+      }
+    }
+
+    job->start_ns = builder_now_ns();
+  }
+
+  if (builder_running_size <= builder_running_count) {
+    builder_running_size = (builder_running_size + 1) * 2;
+
+    builder_running_jobs = (job_t **)realloc(builder_running_jobs, sizeof(job_t *) * builder_running_size);
+  }
+
+  builder_running_jobs[builder_running_count++] = job;
+  builder_running_memory += job->memory;
+
+  job->state = JOB_RUNNING;
+  job->group->running++;
+});
+
+/**
+ * @brief Finds a running job by its process ID and removes it from the running jobs.
+ * @param pid The process ID of a reaped child.
+ * @return The job that owned the process, or NULL if the process isn't a job.
+ */
+job_t *builder_running_take(pid_t pid) impl({
+  for (size_t i = 0; i < builder_running_count; i++) {
+    job_t *job = builder_running_jobs[i];
+
+    if (job->pid != pid)
+      continue;
+
+    builder_running_jobs[i] = builder_running_jobs[--builder_running_count];
+    builder_running_memory -= job->memory;
+    job->group->running--;
+
+    return job;
+  }
+
+  return NULL;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Jobserver //////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief The descriptors tokens are read from and written back to, or -1 outside of a jobserver. */
+impl_global(int builder_jobserver_fds[2], { -1, -1 });
+/** @brief The tokens taken from the jobserver, returned as they were read. */
+impl_global(char *builder_jobserver_tokens, NULL);
+/** @brief The number of tokens taken. */
+impl_global(size_t builder_jobserver_held, 0);
+/** @brief The allocated capacity of `builder_jobserver_tokens`. */
+impl_global(size_t builder_jobserver_size, 0);
+/** @brief `true` while a queued job waits for a token, so waiting for jobs also waits for tokens. */
+impl_global(bool builder_jobserver_waiting, false);
+/** @brief The fifo created by `builder_jobserver_serve`, removed at exit, or NULL. */
+impl_global(char *builder_jobserver_fifo, NULL);
+/** @brief `true` if `--jobserver` asked to share the job limit with the commands of the build script. */
+impl_global(bool builder_jobserver_requested, false);
+
+/**
+ * @brief Checks whether jobs are limited by a jobserver.
+ * @return `true` if the build script joined or started a jobserver.
+ */
+bool builder_jobserver_active() impl({
+  return builder_jobserver_fds[0] != -1;
+});
+
+/**
+ * @brief Opens the read end of an inherited jobserver pipe without blocking, without changing it for other processes.
+ * @param fd The inherited descriptor.
+ * @return A new descriptor on success, or -1 on failure.
+ */
+int builder_jobserver_reopen(int fd) impl({
+  char path[64];
+
+  if (fcntl(fd, F_GETFD) == -1) {
+    return -1;
+  }
+
+  // A new open file description of the same pipe, so O_NONBLOCK doesn't leak to make
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+  int reopened = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+  if (reopened == -1 && (fcntl(fd, F_GETFL) & O_NONBLOCK)) {
+    reopened = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  }
+
+  return reopened;
+});
+
+/**
+ * @brief Joins the jobserver of a parent `make` (or another build script), so its job limit covers our jobs too.
+ *
+ * Both the `--jobserver-auth=fifo:PATH` form of GNU make 4.4 and the `--jobserver-auth=R,W`
+ * (or `--jobserver-fds=R,W`) descriptor pair of older versions are understood. Like every
+ * jobserver client, the first running job uses the token implicitly given to the build script;
+ * every other job takes a token before it starts and returns it once it is done.
+ * @param makeflags The value of `MAKEFLAGS`, or NULL.
+ * @return `true` if a jobserver was joined, `false` if there is none or it can't be used.
+ */
+bool builder_jobserver_join(const char *makeflags) impl({
+  const char *auth = NULL, *last = NULL, *found;
+  static const char *const options[] = { "--jobserver-auth=", "--jobserver-fds=" };
+
+  if (!makeflags || builder_jobserver_active())
+    return false;
+
+  // The last option wins, like in make
+  for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    for (const char *p = makeflags; (found = strstr(p, options[i])); p = found + 1) {
+      if (!last || found > last) {
+        last = found;
+        auth = found + strlen(options[i]);
+      }
+    }
+  }
+
+  if (!auth)
+    return false;
+
+  size_t length = strcspn(auth, " ");
+  int read_fd, write_fd;
+
+  if (strncmp(auth, "fifo:", 5) == 0) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%.*s", (int)(length - 5), auth + 5);
+
+    read_fd = write_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (read_fd == -1) {
+      warn("couldn't open the jobserver fifo %s: %s", path, strerror(errno));
+
+      return false;
+    }
+  } else if (sscanf(auth, "%d,%d", &read_fd, &write_fd) == 2 && read_fd >= 0 && write_fd >= 0) {
+    // make closes the descriptors for commands it doesn't know to be recursive
+    if (fcntl(write_fd, F_GETFD) == -1 || (read_fd = builder_jobserver_reopen(read_fd)) == -1) {
+      warn("jobserver unavailable, run this build script as a recursive make command (e.g. with '+')");
+
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  builder_jobserver_fds[0] = read_fd;
+  builder_jobserver_fds[1] = write_fd;
+
+  // The tokens are the job limit now, unless one was given explicitly
+  if (builder_max_jobs <= 0) {
+    builder_max_jobs = LONG_MAX;
+  }
+
+  return true;
+});
+
+/**
+ * @brief Removes the fifo created by `builder_jobserver_serve`.
+ */
+void builder_jobserver_cleanup() impl({
+  if (builder_jobserver_fifo) {
+    unlink(builder_jobserver_fifo);
+    free(builder_jobserver_fifo);
+
+    builder_jobserver_fifo = NULL;
+  }
+});
+
+/**
+ * @brief Starts a jobserver shared with the commands of the build script.
+ *
+ * A fifo holding `jobs - 1` tokens is created under `BUILDER_STATE_DIR` and advertised in
+ * `MAKEFLAGS`, so nested `make`, `ninja` and build scripts draw from the same job budget.
+ * The build script takes its tokens from it as well.
+ * @param jobs The number of jobs that may run at once in the whole process tree.
+ * @return `true` on success, `false` if the fifo couldn't be created.
+ */
+bool builder_jobserver_serve(long jobs) impl({
+  char cwd[PATH_MAX], path[PATH_MAX];
+
+  if (builder_jobserver_active())
+    return false;
+
+  if (!getcwd(cwd, sizeof(cwd)) || (mkdir(BUILDER_STATE_DIR, 0755) != 0 && errno != EEXIST)) {
+    error("couldn't create %s: %s", BUILDER_STATE_DIR, strerror(errno));
+
+    return false;
+  }
+
+  if (snprintf(path, sizeof(path), "%s/" BUILDER_STATE_DIR "/jobserver-%ld", cwd, (long)getpid()) >= (int)sizeof(path)) {
+    error("the path of the jobserver fifo is too long");
+
+    return false;
+  }
+
+  unlink(path);
+
+  int fd = -1;
+
+  if (mkfifo(path, 0600) != 0 || (fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1) {
+    error("couldn't create the jobserver fifo %s: %s", path, strerror(errno));
+
+    unlink(path);
+
+    return false;
+  }
+
+  builder_jobserver_fifo = strdup(path);
+  atexit(builder_jobserver_cleanup);
+
+  for (long i = 1; i < jobs; i++) {
+    if (write(fd, "+", 1) != 1) {
+      break;
+    }
+  }
+
+  const char *makeflags = getenv("MAKEFLAGS");
+  size_t length = (makeflags ? strlen(makeflags) : 0) + strlen(path) + 64;
+  char *flags = (char *)malloc(length);
+
+  snprintf(flags, length, "%s%s-j%ld --jobserver-auth=fifo:%s", makeflags ? makeflags : "",
+      makeflags && *makeflags ? " " : "", jobs, path);
+
+  setenv("MAKEFLAGS", flags, 1);
+  free(flags);
+
+  builder_jobserver_fds[0] = builder_jobserver_fds[1] = fd;
+
+  return true;
+});
+
+/**
+ * @brief Takes a token for a job about to start, if it isn't covered by the implicit token or held ones.
+ * @return `true` if the job may start, `false` if it has to wait for a token to be returned.
+ */
+bool builder_jobserver_acquire() impl({
+  char token;
+
+  // Jobs handed to an executor don't need a token, they don't run on this machine
+  if (!builder_jobserver_active() || builder_jobserver_held >= builder_running_count - builder_executors_running) {
+    builder_jobserver_waiting = false;
+
+    return true;
+  }
+
+  for (;;) {
+    ssize_t count = read(builder_jobserver_fds[0], &token, 1);
+
+    if (count == 1)
+      break;
+
+    if (count == -1 && errno == EINTR)
+      continue;
+
+    if (count == -1 && errno == EAGAIN) {
+      builder_jobserver_waiting = true;
+
+      return false;
+    }
+
+    // The jobserver is gone, fall back to our own job limit
+    warn("lost the connection to the jobserver");
+
+    close(builder_jobserver_fds[0]);
+
+    builder_jobserver_fds[0] = builder_jobserver_fds[1] = -1;
+    builder_jobserver_waiting = false;
+
+    return true;
+  }
+
+  if (builder_jobserver_size <= builder_jobserver_held) {
+    builder_jobserver_size = (builder_jobserver_size + 1) * 2;
+    builder_jobserver_tokens = (char *)realloc(builder_jobserver_tokens, builder_jobserver_size);
+  }
+
+  builder_jobserver_tokens[builder_jobserver_held++] = token;
+  builder_jobserver_waiting = false;
+
+  return true;
+});
+
+/**
+ * @brief Returns the tokens that the running jobs don't need anymore to the jobserver.
+ */
+void builder_jobserver_release() impl({
+  size_t local = builder_running_count - builder_executors_running;
+  size_t needed = local > 0 ? local - 1 : 0;
+
+  while (builder_jobserver_held > needed) {
+    char token = builder_jobserver_tokens[builder_jobserver_held - 1];
+
+    if (builder_jobserver_active() && write(builder_jobserver_fds[1], &token, 1) == -1 && errno == EINTR)
+      continue;
+
+    builder_jobserver_held--;
+  }
+});
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// Output capture ///////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief The capacity requested for the pipes capturing a job's output, where it can be changed. */
+#ifndef BUILDER_PIPE_SIZE
+#define BUILDER_PIPE_SIZE (256 * 1024)
+#endif
+
+/** @brief `true` if the output of jobs is captured and printed once they are done. */
+impl_global(bool builder_output_capture, true);
+/** @brief `true` if the output of jobs that succeeded is dropped. */
+impl_global(bool builder_output_quiet, false);
+/** @brief The self-pipe written to by the SIGCHLD handler, so polling wakes up when a child exits. */
+impl_global(int builder_sigchld_fds[2], { -1, -1 });
+/** @brief The SIGINT, SIGTERM or SIGHUP the build script got while jobs were running, or 0. */
+impl_global(volatile sig_atomic_t builder_interrupted, 0);
+
+/**
+ * @brief Sets whether the output of jobs is captured.
+ *
+ * Captured output is printed in one piece once its job is done, so the output of parallel jobs
+ * doesn't interleave. Without it, jobs write directly to the build script's stdout and stderr.
+ * @param capture `true` to capture the output of the jobs started from now on.
+ */
+void builder_set_output_capture(bool capture) impl({
+  builder_output_capture = capture;
+});
+
+/**
+ * @brief Sets whether the captured output of jobs that succeeded is dropped.
+ * @param quiet `true` to only print the output of failed jobs.
+ */
+void builder_set_quiet(bool quiet) impl({
+  builder_output_quiet = quiet;
+});
+
+impl(
+  /** @brief Wakes up `builder_poll_events` when a child exits. */
+  static void builder_on_sigchld(int signal) {
+    int saved_errno = errno;
+
+    (void)signal;
+
+    if (write(builder_sigchld_fds[1], "", 1) == -1) {
+      // The pipe is full, which already wakes the poll up
+    }
+
+    errno = saved_errno;
+  }
+
+  /**
+   * @brief Lets `builder_reap` forward an interruption to the jobs, which run in process groups of their own.
+   * Without running jobs, or when interrupted twice, the build script is terminated right away.
+   */
+  static void builder_on_interrupt(int signal) {
+    int saved_errno = errno;
+
+    if (builder_interrupted || builder_running_count == 0) {
+      struct sigaction action;
+
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = SIG_DFL;
+
+      sigaction(signal, &action, NULL);
+      raise(signal);
+    }
+
+    builder_interrupted = signal;
+
+    if (write(builder_sigchld_fds[1], "", 1) == -1) {
+      // The pipe is full, which already wakes the poll up
+    }
+
+    errno = saved_errno;
+  }
+)
+
+/**
+ * @brief Sets a descriptor to be closed on exec, and optionally to not block.
+ * @param fd The descriptor.
+ * @param nonblock `true` to also set `O_NONBLOCK`.
+ * @return `true` on success, `false` on failure.
+ */
+bool builder_fd_setup(int fd, bool nonblock) impl({
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+    return false;
+
+  return !nonblock || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != -1;
+});
+
+/**
+ * @brief Installs the SIGCHLD handler that `builder_poll_events` waits on, and the handlers forwarding
+ * SIGINT, SIGTERM and SIGHUP to the jobs. Does nothing after the first call.
+ * @return `true` if the handlers are installed, `false` on failure.
+ */
+bool builder_events_init(void) impl({
+  static const int interruptions[] = { SIGINT, SIGTERM, SIGHUP };
+  struct sigaction action;
+
+  if (builder_sigchld_fds[0] != -1)
+    return true;
+
+  if (pipe(builder_sigchld_fds) == -1) {
+    builder_sigchld_fds[0] = builder_sigchld_fds[1] = -1;
+
+    return false;
+  }
+
+  builder_fd_setup(builder_sigchld_fds[0], true);
+  builder_fd_setup(builder_sigchld_fds[1], true);
+
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+
+  action.sa_handler = builder_on_interrupt;
+  action.sa_flags = SA_RESTART;
+
+  for (size_t i = 0; i < sizeof(interruptions) / sizeof(interruptions[0]); i++) {
+    struct sigaction old;
+
+    // Signals ignored by whoever started us (e.g. `nohup`) stay ignored
+    if (sigaction(interruptions[i], NULL, &old) == 0 && old.sa_handler != SIG_IGN) {
+      sigaction(interruptions[i], &action, NULL);
+    }
+  }
+
+  action.sa_handler = builder_on_sigchld;
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+
+  return sigaction(SIGCHLD, &action, NULL) == 0;
+});
+
+#ifdef __linux__
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+#ifndef F_GETPIPE_SZ
+#define F_GETPIPE_SZ 1032
+#endif
+#ifndef SPLICE_F_NONBLOCK
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+/**
+ * @brief Grows a pipe to `BUILDER_PIPE_SIZE`, so a job rarely blocks on it before it is read.
+ * @param fd Either end of the pipe.
+ * @return The capacity of the pipe, or 0 if it can't be queried.
+ */
+int builder_pipe_grow(int fd) impl({
+  // Fails once the per-user pipe memory is used up, the pipe then keeps its default size
+  fcntl(fd, F_SETPIPE_SZ, BUILDER_PIPE_SIZE);
+
+  int size = fcntl(fd, F_GETPIPE_SZ);
+
+  return size > 0 ? size : 0;
+});
+
+/**
+ * @brief Returns the number of bytes waiting to be read from a pipe.
+ * @param fd The read end of the pipe.
+ * @return The number of bytes in the pipe, or 0 if it can't be queried.
+ */
+int builder_pipe_pending(int fd) impl({
+  int pending = 0;
+
+  return ioctl(fd, FIONREAD, &pending) == 0 ? pending : 0;
+});
+
+/**
+ * @brief Moves the data waiting in a pipe to another descriptor without copying it through the build script.
+ * @param in The read end of the pipe.
+ * @param out The descriptor to write to.
+ * @return `true` once the pipe is empty, `false` if splicing isn't possible between the two descriptors.
+ */
+bool builder_pipe_splice(int in, int out) impl({
+  for (;;) {
+    long moved = syscall(SYS_splice, in, NULL, out, NULL, (size_t)BUILDER_PIPE_SIZE, SPLICE_F_NONBLOCK);
+
+    if (moved > 0)
+      continue;
+
+    if (moved == -1 && errno == EINTR)
+      continue;
+
+    // EAGAIN means a process inherited the pipe and keeps it open, what's there was moved
+    return moved == 0 || (errno == EAGAIN && builder_pipe_pending(in) == 0);
+  }
+});
+#else
+int builder_pipe_grow(int fd) impl({
+  (void)fd;
+
+  return 0;
+});
+
+int builder_pipe_pending(int fd) impl({
+  (void)fd;
+
+  return 0;
+});
+
+bool builder_pipe_splice(int in, int out) impl({
+  (void)in;
+  (void)out;
+
+  return false;
+});
+#endif
+
+/**
+ * @brief Reads the data waiting in one of a job's output pipes, closing the pipe at end of file.
+ * @param output The output of the job.
+ * @param stream 0 for stdout, 1 for stderr.
+ */
+void builder_output_read(job_output_t *output, int stream) impl({
+  while (output->fds[stream] != -1) {
+    if (output->capacities[stream] - output->lengths[stream] < 4096) {
+      output->capacities[stream] = output->capacities[stream] ? output->capacities[stream] * 2 : 8192;
+      output->data[stream] = (char *)realloc(output->data[stream], output->capacities[stream]);
+    }
+
+    ssize_t count = read(output->fds[stream], output->data[stream] + output->lengths[stream],
+        output->capacities[stream] - output->lengths[stream]);
+
+    if (count > 0) {
+      output->lengths[stream] += (size_t)count;
+    } else if (count == 0) {
+      close(output->fds[stream]);
+      output->fds[stream] = -1;
+    } else if (errno != EINTR) {
+      // EAGAIN, the pipe is empty for now
+      break;
+    }
+  }
+});
+
+/**
+ * @brief Writes a whole buffer to a descriptor.
+ * @param fd The descriptor to write to.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @return `true` on success, `false` on failure.
+ */
+bool builder_write_all(int fd, const char *data, size_t length) impl({
+  while (length > 0) {
+    ssize_t count = write(fd, data, length);
+
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+
+      return false;
+    }
+
+    data += count;
+    length -= (size_t)count;
+  }
+
+  return true;
+});
+
+/**
+ * @brief Closes a job's output pipes and frees the output read from them, without printing it.
+ * @param output The output of the job.
+ */
+void builder_output_free(job_output_t *output) impl({
+  for (int stream = 0; stream < 2; stream++) {
+    if (output->fds[stream] != -1) {
+      close(output->fds[stream]);
+    }
+
+    free(output->data[stream]);
+  }
+
+  *output = (job_output_t){ .fds = { -1, -1 } };
+});
+
+/**
+ * @brief Prints the output of a job that is done to the build script's stdout and stderr, then frees it.
+ * @param output The output of the job.
+ * @param print `false` to drop the output instead.
+ */
+void builder_output_flush(job_output_t *output, bool print) impl({
+  for (int stream = 0; print && stream < 2; stream++) {
+    int out = stream == 0 ? STDOUT_FILENO : STDERR_FILENO;
+
+    if (output->fds[stream] == -1 && output->lengths[stream] == 0)
+      continue;
+
+    // Whatever the build script printed itself comes first, the progress line is drawn again on the next update
+    builder_progress_clear();
+    fflush(stream == 0 ? stdout : stderr);
+
+    builder_write_all(out, output->data[stream], output->lengths[stream]);
+
+    // The rest of the output waits in the pipe, move it without reading it in
+    if (output->fds[stream] != -1 && !builder_pipe_splice(output->fds[stream], out)) {
+      output->lengths[stream] = 0;
+
+      builder_output_read(output, stream);
+      builder_write_all(out, output->data[stream], output->lengths[stream]);
+    }
+  }
+
+  builder_output_free(output);
+});
+
+/**
+ * @brief Creates a pipe to capture one of a job's output streams.
+ * @param output The output of the job.
+ * @param stream 0 for stdout, 1 for stderr.
+ * @return The write end of the pipe, to be given to the child, or -1 on failure.
+ */
+int builder_output_pipe(job_output_t *output, int stream) impl({
+  int fds[2];
+
+  if (pipe(fds) == -1)
+    return -1;
+
+  // Both ends are closed on exec, the write end is duplicated onto the child's stdout or stderr
+  if (!builder_fd_setup(fds[0], true) || !builder_fd_setup(fds[1], false)) {
+    close(fds[0]);
+    close(fds[1]);
+
+    return -1;
+  }
+
+  output->fds[stream] = fds[0];
+  builder_pipe_grow(fds[0]);
+
+  return fds[1];
+});
+
+/**
+ * @brief Starts a process for a job, capturing its stdout and stderr unless they are redirected.
+ * @param job The job the process belongs to. Output captured from a previous process is dropped.
+ * @param argv The argument vector of the process, ending with NULL.
+ * @param options How to set up the process, or NULL for the defaults.
+ * @return The process ID of the child on success, or -1 on failure.
+ */
+pid_t builder_job_run(job_t *job, char **argv, const spawn_options_t *options) impl({
+  spawn_options_t captured = options ? *options : (spawn_options_t){0};
+  int stdout_fd = -1, stderr_fd = -1;
+
+  builder_output_free(&job->output);
+
+  // Stopped on their own by fail-fast and timeouts, and interrupted by the build script
+  captured.process_group = true;
+
+  // A process group in the background reading the terminal would be stopped
+  if (!captured.stdin_path && !captured.stdin_fd && isatty(STDIN_FILENO)) {
+    captured.stdin_path = "/dev/null";
+  }
+
+  // Without the SIGCHLD wakeup, waiting for jobs couldn't read their pipes in the meantime
+  if (builder_events_init() && builder_output_capture) {
+    if (!captured.stdout_path && !captured.stdout_fd) {
+      stdout_fd = builder_output_pipe(&job->output, 0);
+      captured.stdout_fd = stdout_fd != -1 ? stdout_fd : 0;
+    }
+
+    if (!captured.stderr_path && !captured.stderr_fd && !captured.stderr_to_stdout) {
+      stderr_fd = builder_output_pipe(&job->output, 1);
+      captured.stderr_fd = stderr_fd != -1 ? stderr_fd : 0;
+    }
+  }
+
+  pid_t pid = run_command_ex(argv[0], argv, &captured);
+
+  if (stdout_fd != -1) close(stdout_fd);
+  if (stderr_fd != -1) close(stderr_fd);
+
+  if (pid == -1) {
+    builder_output_free(&job->output);
+  }
+
+  return pid;
+});
+
+/**
+ * @brief Waits until a child may have exited, reading the output pipes of the running jobs meanwhile.
+ * @param timeout_ms The longest time to wait in milliseconds, or -1 to wait for a child.
+ * @return `true` if a queued job waiting for a jobserver token may get one now.
+ */
+bool builder_poll_events(int timeout_ms) impl({
+  // Kept between calls, the build waits for jobs in a loop
+  static struct pollfd *fds = NULL;
+  static size_t capacity = 0;
+  nfds_t count = 0;
+  int sigchld = -1, jobserver = -1;
+  bool token = false;
+
+  if (capacity < 2 + builder_running_count * 2) {
+    capacity = 2 + builder_running_count * 2;
+    fds = (struct pollfd *)realloc(fds, sizeof(struct pollfd) * capacity);
+  }
+
+  if (builder_sigchld_fds[0] != -1) {
+    sigchld = (int)count;
+    fds[count++] = (struct pollfd){ .fd = builder_sigchld_fds[0], .events = POLLIN };
+  }
+
+  if (builder_jobserver_waiting && builder_jobserver_active()) {
+    jobserver = (int)count;
+    fds[count++] = (struct pollfd){ .fd = builder_jobserver_fds[0], .events = POLLIN };
+  }
+
+  nfds_t pipes = count;
+
+  for (size_t i = 0; i < builder_running_count; i++) {
+    job_output_t *output = &builder_running_jobs[i]->output;
+
+    for (int stream = 0; stream < 2; stream++) {
+      if (output->fds[stream] != -1) {
+        fds[count++] = (struct pollfd){ .fd = output->fds[stream], .events = POLLIN };
+      }
+    }
+  }
+
+  if (poll(fds, count, timeout_ms) <= 0) {
+    return false;
+  }
+
+  token = jobserver != -1 && (fds[jobserver].revents & (POLLIN | POLLHUP));
+
+  if (sigchld != -1 && (fds[sigchld].revents & POLLIN)) {
+    char buffer[64];
+
+    while (read(builder_sigchld_fds[0], buffer, sizeof(buffer)) > 0) {}
+  }
+
+  // The pipes are in the order they were added in, only those with data (or closed) are read
+  for (size_t i = 0; i < builder_running_count; i++) {
+    job_output_t *output = &builder_running_jobs[i]->output;
+
+    for (int stream = 0; stream < 2; stream++) {
+      if (output->fds[stream] != -1 && (fds[pipes++].revents & (POLLIN | POLLHUP | POLLERR))) {
+        builder_output_read(output, stream);
+      }
+    }
+  }
+
+  return token;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// Compiler cache ///////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief The default size limit of the compiler cache, in bytes. Can be defined before including builder.h. */
+#ifndef BUILDER_CACHE_MAX_SIZE
+#define BUILDER_CACHE_MAX_SIZE (5ULL * 1024 * 1024 * 1024)
+#endif
+
+/**
+ * @brief Whether cache hits may be hard links to the cache entries instead of copies, like ccache's `hard_link`.
+ * Off by default: a linked object shares its inode with the entry, so a tool that modifies it in place (or anyone
+ * writing as root, despite the read-only entry) corrupts the cache. Can be defined before including builder.h.
+ */
+#ifndef BUILDER_CACHE_HARD_LINKS
+#define BUILDER_CACHE_HARD_LINKS 0
+#endif
+
+/** @brief The compiler cache directory, or NULL if the cache is disabled. */
+impl_global(char *builder_cache_dir, NULL);
+/** @brief The size limit of the compiler cache, in bytes. */
+impl_global(uint64_t builder_cache_max_size, BUILDER_CACHE_MAX_SIZE);
+/** @brief The number of cache hits during this run. */
+impl_global(size_t builder_cache_hits, 0);
+/** @brief The number of cache misses during this run. */
+impl_global(size_t builder_cache_misses, 0);
+/** @brief The number of objects stored in the cache during this run. */
+impl_global(size_t builder_cache_stores, 0);
+
+/** @brief The stages of a cached compile. */
+typedef enum job_cache_stage_t {
+  /** @brief The source is being preprocessed to compute the cache key. */
+  CACHE_PREPROCESSING,
+  /** @brief The cache missed and the real command is running. */
+  CACHE_COMPILING,
+} job_cache_stage_t;
+
+/** @brief The compiler cache lookup of a job. */
+typedef struct job_cache_t {
+  /** @brief The current stage of the lookup. */
+  job_cache_stage_t stage;
+  /** @brief The command preprocessing the source, ending with NULL. */
+  char **preprocess_argv;
+  /** @brief Where the preprocessed source is written. */
+  char *preprocessed;
+  /** @brief The object file and the depfile written by the command (the depfile may be NULL). */
+  char *output, *depfile;
+  /** @brief The path of the cache entry, without the ".o"/".d" suffix. */
+  char *entry;
+} job_cache_t;
+
+/** @brief The identity of a compiler executable, cached for the whole run. */
+typedef struct compiler_id_t {
+  /** @brief The resolved path of the compiler. */
+  char *path;
+  /** @brief A hash of the compiler's `--version` output, size and modification time. */
+  uint64_t hash;
+} compiler_id_t;
+
+/** @brief The compilers identified during this run. */
+impl_global(compiler_id_t *builder_compilers, NULL);
+/** @brief The number of identified compilers. */
+impl_global(size_t builder_compilers_count, 0);
+
+/**
+ * @brief Enables the compiler cache, storing objects in the given directory.
+ * @param dir The cache directory, created if needed.
+ * @param max_size The size limit of the cache in bytes, or 0 for `BUILDER_CACHE_MAX_SIZE`.
+ * @return `true` on success, `false` if the directory couldn't be created.
+ */
+bool builder_cache_enable(const char *dir, uint64_t max_size) impl({
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/tmp", dir);
+
+  if ((mkdir(dir, 0755) != 0 && errno != EEXIST) || (mkdir(path, 0755) != 0 && errno != EEXIST)) {
+    error("couldn't create cache directory %s: %s", dir, strerror(errno));
+
+    return false;
+  }
+
+  free(builder_cache_dir);
+
+  builder_cache_dir = strdup(dir);
+  builder_cache_max_size = max_size ? max_size : BUILDER_CACHE_MAX_SIZE;
+
+  return true;
+});
+
+/**
+ * @brief Identifies a compiler by its `--version` output, size and modification time.
+ * @param path The resolved path of the compiler.
+ * @param hash Where to store the identity hash.
+ * @return `true` on success, `false` if the compiler couldn't be run.
+ */
+bool builder_compiler_id(const char *path, uint64_t *hash) impl({
+  char version_path[PATH_MAX];
+  struct stat st;
+
+  for (size_t i = 0; i < builder_compilers_count; i++) {
+    if (strcmp(builder_compilers[i].path, path) == 0) {
+      *hash = builder_compilers[i].hash;
+
+      return true;
+    }
+  }
+
+  if (stat(path, &st) != 0) {
+    return false;
+  }
+
+  snprintf(version_path, sizeof(version_path), "%s/tmp/version-%d", builder_cache_dir, (int)getpid());
+
+  spawn_options_t options = { .stdout_path = version_path, .stderr_to_stdout = true };
+  pid_t pid = run_command_ex(path, StringArrayN((char *)path, "--version"), &options);
+
+  if (pid == -1 || wait_pid_sync(pid) != 0 || !hash_file(version_path, hash)) {
+    unlink(version_path);
+
+    return false;
+  }
+
+  unlink(version_path);
+
+  uint64_t identity[3] = { *hash, (uint64_t)st.st_size, builder_stat_mtime_ns(&st) };
+
+  *hash = hash_bytes(identity, sizeof(identity), 0);
+
+  builder_compilers = (compiler_id_t *)realloc(builder_compilers, sizeof(compiler_id_t) * (builder_compilers_count + 1));
+  builder_compilers[builder_compilers_count++] = (compiler_id_t){ .path = strdup(path), .hash = *hash };
+
+  return true;
+});
+
+/**
+ * @brief Checks if an argument names a source file the compiler preprocesses.
+ * @param arg The argument.
+ * @return `true` if the argument ends with a C, C++, Objective-C or preprocessed assembly suffix.
+ */
+bool builder_is_source_file(const char *arg) impl({
+  static const char *suffixes[] = { ".c", ".cc", ".cpp", ".cxx", ".c++", ".C", ".m", ".mm", ".S" };
+  const char *dot = strrchr(arg, '.');
+
+  if (!dot || *arg == '-') {
+    return false;
+  }
+
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    if (strcmp(dot, suffixes[i]) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+});
+
+/**
+ * @brief Finds the object a command compiles, if it compiles a single source with `-c` and `-o`.
+ * @param argv The argument vector of the command, ending with NULL.
+ * @return The path of the object, or NULL if the command compiles something else, reads a response
+ * file or stdin, or writes preprocessed source or assembly.
+ */
+const char *builder_command_object(char **argv) impl({
+  const char *output = NULL;
+  size_t sources = 0;
+  bool compile_only = false;
+
+  for (size_t i = 1; argv[0] && argv[i]; i++) {
+    const char *arg = argv[i];
+
+    if (strcmp(arg, "-c") == 0) {
+      compile_only = true;
+    } else if (strcmp(arg, "-o") == 0 && argv[i + 1]) {
+      output = argv[i + 1];
+    } else if (arg[0] == '@' || strcmp(arg, "-") == 0 || strcmp(arg, "-E") == 0 || strcmp(arg, "-S") == 0) {
+      // Response files, stdin and other outputs than objects
+      return NULL;
+    } else if (builder_is_source_file(arg)) {
+      sources++;
+    }
+  }
+
+  return compile_only && sources == 1 ? output : NULL;
+});
+
+/**
+ * @brief Sets up the cache lookup of a job, if its command compiles a single source to an object.
+ * @param job The job about to start.
+ * @return `true` if the job's command can be cached, `false` otherwise.
+ */
+bool builder_cache_prepare(job_t *job) impl({
+  static unsigned counter = 0;
+  char depfile[PATH_MAX], path[PATH_MAX];
+  const char *output = builder_command_object(job->argv);
+  size_t argc = 0;
+
+  if (!output) {
+    return false;
+  }
+
+  while (job->argv[argc]) {
+    argc++;
+  }
+
+  job_cache_t *cache = (typeof(cache)) calloc(1, sizeof(job_cache_t));
+
+  snprintf(path, sizeof(path), "%s/tmp/%d-%u.i", builder_cache_dir, (int)getpid(), counter++);
+
+  cache->stage = CACHE_PREPROCESSING;
+  cache->preprocessed = strdup(path);
+  cache->output = strdup(output);
+  cache->depfile = builder_command_depfile(job->argv, depfile) ? strdup(depfile) : NULL;
+  cache->preprocess_argv = (char **)calloc(argc + 1, sizeof(char *));
+
+  // Same command, with -E instead of -c, into a temporary file and without writing a depfile
+  for (size_t i = 0, j = 0; i < argc; i++) {
+    const char *arg = job->argv[i];
+
+    if (i > 0 && strcmp(arg, "-c") == 0) {
+      arg = "-E";
+    } else if (i > 0 && strcmp(arg, "-o") == 0) {
+      cache->preprocess_argv[j++] = strdup("-o");
+      cache->preprocess_argv[j++] = strdup(cache->preprocessed);
+      i++;
+      continue;
+    } else if (i > 0 && (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0)) {
+      continue;
+    } else if (i > 0 && (strcmp(arg, "-MF") == 0 || strcmp(arg, "-MT") == 0 || strcmp(arg, "-MQ") == 0)) {
+      i++;
+      continue;
+    } else if (i > 0 && (strncmp(arg, "-MF", 3) == 0 || strncmp(arg, "-MT", 3) == 0 || strncmp(arg, "-MQ", 3) == 0)) {
+      continue;
+    }
+
+    cache->preprocess_argv[j++] = strdup(arg);
+  }
+
+  job->cache = cache;
+
+  return true;
+});
+
+/**
+ * @brief Frees the cache lookup of a job, removing its temporary files.
+ * @param job The job.
+ */
+void builder_cache_free(job_t *job) impl({
+  job_cache_t *cache = job->cache;
+
+  if (!cache) {
+    return;
+  }
+
+  unlink(cache->preprocessed);
+
+  for (size_t i = 0; cache->preprocess_argv[i]; i++) {
+    free(cache->preprocess_argv[i]);
+  }
+
+  free(cache->preprocess_argv);
+  free(cache->preprocessed);
+  free(cache->output);
+  free(cache->depfile);
+  free(cache->entry);
+  free(cache);
+
+  job->cache = NULL;
+});
+
+#ifdef FICLONE
+/**
+ * @brief Shares the blocks of `src` with `dst` (a reflink), on file systems that support it.
+ * @return `true` on success, `false` if it isn't supported.
+ */
+bool builder_reflink(int src, int dst) impl({
+  return ioctl(dst, FICLONE, src) == 0;
+});
+#else
+/**
+ * @brief Stands in for reflinks on platforms without `FICLONE`.
+ * @return `false`, reflinks aren't supported.
+ */
+bool builder_reflink(int src, int dst) impl({
+  (void)src;
+  (void)dst;
+
+  return false;
+});
+#endif
+
+/**
+ * @brief Makes `dst` a copy of `src`, with a reflink if possible, then optionally a hard link,
+ * and as a last resort by copying the bytes.
+ * @param src The path of the file to copy.
+ * @param dst The path of the copy. It is replaced if it exists.
+ * @param allow_link `true` if `dst` may be a hard link to `src`.
+ * @param mode The permissions of `dst` if it gets created.
+ * @return `true` on success, `false` otherwise.
+ */
+bool builder_file_clone(const char *src, const char *dst, bool allow_link, mode_t mode) impl({
+  char buffer[64 * 1024];
+  ssize_t len;
+  bool ok = true;
+
+  // Never write through a hard link to another file
+  unlink(dst);
+
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+
+  if (in == -1) {
+    return false;
+  }
+
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+
+  if (out == -1) {
+    close(in);
+
+    return false;
+  }
+
+  if (builder_reflink(in, out)) {
+    close(in);
+
+    return close(out) == 0;
+  }
+
+  if (allow_link) {
+    close(out);
+
+    if (unlink(dst) == 0 && link(src, dst) == 0) {
+      close(in);
+
+      return true;
+    }
+
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+
+    if (out == -1) {
+      close(in);
+
+      return false;
+    }
+  }
+
+  while (ok && (len = read(in, buffer, sizeof(buffer))) != 0) {
+    if (len == -1) {
+      ok = errno == EINTR;
+      continue;
+    }
+
+    for (ssize_t written = 0, n; ok && written < len; written += n) {
+      n = write(out, buffer + written, (size_t)(len - written));
+      ok = n > 0;
+    }
+  }
+
+  close(in);
+
+  return close(out) == 0 && ok;
+});
+
+/**
+ * @brief Checks if a compile records its working directory in the object, like debug info's compilation
+ * directory or the paths of coverage data.
+ * @param argv The argument vector of the command, ending with NULL.
+ * @return `true` if the object depends on the working directory, `false` otherwise.
+ */
+bool builder_command_records_cwd(char **argv) impl({
+  bool recorded = false;
+
+  for (size_t i = 1; argv[i]; i++) {
+    const char *arg = argv[i];
+
+    if (arg[0] == '-' && arg[1] == 'g') {
+      // The last -g wins, -g0 turns debug info back off
+      recorded = strcmp(arg, "-g0") != 0;
+    } else if (strcmp(arg, "--coverage") == 0 || strcmp(arg, "-ftest-coverage") == 0 ||
+               strcmp(arg, "-fprofile-arcs") == 0) {
+      return true;
+    }
+  }
+
+  return recorded;
+});
+
+/**
+ * @brief Computes the cache entry of a job from its preprocessed source, compiler and flags.
+ * @param job The job, whose source was preprocessed.
+ * @return `true` on success, `false` if the compiler couldn't be identified.
+ */
+bool builder_cache_key(job_t *job) impl({
+  char compiler[PATH_MAX], cwd[PATH_MAX], path[PATH_MAX];
+  uint64_t compiler_hash, source_hash;
+  hash_state_t state;
+
+  char **env = job->options ? job->options->env : NULL;
+
+  if (!builder_resolve_executable_env(job->argv[0], env, compiler) || !builder_compiler_id(compiler, &compiler_hash) ||
+      !hash_file(job->cache->preprocessed, &source_hash)) {
+    return false;
+  }
+
+  hash_init(&state, 0);
+  hash_update(&state, &compiler_hash, sizeof(compiler_hash));
+  hash_update(&state, &source_hash, sizeof(source_hash));
+
+  // Only objects that embed the directory differ between two checkouts, the others are shared
+  if (builder_command_records_cwd(job->argv)) {
+    const char *dir = job->options && job->options->cwd ? job->options->cwd : getcwd(cwd, sizeof(cwd));
+
+    if (!dir) {
+      return false;
+    }
+
+    hash_update(&state, dir, strlen(dir) + 1);
+  }
+
+  // The flags, including the output names the depfile refers to
+  for (size_t i = 1; job->argv[i]; i++) {
+    hash_update(&state, job->argv[i], strlen(job->argv[i]) + 1);
+  }
+
+  // An explicit environment may change what the compiler does, the inherited one isn't tracked
+  for (size_t i = 0; env && env[i]; i++) {
+    hash_update(&state, "\0env", 4);
+    hash_update(&state, env[i], strlen(env[i]) + 1);
+  }
+
+  uint64_t key = hash_digest(&state);
+
+  snprintf(path, sizeof(path), "%s/%02x", builder_cache_dir, (unsigned)(key >> 56));
+  mkdir(path, 0755);
+
+  snprintf(path, sizeof(path), "%s/%02x/%016" PRIx64, builder_cache_dir, (unsigned)(key >> 56), key);
+
+  job->cache->entry = strdup(path);
+
+  return true;
+});
+
+/**
+ * @brief Starts the process of a job: its preprocessing step when the job is cached, its command otherwise.
+ * @param job The job to start.
+ * @return The process ID of the child on success, or -1 on failure.
+ */
+pid_t builder_job_spawn(job_t *job) impl({
+  if (builder_cache_dir && !job->cache && builder_cache_prepare(job)) {
+    pid_t pid = builder_job_run(job, job->cache->preprocess_argv, job->options);
+
+    if (pid != -1) {
+      return pid;
+    }
+
+    builder_cache_free(job);
+  }
+
+  return builder_job_run(job, job->argv, job->options);
+});
+
+/**
+ * @brief Advances the cache lookup of a job once its current process exited.
+ *
+ * After preprocessing, a hit materializes the cached object (and depfile) and finishes the job,
+ * while a miss starts the real command. After a successful compile, the outputs are stored.
+ * @param job The job, with a cache lookup.
+ * @param status The wait status of the process. Replaced by a successful status on a hit.
+ * @return `true` if the job was given a new process, `false` if it is done.
+ */
+bool builder_cache_step(job_t *job, int *status) impl({
+  job_cache_t *cache = job->cache;
+  char object[PATH_MAX], depfile[PATH_MAX];
+  bool ok = WIFEXITED(*status) && WEXITSTATUS(*status) == 0;
+
+  if (cache->stage == CACHE_PREPROCESSING) {
+    if (ok && builder_cache_key(job)) {
+      struct stat st;
+
+      snprintf(object, sizeof(object), "%s.o", cache->entry);
+      snprintf(depfile, sizeof(depfile), "%s.d", cache->entry);
+
+      // Root writes through the read-only entries, it always gets copies
+      bool hard_link = BUILDER_CACHE_HARD_LINKS && geteuid() != 0;
+
+      if (stat(object, &st) == 0 && builder_file_clone(object, cache->output, hard_link, 0644) &&
+          (!cache->depfile || builder_file_clone(depfile, cache->depfile, false, 0644))) {
+        // Refresh the entry, the least recently used ones are evicted first
+        utimensat(AT_FDCWD, object, NULL, 0);
+        utimensat(AT_FDCWD, depfile, NULL, 0);
+
+        builder_cache_hits++;
+        builder_cache_free(job);
+
+        *status = 0;
+
+        return false;
+      }
+    }
+
+    builder_cache_misses++;
+
+    // The output may be a hard link to a cache entry, don't let the compiler write through it
+    unlink(cache->output);
+
+    cache->stage = CACHE_COMPILING;
+    // Drops the diagnostics of preprocessing, the compiler reports them again
+    job->pid = builder_job_run(job, job->argv, job->options);
+
+    if (job->pid == -1) {
+      // Same encoding as a process that exited with 127
+      *status = 127 << 8;
+
+      builder_cache_free(job);
+
+      return false;
+    }
+
+    return true;
+  }
+
+  if (ok && cache->entry) {
+    snprintf(object, sizeof(object), "%s.o", cache->entry);
+    snprintf(depfile, sizeof(depfile), "%s.d", cache->entry);
+
+    // Stored read-only, so entries handed out as hard links can't be modified in place
+    if (builder_file_clone(cache->output, object, false, 0444) &&
+        (!cache->depfile || builder_file_clone(cache->depfile, depfile, false, 0444))) {
+      builder_cache_stores++;
+    } else {
+      unlink(object);
+    }
+  }
+
+  builder_cache_free(job);
+
+  return false;
+});
+
+/** @brief An entry of the cache directory (its object and depfile), used to evict the least recently used ones. */
+typedef struct cache_file_t {
+  /** @brief The path of the entry, without the ".o"/".d" suffix. */
+  char *path;
+  /** @brief The last time the entry was used, in nanoseconds. */
+  uint64_t mtime_ns,
+  /** @brief The size of the entry's files in bytes. */
+           size;
+} cache_file_t;
+
+impl(
+  /**
+   * @brief Orders cache entries from the least to the most recently used.
+   */
+  static int builder_cache_file_compare(const void *a, const void *b) {
+    const cache_file_t *left = (const cache_file_t *)a, *right = (const cache_file_t *)b;
+
+    return left->mtime_ns < right->mtime_ns ? -1 : left->mtime_ns > right->mtime_ns;
+  }
+)
+
+/**
+ * @brief Evicts the least recently used entries until the cache is under 90% of its size limit.
+ * Only done when objects were stored during this run.
+ */
+void builder_cache_trim() impl({
+  cache_file_t *files = NULL;
+  size_t count = 0, size = 0;
+  uint64_t total = 0;
+  char path[PATH_MAX];
+  struct stat st;
+
+  if (!builder_cache_dir) {
+    return;
+  }
+
+  if (builder_cache_hits || builder_cache_misses) {
+    info("compiler cache: %zu hits, %zu misses", builder_cache_hits, builder_cache_misses);
+  }
+
+  if (builder_cache_stores == 0) {
+    return;
+  }
+
+  for (unsigned prefix = 0; prefix < 256; prefix++) {
+    snprintf(path, sizeof(path), "%s/%02x", builder_cache_dir, prefix);
+
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+
+    if (!dir) {
+      continue;
+    }
+
+    while ((entry = readdir(dir))) {
+      size_t len = strlen(entry->d_name);
+
+      if (entry->d_name[0] == '.' || len < 3 || entry->d_name[len - 2] != '.') {
+        continue;
+      }
+
+      char suffix = entry->d_name[len - 1];
+
+      if (suffix != 'o' && suffix != 'd') {
+        continue;
+      }
+
+      // An entry is accounted for once, from its object, or from its depfile if the object is gone
+      snprintf(path, sizeof(path), "%s/%02x/%.*s.o", builder_cache_dir, prefix, (int)(len - 2), entry->d_name);
+
+      bool has_object = stat(path, &st) == 0;
+
+      if (suffix == 'd' && has_object) {
+        continue;
+      }
+
+      uint64_t mtime_ns = has_object ? builder_stat_mtime_ns(&st) : 0, bytes = has_object ? (uint64_t)st.st_size : 0;
+
+      path[strlen(path) - 1] = 'd';
+
+      if (stat(path, &st) == 0) {
+        uint64_t depfile_mtime_ns = builder_stat_mtime_ns(&st);
+
+        mtime_ns = depfile_mtime_ns > mtime_ns ? depfile_mtime_ns : mtime_ns;
+        bytes += (uint64_t)st.st_size;
+      } else if (!has_object) {
+        continue;
+      }
+
+      if (size <= count) {
+        size = (size + 1) * 2;
+        files = (cache_file_t *)realloc(files, sizeof(cache_file_t) * size);
+      }
+
+      path[strlen(path) - 2] = '\0';
+
+      files[count++] = (cache_file_t){ strdup(path), mtime_ns, bytes };
+      total += bytes;
+    }
+
+    closedir(dir);
+  }
+
+  if (total > builder_cache_max_size) {
+    qsort(files, count, sizeof(cache_file_t), builder_cache_file_compare);
+
+    for (size_t i = 0; i < count && total > builder_cache_max_size / 10 * 9; i++) {
+      // The object goes first, an entry without one is a miss even if its depfile is left behind
+      snprintf(path, sizeof(path), "%s.o", files[i].path);
+      unlink(path);
+      snprintf(path, sizeof(path), "%s.d", files[i].path);
+      unlink(path);
+
+      total -= files[i].size;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    free(files[i].path);
+  }
+
+  free(files);
+});
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Compilation database /////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief The magic number at the start of the recorded compile commands ("BCDB"). */
+#define BUILDER_COMPDB_MAGIC 0x42444342u
+
+/** @brief A compile command of the compilation database. */
+typedef struct compdb_entry_t {
+  /** @brief The directory and the output (or the source) of the command, or NULL if the slot is empty. */
+  char *key;
+  /** @brief The absolute path of the source file compiled. */
+  char *file;
+  /** @brief The entry as it is written to the database, a JSON object. */
+  char *json;
+} compdb_entry_t;
+
+/** @brief The compile commands of every build so far, an open-addressing hash table. */
+typedef struct compdb_t {
+  /** @brief The number of slots in the table, always a power of two. */
+  size_t size,
+  /** @brief The number of used slots. */
+         current;
+  /** @brief The slots of the table. */
+  compdb_entry_t *items;
+  /** @brief The `compile_commands.json` to write, or NULL if the database is disabled. */
+  char *path;
+  /** @brief `true` once the recorded commands were read. */
+  bool loaded,
+  /** @brief `true` if an entry changed since the recorded commands were read. */
+       dirty;
+} compdb_t;
+
+/** @brief The compile commands recorded in `BUILDER_STATE_DIR/compdb`. */
+impl_global(compdb_t builder_compdb, {0});
+
+impl(
+  /**
+   * @brief Finds the slot of a key in the compilation database.
+   */
+  static compdb_entry_t *builder_compdb_slot(const char *key) {
+    size_t mask = builder_compdb.size - 1;
+    size_t i = builder_hash_string(key) & mask;
+
+    while (builder_compdb.items[i].key && strcmp(builder_compdb.items[i].key, key) != 0) {
+      i = (i + 1) & mask;
+    }
+
+    return &builder_compdb.items[i];
+  }
+
+  /**
+   * @brief Creates or replaces an entry of the compilation database. It takes ownership of `json`.
+   * @return `true` if the entry changed.
+   */
+  static bool builder_compdb_put(const char *key, const char *file, char *json) {
+    if (!builder_compdb.items || (builder_compdb.current + 1) * 2 > builder_compdb.size) {
+      compdb_t old = builder_compdb;
+
+      builder_compdb.size = old.size ? old.size * 2 : 256;
+      builder_compdb.items = (compdb_entry_t *)calloc(builder_compdb.size, sizeof(compdb_entry_t));
+
+      for (size_t i = 0; i < old.size; i++) {
+        if (old.items[i].key) {
+          *builder_compdb_slot(old.items[i].key) = old.items[i];
+        }
+      }
+
+      free(old.items);
+    }
+
+    compdb_entry_t *entry = builder_compdb_slot(key);
+
+    if (entry->key && strcmp(entry->json, json) == 0) {
+      free(json);
+
+      return false;
+    }
+
+    if (!entry->key) {
+      entry->key = strdup(key);
+      builder_compdb.current++;
+    } else {
+      free(entry->file);
+      free(entry->json);
+    }
+
+    entry->file = strdup(file);
+    entry->json = json;
+
+    return true;
+  }
+
+  /**
+   * @brief Reads the compile commands recorded by the previous runs, if there are any.
+   */
+  static void builder_compdb_load() {
+    uint32_t header[3];
+
+    if (builder_compdb.loaded) {
+      return;
+    }
+
+    builder_compdb.loaded = true;
+
+    FILE *file = fopen(BUILDER_STATE_DIR "/compdb", "rb");
+
+    if (!file) {
+      return;
+    }
+
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != BUILDER_COMPDB_MAGIC ||
+        header[1] != BUILDER_STATE_VERSION) {
+      fclose(file);
+
+      return;
+    }
+
+    for (uint32_t i = 0; i < header[2]; i++) {
+      uint32_t record[3];
+
+      // Each record is the lengths of the key, the file and the entry, then their bytes
+      if (fread(record, sizeof(record), 1, file) != 1 || record[0] >= PATH_MAX * 2 || record[1] >= PATH_MAX) {
+        break;
+      }
+
+      char key[PATH_MAX * 2], source[PATH_MAX];
+      char *json = (char *)malloc(record[2] + 1);
+
+      if (fread(key, 1, record[0], file) != record[0] || fread(source, 1, record[1], file) != record[1] ||
+          fread(json, 1, record[2], file) != record[2]) {
+        free(json);
+        break;
+      }
+
+      key[record[0]] = source[record[1]] = json[record[2]] = '\0';
+
+      builder_compdb_put(key, source, json);
+    }
+
+    fclose(file);
+  }
+
+  /**
+   * @brief Orders the entries of the compilation database by key for `qsort`.
+   */
+  static int builder_compdb_compare(const void *a, const void *b) {
+    return strcmp((*(compdb_entry_t *const *)a)->key, (*(compdb_entry_t *const *)b)->key);
+  }
+)
+
+/**
+ * @brief Enables the compilation database (`--compdb`): the compile commands run by this and
+ * later builds are written to a `compile_commands.json` for clangd and other tools.
+ * @param path Where to write the database, e.g., "compile_commands.json".
+ */
+void builder_compdb_enable(const char *path) impl({
+  free(builder_compdb.path);
+
+  builder_compdb.path = strdup(path);
+});
+
+/**
+ * @brief Records a command in the compilation database, if it compiles a single source file.
+ * Called for every queued command, does nothing unless the database is enabled.
+ * @param argv The argument vector of the command, ending with NULL.
+ * @param cwd The directory the command runs in, or NULL for the working directory.
+ */
+void builder_compdb_record(char **argv, const char *cwd) impl({
+  char directory[PATH_MAX], source[PATH_MAX], key[PATH_MAX * 2];
+  const char *file = NULL, *output = NULL;
+  bool compile_only = false;
+
+  if (!builder_compdb.path) {
+    return;
+  }
+
+  for (size_t i = 1; argv[0] && argv[i]; i++) {
+    if (strcmp(argv[i], "-c") == 0) {
+      compile_only = true;
+    } else if (strcmp(argv[i], "-o") == 0 && argv[i + 1]) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "-E") == 0 || strcmp(argv[i], "-S") == 0) {
+      return;
+    } else if (argv[i][0] != '-' && builder_is_source_file(argv[i])) {
+      // Commands compiling several sources at once have no single entry
+      if (file) return;
+
+      file = argv[i];
+    }
+  }
+
+  if (!compile_only || !file || !getcwd(directory, sizeof(directory))) {
+    return;
+  }
+
+  if (cwd && cwd[0] == '/') {
+    snprintf(directory, sizeof(directory), "%s", cwd);
+  } else if (cwd) {
+    size_t length = strlen(directory);
+
+    snprintf(directory + length, sizeof(directory) - length, "/%s", cwd);
+  }
+
+  int written = file[0] == '/' ? snprintf(source, sizeof(source), "%s", file)
+                               : snprintf(source, sizeof(source), "%s/%s", directory, file);
+
+  if (written < 0 || (size_t)written >= sizeof(source)) {
+    return;
+  }
+
+  snprintf(key, sizeof(key), "%s/%s", directory, output ? output : file);
+
+  char *json = NULL;
+  size_t len = 0, size = 0;
+
+  builder_buffer_append(&json, &len, &size, "{\"directory\": ");
+  builder_json_append_string(&json, &len, &size, directory);
+  builder_buffer_append(&json, &len, &size, ", \"arguments\": [");
+
+  for (size_t i = 0; argv[i]; i++) {
+    if (i > 0) builder_buffer_append(&json, &len, &size, ", ");
+
+    builder_json_append_string(&json, &len, &size, argv[i]);
+  }
+
+  builder_buffer_append(&json, &len, &size, "], \"file\": ");
+  builder_json_append_string(&json, &len, &size, file);
+
+  if (output) {
+    builder_buffer_append(&json, &len, &size, ", \"output\": ");
+    builder_json_append_string(&json, &len, &size, output);
+  }
+
+  builder_buffer_append(&json, &len, &size, "}");
+
+  builder_compdb_load();
+
+  if (builder_compdb_put(key, source, json)) {
+    builder_compdb.dirty = true;
+  }
+});
+
+/**
+ * @brief Writes the compilation database if a compile command changed, or if it was removed.
+ *
+ * Entries are kept as they are written, only the changed commands are formatted again. The
+ * database is written next to its final path and renamed over it, so tools reading it never see
+ * half of it. Commands of sources that don't exist anymore are dropped.
+ * @return `true` on success, `false` if the database couldn't be written.
+ */
+bool builder_compdb_save() impl({
+  char tmp[PATH_MAX];
+  struct stat st;
+
+  if (!builder_compdb.path || (!builder_compdb.dirty && stat(builder_compdb.path, &st) == 0)) {
+    return true;
+  }
+
+  builder_compdb_load();
+
+  compdb_entry_t **entries = (compdb_entry_t **)malloc(sizeof(compdb_entry_t *) * (builder_compdb.current + 1));
+  size_t count = 0;
+
+  for (size_t i = 0; i < builder_compdb.size; i++) {
+    if (builder_compdb.items[i].key && stat(builder_compdb.items[i].file, &st) == 0) {
+      entries[count++] = &builder_compdb.items[i];
+    }
+  }
+
+  // Sorted, so the file doesn't change with the order the commands ran in
+  qsort(entries, count, sizeof(compdb_entry_t *), builder_compdb_compare);
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", builder_compdb.path);
+
+  FILE *file = fopen(tmp, "w");
+
+  if (!file) {
+    error("couldn't write %s: %s", tmp, strerror(errno));
+    free(entries);
+
+    return false;
+  }
+
+  fputs("[\n", file);
+
+  for (size_t i = 0; i < count; i++) {
+    fprintf(file, "  %s%s\n", entries[i]->json, i + 1 < count ? "," : "");
+  }
+
+  fputs("]\n", file);
+
+  if (fclose(file) != 0 || rename(tmp, builder_compdb.path) != 0) {
+    error("couldn't write %s: %s", builder_compdb.path, strerror(errno));
+    unlink(tmp);
+    free(entries);
+
+    return false;
+  }
+
+  if (mkdir(BUILDER_STATE_DIR, 0755) != 0 && errno != EEXIST) {
+    error("couldn't create " BUILDER_STATE_DIR ": %s", strerror(errno));
+    free(entries);
+
+    return false;
+  }
+
+  // The commands that were kept are recorded for the next runs, which may not compile everything again
+  file = fopen(BUILDER_STATE_DIR "/compdb.tmp", "wb");
+
+  if (!file) {
+    error("couldn't write " BUILDER_STATE_DIR "/compdb.tmp: %s", strerror(errno));
+    free(entries);
+
+    return false;
+  }
+
+  uint32_t header[3] = { BUILDER_COMPDB_MAGIC, BUILDER_STATE_VERSION, (uint32_t)count };
+
+  fwrite(header, sizeof(header), 1, file);
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t record[3] = { (uint32_t)strlen(entries[i]->key), (uint32_t)strlen(entries[i]->file), (uint32_t)strlen(entries[i]->json) };
+
+    fwrite(record, sizeof(record), 1, file);
+    fwrite(entries[i]->key, 1, record[0], file);
+    fwrite(entries[i]->file, 1, record[1], file);
+    fwrite(entries[i]->json, 1, record[2], file);
+  }
+
+  free(entries);
+
+  if (fclose(file) != 0 || rename(BUILDER_STATE_DIR "/compdb.tmp", BUILDER_STATE_DIR "/compdb") != 0) {
+    error("couldn't write " BUILDER_STATE_DIR "/compdb: %s", strerror(errno));
+
+    return false;
+  }
+
+  builder_compdb.dirty = false;
+
+  return true;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+////////////////////////////// Remote execution //////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief The program used to reach SSH workers, where it can be changed. */
+#ifndef BUILDER_SSH_COMMAND
+#define BUILDER_SSH_COMMAND "ssh"
+#endif
+
+/** @brief The number of jobs an SSH worker runs at once, if not given. */
+#ifndef BUILDER_SSH_SLOTS
+#define BUILDER_SSH_SLOTS 4
+#endif
+
+/** @brief The exit code of a worker that couldn't set up a job, e.g. because an input is missing from its store. */
+#define BUILDER_REMOTE_TEMPFAIL 75
+
+/** @brief The exit code of `ssh` when it couldn't reach the worker. */
+#define BUILDER_SSH_UNREACHABLE 255
+
+/**
+ * @brief A backend that runs jobs elsewhere than in the local job slots, e.g. on other machines.
+ *
+ * Once the local job slots are full, the scheduler hands the next job to the first executor with
+ * a free slot that accepts it. The executor starts a local process standing for the job (e.g. `ssh`),
+ * which is reaped like the others, then gets the job's outputs back. A job the executor couldn't
+ * run, for whatever reason, runs locally instead.
+ */
+typedef struct executor_t {
+  /** @brief The name of the executor, for messages. */
+  char *name;
+  /** @brief The number of jobs the executor runs at once, 0 if it is disabled. */
+  size_t slots,
+  /** @brief The number of jobs the executor currently runs. */
+         running;
+  /** @brief Checks if the executor can run a job. */
+  bool (*accepts)(struct executor_t *executor, job_t *job);
+  /** @brief Starts the local process of an accepted job, returning its process ID or -1 on failure. */
+  pid_t (*start)(struct executor_t *executor, job_t *job);
+  /** @brief Finishes a job once its process exited, returning `true` if it is done and `false` to run it locally. */
+  bool (*finish)(struct executor_t *executor, job_t *job, int status);
+  /** @brief Frees the data of the executor, or NULL. */
+  void (*free)(struct executor_t *executor);
+  /** @brief The data of the executor. */
+  void *data;
+} executor_t;
+
+/** @brief The registered executors, tried in the order they were added. */
+impl_global(executor_t **builder_executors, NULL);
+/** @brief The number of registered executors. */
+impl_global(size_t builder_executors_count, 0);
+
+/**
+ * @brief Registers an executor, whose slots are used once the local job slots are full.
+ * @param executor The executor, allocated with `malloc`. It is owned by the build from now on.
+ */
+void builder_executor_add(executor_t *executor) impl({
+  builder_executors = (executor_t **)realloc(builder_executors, sizeof(executor_t *) * (builder_executors_count + 1));
+  builder_executors[builder_executors_count++] = executor;
+});
+
+/**
+ * @brief Removes the executors registered after the first ones, which must not be running jobs.
+ * @param count The number of executors to keep.
+ */
+void builder_executors_truncate(size_t count) impl({
+  while (builder_executors_count > count) {
+    executor_t *executor = builder_executors[--builder_executors_count];
+
+    if (executor->free) {
+      executor->free(executor);
+    }
+
+    free(executor->name);
+    free(executor);
+  }
+});
+
+/**
+ * @brief Finds an executor for a job.
+ * @param job The job about to start.
+ * @return The first executor with a free slot that accepts the job, or NULL if there is none.
+ */
+executor_t *builder_executor_find(job_t *job) impl({
+  for (size_t i = 0; i < builder_executors_count; i++) {
+    executor_t *executor = builder_executors[i];
+
+    if (executor->running < executor->slots && executor->accepts(executor, job)) {
+      return executor;
+    }
+  }
+
+  return NULL;
+});
+
+/**
+ * @brief Starts a job with an executor.
+ * @param executor The executor, which accepted the job.
+ * @param job The job to start.
+ * @return The process ID standing for the job on success, or -1 on failure.
+ */
+pid_t builder_executor_start(executor_t *executor, job_t *job) impl({
+  pid_t pid = executor->start(executor, job);
+
+  if (pid == -1) {
+    return -1;
+  }
+
+  // What the job uses on the worker isn't counted against the local memory limit
+  job->memory = 0;
+  job->executor = executor;
+
+  executor->running++;
+  builder_executors_running++;
+
+  return pid;
+});
+
+/**
+ * @brief Finishes a job run by an executor once its process exited, or runs it locally if the
+ * executor couldn't run it. The local run takes a job slot right away, the job waited long enough.
+ * @param job The job, handed to an executor.
+ * @param status The wait status of the process. Replaced by a failure to start if the local run can't start.
+ * @return `true` if the job was given a new process, `false` if it is done.
+ */
+bool builder_executor_step(job_t *job, int *status) impl({
+  executor_t *executor = job->executor;
+
+  executor->running--;
+  builder_executors_running--;
+
+  // A stopped job isn't run again
+  if (executor->finish(executor, job, *status) || job->cancelled) {
+    return false;
+  }
+
+  job->executor = NULL;
+  job->pid = builder_job_spawn(job);
+
+  if (job->pid == -1) {
+    // Same encoding as a process that exited with 127
+    *status = 127 << 8;
+
+    return false;
+  }
+
+  return true;
+});
+
+impl(
+  /**
+   * @brief Appends a tar header (in the ustar format) to an archive.
+   */
+  static bool builder_tar_header(FILE *file, const char *name, uint64_t size, uint64_t mtime) {
+    char header[512] = {0};
+    unsigned checksum = 0;
+
+    if (strlen(name) >= 100) {
+      return false;
+    }
+
+    memcpy(header, name, strlen(name));
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011" PRIo64, size);
+    snprintf(header + 136, 12, "%011" PRIo64, mtime & 077777777777);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // The checksum is computed with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+
+    for (size_t i = 0; i < sizeof(header); i++) {
+      checksum += (unsigned char)header[i];
+    }
+
+    snprintf(header + 148, 7, "%06o", checksum & 0777777);
+
+    return fwrite(header, sizeof(header), 1, file) == 1;
+  }
+
+  /**
+   * @brief Appends a file to a tar archive under another name.
+   */
+  static bool builder_tar_add(FILE *file, const char *name, const char *path) {
+    char buffer[64 * 1024];
+    struct stat st;
+    size_t len, total = 0;
+    FILE *in = fopen(path, "rb");
+
+    if (!in) {
+      return false;
+    }
+
+    if (fstat(fileno(in), &st) != 0 ||
+        !builder_tar_header(file, name, (uint64_t)st.st_size, (uint64_t)st.st_mtim.tv_sec)) {
+      fclose(in);
+
+      return false;
+    }
+
+    while ((len = fread(buffer, 1, sizeof(buffer), in)) > 0 && total + len <= (size_t)st.st_size) {
+      fwrite(buffer, 1, len, file);
+      total += len;
+    }
+
+    fclose(in);
+
+    // The header announced the size, a file that changed meanwhile would corrupt the archive
+    if (total != (size_t)st.st_size) {
+      return false;
+    }
+
+    memset(buffer, 0, 512);
+
+    return fwrite(buffer, 1, (512 - total % 512) % 512, file) == (512 - total % 512) % 512;
+  }
+
+  /**
+   * @brief Appends a file with the given content to a tar archive.
+   */
+  static bool builder_tar_add_data(FILE *file, const char *name, const void *data, size_t size) {
+    char zeros[512] = {0};
+
+    return builder_tar_header(file, name, (uint64_t)size, (uint64_t)time(NULL)) &&
+           fwrite(data, 1, size, file) == size &&
+           fwrite(zeros, 1, (512 - size % 512) % 512, file) == (512 - size % 512) % 512;
+  }
+
+  /**
+   * @brief Ends a tar archive with its two empty blocks.
+   */
+  static bool builder_tar_finish(FILE *file) {
+    char zeros[1024] = {0};
+
+    return fwrite(zeros, sizeof(zeros), 1, file) == 1;
+  }
+
+  /**
+   * @brief Extracts the regular files of a tar archive whose names are in `paths`, skipping the others.
+   * Each file is written next to its path, then renamed over it. Both ustar and GNU archives are read.
+   * @return The number of extracted files, or -1 if the archive is corrupt or a file couldn't be written.
+   */
+  static int builder_tar_extract(const char *archive, const char **paths, size_t count) {
+    char header[512], name[PATH_MAX], tmp[PATH_MAX], buffer[64 * 1024];
+    bool long_name = false;
+    int extracted = 0;
+    FILE *file = fopen(archive, "rb");
+
+    if (!file) {
+      return -1;
+    }
+
+    while (fread(header, sizeof(header), 1, file) == 1) {
+      char size_field[13] = {0};
+      const char *path = NULL;
+
+      // The archive ends with empty blocks
+      if (header[0] == '\0') {
+        break;
+      }
+
+      memcpy(size_field, header + 124, 12);
+
+      uint64_t size = strtoull(size_field, NULL, 8), padded = (size + 511) / 512 * 512;
+
+      // A GNU long name, the name of the next file is the data of this one
+      if (header[156] == 'L') {
+        if (size >= sizeof(name) || fread(name, 1, padded, file) != padded) {
+          break;
+        }
+
+        name[size] = '\0';
+        long_name = true;
+
+        continue;
+      }
+
+      if (!long_name) {
+        // Names longer than 100 bytes continue in the prefix field of ustar archives
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+          snprintf(name, sizeof(name), "%.155s/%.100s", header + 345, header);
+        } else {
+          snprintf(name, sizeof(name), "%.100s", header);
+        }
+      }
+
+      long_name = false;
+
+      for (size_t i = 0; i < count && (header[156] == '0' || header[156] == '\0'); i++) {
+        if (paths[i] && strcmp(paths[i], name) == 0) {
+          path = paths[i];
+        }
+      }
+
+      if (!path) {
+        if (fseeko(file, (off_t)padded, SEEK_CUR) != 0) {
+          break;
+        }
+
+        continue;
+      }
+
+      snprintf(tmp, sizeof(tmp), "%s.remote", path);
+
+      FILE *out = fopen(tmp, "wb");
+      bool ok = out != NULL;
+
+      for (uint64_t left = padded; ok && left > 0;) {
+        size_t len = left < sizeof(buffer) ? (size_t)left : sizeof(buffer);
+        uint64_t done = padded - left;
+
+        ok = fread(buffer, 1, len, file) == len;
+
+        // Only the padding is past the size of the file
+        if (ok && done < size) {
+          size_t data = size - done < len ? (size_t)(size - done) : len;
+
+          ok = fwrite(buffer, 1, data, out) == data;
+        }
+
+        left -= len;
+      }
+
+      if (out && fclose(out) != 0) {
+        ok = false;
+      }
+
+      if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        fclose(file);
+
+        return -1;
+      }
+
+      builder_stat_invalidate(path);
+      extracted++;
+    }
+
+    fclose(file);
+
+    return extracted;
+  }
+
+  /**
+   * @brief Writes an argument to a shell script, quoted so the shell reads it back unchanged.
+   */
+  static void builder_shell_quote(FILE *script, const char *arg) {
+    fputc('\'', script);
+
+    for (; *arg; arg++) {
+      if (*arg == '\'') {
+        fputs("'\\''", script);
+      } else {
+        fputc(*arg, script);
+      }
+    }
+
+    fputc('\'', script);
+  }
+
+  /**
+   * @brief Checks that a path stays inside the working directory, so it can be recreated in a worker's.
+   */
+  static bool builder_path_is_relative(const char *path) {
+    if (path[0] == '/' || (path[0] == '.' && path[1] == '.' && (path[2] == '/' || path[2] == '\0'))) {
+      return false;
+    }
+
+    return !strstr(path, "/../") && !(strlen(path) >= 3 && strcmp(path + strlen(path) - 3, "/..") == 0);
+  }
+)
+
+/** @brief The workers reached with SSH, see `builder_ssh_executor`. */
+typedef struct ssh_executor_t {
+  /** @brief The destination given to `ssh`, e.g. "user@host". */
+  char *host;
+  /** @brief The content hashes of the files the worker is known to have, as an open addressing table (0 is empty). */
+  uint64_t *blobs;
+  /** @brief The number of hashes in `blobs`, and its capacity. */
+  size_t blobs_count, blobs_size;
+} ssh_executor_t;
+
+/** @brief What is kept about a job running on an SSH worker. */
+typedef struct ssh_job_t {
+  /** @brief The archive of files uploaded to the worker, and the one of the outputs it sent back. */
+  char input[PATH_MAX], output[PATH_MAX];
+  /** @brief The object and the depfile the job writes (the depfile may be NULL). */
+  char *object, *depfile;
+  /** @brief The hashes of the files uploaded with the job, remembered once the worker stored them. */
+  uint64_t *blobs;
+  /** @brief The number of hashes in `blobs`. */
+  size_t blobs_count;
+} ssh_job_t;
+
+impl(
+  /**
+   * @brief Finds the slot of a hash in the files known to an SSH worker.
+   */
+  static uint64_t *builder_ssh_blob_slot(ssh_executor_t *ssh, uint64_t hash) {
+    size_t mask = ssh->blobs_size - 1;
+
+    for (size_t i = (size_t)hash & mask;; i = (i + 1) & mask) {
+      if (ssh->blobs[i] == hash || ssh->blobs[i] == 0) {
+        return &ssh->blobs[i];
+      }
+    }
+  }
+
+  /**
+   * @brief Checks if an SSH worker is known to have a file.
+   */
+  static bool builder_ssh_has_blob(ssh_executor_t *ssh, uint64_t hash) {
+    return hash != 0 && ssh->blobs && *builder_ssh_blob_slot(ssh, hash) == hash;
+  }
+
+  /**
+   * @brief Remembers that an SSH worker has a file.
+   */
+  static void builder_ssh_add_blob(ssh_executor_t *ssh, uint64_t hash) {
+    if (hash == 0 || builder_ssh_has_blob(ssh, hash)) {
+      return;
+    }
+
+    if ((ssh->blobs_count + 1) * 2 > ssh->blobs_size) {
+      uint64_t *old = ssh->blobs;
+      size_t old_size = ssh->blobs_size;
+
+      ssh->blobs_size = old_size ? old_size * 2 : 256;
+      ssh->blobs = (uint64_t *)calloc(ssh->blobs_size, sizeof(uint64_t));
+
+      for (size_t i = 0; i < old_size; i++) {
+        if (old[i]) {
+          *builder_ssh_blob_slot(ssh, old[i]) = old[i];
+        }
+      }
+
+      free(old);
+    }
+
+    *builder_ssh_blob_slot(ssh, hash) = hash;
+    ssh->blobs_count++;
+  }
+
+  /**
+   * @brief Collects the files a compile job reads, from the dependencies its depfile recorded last time.
+   * System headers (absolute paths outside the working directory) are expected on the worker.
+   * @return The number of files, or -1 if the job can't run on a worker.
+   */
+  static ssize_t builder_ssh_inputs(const char *object, const char **paths, uint64_t *hashes, size_t size) {
+    char cwd[PATH_MAX];
+    size_t cwd_len, count = 0;
+    deps_entry_t *entry = builder_deps_get(object);
+
+    if (!entry || !getcwd(cwd, sizeof(cwd))) {
+      return -1;
+    }
+
+    cwd_len = strlen(cwd);
+
+    const char *dep = entry->blob;
+
+    for (uint32_t i = 0; i < entry->count; i++, dep += strlen(dep) + 1) {
+      if (dep[0] == '/' && !(strncmp(dep, cwd, cwd_len) == 0 && dep[cwd_len] == '/')) {
+        continue;
+      }
+
+      if (!builder_path_is_relative(dep) || count >= size || !builder_file_hash(dep, &hashes[count])) {
+        return -1;
+      }
+
+      paths[count++] = dep;
+    }
+
+    return (ssize_t)count;
+  }
+
+  /**
+   * @brief Checks if a job can run on an SSH worker: it compiles a single source whose dependencies were
+   * recorded, with paths inside the working directory, and its process isn't redirected.
+   */
+  static bool builder_ssh_accepts(executor_t *executor, job_t *job) {
+    char cwd[PATH_MAX], depfile[PATH_MAX];
+    const spawn_options_t *options = job->options;
+    const char *object = builder_command_object(job->argv);
+
+    (void)executor;
+
+    if (!object || !builder_path_is_relative(object) || !getcwd(cwd, sizeof(cwd))) {
+      return false;
+    }
+
+    if (options && (options->cwd || options->stdin_path || options->stdout_path || options->stderr_path ||
+        options->stdin_fd || options->stdout_fd || options->stderr_fd || options->stderr_to_stdout)) {
+      return false;
+    }
+
+    if (builder_command_depfile(job->argv, depfile) && !builder_path_is_relative(depfile)) {
+      return false;
+    }
+
+    // The worker builds in another directory, absolute paths to this one wouldn't exist there
+    for (size_t i = 1; job->argv[i]; i++) {
+      if (strstr(job->argv[i], cwd)) {
+        return false;
+      }
+    }
+
+    return builder_deps_get(object) != NULL;
+  }
+
+  /**
+   * @brief Frees what is kept about a job that ran on an SSH worker, removing its archives.
+   */
+  static void builder_ssh_job_free(job_t *job) {
+    ssh_job_t *remote = (ssh_job_t *)job->executor_data;
+
+    if (!remote) {
+      return;
+    }
+
+    unlink(remote->input);
+    unlink(remote->output);
+    free(remote->object);
+    free(remote->depfile);
+    free(remote->blobs);
+    free(remote);
+
+    job->executor_data = NULL;
+  }
+
+  /**
+   * @brief Starts a job on an SSH worker.
+   *
+   * An archive is uploaded on stdin with the script of the job and the files of the job the worker
+   * isn't known to have, named by their content hash. The worker extracts it and runs the script with
+   * `sh`, which keeps the files in its store, links them into a temporary directory with the same
+   * layout as ours, runs the command there with its output on stderr, then sends back the object and
+   * depfile as an archive on stdout.
+   */
+  static pid_t builder_ssh_start(executor_t *executor, job_t *job) {
+    static unsigned counter = 0;
+    ssh_executor_t *ssh = (ssh_executor_t *)executor->data;
+    const char *paths[4096], *outputs[2];
+    uint64_t hashes[4096];
+    char depfile[PATH_MAX], name[32];
+    char *text = NULL;
+    size_t text_len = 0;
+    const char *object = builder_command_object(job->argv);
+    ssize_t count = builder_ssh_inputs(object, paths, hashes, sizeof(paths) / sizeof(paths[0]));
+
+    if (count < 0 || (mkdir(BUILDER_STATE_DIR, 0755) != 0 && errno != EEXIST) ||
+        (mkdir(BUILDER_STATE_DIR "/remote", 0755) != 0 && errno != EEXIST)) {
+      return -1;
+    }
+
+    ssh_job_t *remote = (ssh_job_t *)calloc(1, sizeof(ssh_job_t));
+
+    snprintf(remote->input, sizeof(remote->input), BUILDER_STATE_DIR "/remote/%d-%u.in", (int)getpid(), counter);
+    snprintf(remote->output, sizeof(remote->output), BUILDER_STATE_DIR "/remote/%d-%u.out", (int)getpid(), counter++);
+
+    remote->object = strdup(object);
+    remote->depfile = builder_command_depfile(job->argv, depfile) ? strdup(depfile) : NULL;
+    remote->blobs = (uint64_t *)malloc(sizeof(uint64_t) * (count ? (size_t)count : 1));
+    job->executor_data = remote;
+
+    FILE *script = open_memstream(&text, &text_len);
+
+    if (!script) {
+      builder_ssh_job_free(job);
+
+      return -1;
+    }
+
+    // Run from the directory the archive was extracted to, given as its argument
+    fputs("t=\"$1\"; trap 'rm -rf \"$t\"' EXIT\n"
+          "s=\"${XDG_CACHE_HOME:-$HOME/.cache}/builder-cas\"; mkdir -p \"$s\" \"$t/work\" && cd \"$t/work\" || exit 75\n"
+          "for f in \"$t\"/in/*; do if [ -f \"$f\" ]; then mv -f \"$f\" \"$s/\" || exit 75; fi; done\n"
+          "m() { mkdir -p \"$(dirname \"$2\")\" && { ln \"$s/$1\" \"$2\" 2>/dev/null || cp \"$s/$1\" \"$2\"; } || exit 75; }\n",
+        script);
+
+    for (ssize_t i = 0; i < count; i++) {
+      fprintf(script, "m %016" PRIx64 " ", hashes[i]);
+      builder_shell_quote(script, paths[i]);
+      fputc('\n', script);
+    }
+
+    outputs[0] = remote->object;
+    outputs[1] = remote->depfile;
+
+    for (size_t i = 0; i < 2 && outputs[i]; i++) {
+      fputs("mkdir -p \"$(dirname ", script);
+      builder_shell_quote(script, outputs[i]);
+      fputs(")\" || exit 75\n", script);
+    }
+
+    // The `ssh` process keeps ours, the command gets its own environment on the worker as well
+    if (job->options && job->options->env) {
+      fputs("env -i ", script);
+
+      for (size_t i = 0; job->options->env[i]; i++) {
+        builder_shell_quote(script, job->options->env[i]);
+        fputc(' ', script);
+      }
+    }
+
+    for (size_t i = 0; job->argv[i]; i++) {
+      builder_shell_quote(script, job->argv[i]);
+      fputc(' ', script);
+    }
+
+    fputs(">&2 || exit $?\ntar -cf -", script);
+
+    for (size_t i = 0; i < 2 && outputs[i]; i++) {
+      fputc(' ', script);
+      builder_shell_quote(script, outputs[i]);
+    }
+
+    fputc('\n', script);
+    fclose(script);
+
+    // The script goes in the archive, it can be larger than a command line
+    FILE *archive = fopen(remote->input, "wb");
+    bool ok = archive != NULL && builder_tar_add_data(archive, "job.sh", text, text_len);
+
+    free(text);
+
+    for (ssize_t i = 0; ok && i < count; i++) {
+      bool uploaded = builder_ssh_has_blob(ssh, hashes[i]);
+
+      // A header included twice is only uploaded once
+      for (size_t j = 0; !uploaded && j < remote->blobs_count; j++) {
+        uploaded = remote->blobs[j] == hashes[i];
+      }
+
+      if (uploaded)
+        continue;
+
+      snprintf(name, sizeof(name), "in/%016" PRIx64, hashes[i]);
+
+      ok = builder_tar_add(archive, name, paths[i]);
+      remote->blobs[remote->blobs_count++] = hashes[i];
+    }
+
+    if (archive && (!builder_tar_finish(archive) || fclose(archive) != 0)) {
+      ok = false;
+    }
+
+    if (!ok) {
+      builder_ssh_job_free(job);
+
+      return -1;
+    }
+
+    // One connection per worker is shared by its jobs, and kept for a minute after the last one. The
+    // login shell of the worker only starts `sh`, the script can't rely on what that shell is
+    char *argv[] = {
+      BUILDER_SSH_COMMAND, "-o", "BatchMode=yes", "-o", "ControlMaster=auto",
+      "-o", "ControlPath=" BUILDER_STATE_DIR "/ssh-%C", "-o", "ControlPersist=60",
+      ssh->host, "sh", "-c",
+      "'t=$(mktemp -d) || exit 75; tar -xf - -C \"$t\" || { rm -rf \"$t\"; exit 75; }; exec sh \"$t/job.sh\" \"$t\"'",
+      NULL,
+    };
+    spawn_options_t options = { .stdin_path = remote->input, .stdout_path = remote->output };
+
+    pid_t pid = builder_job_run(job, argv, &options);
+
+    if (pid == -1) {
+      builder_ssh_job_free(job);
+    }
+
+    return pid;
+  }
+
+  /**
+   * @brief Gets the outputs of a job back from an SSH worker.
+   */
+  static bool builder_ssh_finish(executor_t *executor, job_t *job, int status) {
+    ssh_executor_t *ssh = (ssh_executor_t *)executor->data;
+    ssh_job_t *remote = (ssh_job_t *)job->executor_data;
+    const char *outputs[2] = { remote->object, remote->depfile };
+    bool ok = false;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      // A failed compile is run again locally as well, in case it missed a header it didn't include last time
+      ok = builder_tar_extract(remote->output, outputs, 2) == (remote->depfile ? 2 : 1);
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == BUILDER_SSH_UNREACHABLE && executor->slots > 0) {
+      warn("couldn't reach %s, running its jobs locally", ssh->host);
+
+      executor->slots = 0;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == BUILDER_REMOTE_TEMPFAIL) {
+      // The worker's store was cleaned up, everything is uploaded again
+      free(ssh->blobs);
+
+      ssh->blobs = NULL;
+      ssh->blobs_count = ssh->blobs_size = 0;
+    }
+
+    if (ok) {
+      for (size_t i = 0; i < remote->blobs_count; i++) {
+        builder_ssh_add_blob(ssh, remote->blobs[i]);
+      }
+    }
+
+    builder_ssh_job_free(job);
+
+    return ok;
+  }
+
+  /**
+   * @brief Frees the data of an SSH executor.
+   */
+  static void builder_ssh_free(executor_t *executor) {
+    ssh_executor_t *ssh = (ssh_executor_t *)executor->data;
+
+    free(ssh->host);
+    free(ssh->blobs);
+    free(ssh);
+  }
+)
+
+/**
+ * @brief Adds a worker reached with SSH, which runs compile jobs once the local job slots are full.
+ *
+ * Only commands compiling a single source whose dependencies were recorded by a previous run are sent,
+ * with the files they read inside the working directory. Files are uploaded once per worker, by content
+ * hash, into `~/.cache/builder-cas` on the worker, which needs `sh`, `tar` and the same compilers and system
+ * headers as this machine. A job that fails on the worker, or can't reach it, runs locally instead.
+ * @param host The destination given to `ssh`, e.g. "user@host". Key based authentication is expected.
+ * @param slots The number of jobs the worker runs at once, or 0 for `BUILDER_SSH_SLOTS`.
+ * @return The executor, owned by the build.
+ */
+executor_t *builder_ssh_executor(const char *host, size_t slots) impl({
+  executor_t *executor = (executor_t *)calloc(1, sizeof(executor_t));
+  ssh_executor_t *ssh = (ssh_executor_t *)calloc(1, sizeof(ssh_executor_t));
+  size_t name_len = strlen(host) + 5;
+
+  ssh->host = strdup(host);
+
+  executor->name = (char *)malloc(name_len);
+  snprintf(executor->name, name_len, "ssh:%s", host);
+
+  executor->slots = slots ? slots : BUILDER_SSH_SLOTS;
+  executor->accepts = builder_ssh_accepts;
+  executor->start = builder_ssh_start;
+  executor->finish = builder_ssh_finish;
+  executor->free = builder_ssh_free;
+  executor->data = ssh;
+
+  builder_executor_add(executor);
+
+  return executor;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Scheduler //////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief How long a stopped job is given to exit after SIGTERM before it is sent SIGKILL, in milliseconds. */
+#ifndef BUILDER_KILL_GRACE_MS
+#define BUILDER_KILL_GRACE_MS 2000
+#endif
+
+/**
+ * @brief Gets the maximum number of jobs that may run at once inside a `SyncGroup`.
+ * Defaults to the number of online CPUs.
+ * @return The job limit, always greater than zero.
+ */
+long builder_get_max_jobs() impl({
+  if (builder_max_jobs <= 0) {
+    builder_max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (builder_max_jobs <= 0) {
+      builder_max_jobs = 1;
+    }
+  }
+
+  return builder_max_jobs;
+});
+
+/**
+ * @brief Sets the maximum number of jobs that may run at once inside a `SyncGroup`.
+ * @param max_jobs The new job limit. Values lower than 1 reset it to the number of online CPUs.
+ */
+void builder_set_max_jobs(long max_jobs) impl({
+  builder_max_jobs = max_jobs;
+});
+
+/**
+ * @brief Sets the memory that the running jobs may be expected to use at most.
+ *
+ * A job's expected memory is the one given in its spawn options or build context, or else the peak
+ * memory of its command's last successful run. A job is only started if the expected memory of all
+ * running jobs stays under the limit, except when nothing else runs.
+ * @param max_memory The limit in bytes, or 0 for no limit.
+ */
+void builder_set_max_memory(uint64_t max_memory) impl({
+  builder_max_memory = max_memory;
+});
+
+/**
+ * @brief Sets the load average above which no new job is started, except when nothing else runs.
+ * @param max_load The limit, compared with the one minute load average, or 0 for no limit.
+ */
+void builder_set_max_load(double max_load) impl({
+  builder_max_load = max_load;
+});
+
+/**
+ * @brief Parses a size in bytes, with an optional binary suffix (e.g., "512M", "8G").
+ * @param text The text to parse.
+ * @param size Where to store the size.
+ * @return `true` on success, `false` if the text isn't a size.
+ */
+bool builder_parse_size(const char *text, uint64_t *size) impl({
+  static const char suffixes[] = "KMGT";
+  char *end = NULL;
+
+  errno = 0;
+
+  unsigned long long value = strtoull(text, &end, 10);
+
+  if (end == text || errno != 0 || *text == '-')
+    return false;
+
+  if (*end) {
+    const char *suffix = strchr(suffixes, *end == 'k' ? 'K' : *end);
+
+    if (!suffix || !*suffix)
+      return false;
+
+    for (const char *s = suffixes; s <= suffix; s++) {
+      value *= 1024;
+    }
+
+    end++;
+
+    if (*end == 'i') end++;
+    if (*end == 'B') end++;
+  }
+
+  if (*end)
+    return false;
+
+  *size = value;
+
+  return true;
+});
+
+/**
+ * @brief Checks whether a job may start with the resources it is expected to use.
+ * @param job The job to start.
+ * @return `true` if the job fits under the memory and load limits and got a jobserver token, or nothing else runs.
+ */
+bool builder_job_admit(const job_t *job) impl({
+  // Always let one job through, it couldn't run faster later
+  if (builder_running_count == builder_executors_running)
+    return true;
+
+  if (builder_max_memory && builder_running_memory + job->memory > builder_max_memory)
+    return false;
+
+  double load;
+
+  if (builder_max_load > 0 && getloadavg(&load, 1) == 1 && load >= builder_max_load)
+    return false;
+
+  // Taken last, so no token is held while the job waits for something else
+  return builder_jobserver_acquire();
+});
+
+/**
+ * @brief Creates and initializes a new, empty process ID list.
+ * @return A pointer to the newly allocated `pid_list_t`. Must be freed with `pid_list_free`.
+ */
+pid_list_t *pid_list_create()
+  impl({ return (pid_list_t *)calloc(1, sizeof(pid_list_t)); });
+
+/**
+ * @brief Appends a job to the list, resizing if necessary.
+ * @param list The list to add to.
+ * @param job The job to add. The list takes ownership of it.
+ */
+void pid_list_push(pid_list_t *list, job_t *job) impl({
+  if (list->size <= list->current) {
+    size_t size = list->size ? list->size * 2 : 16;
+
+    list->items = (job_t **)arena_grow(&list->arena, list->items, sizeof(job_t *) * list->size, sizeof(job_t *) * size);
+    list->size = size;
+  }
+
+  list->items[list->current++] = job;
+});
+
+/**
+ * @brief Adds an already running process to the list, resizing if necessary.
+ * @param list The PID list to add to.
+ * @param pid The process ID to add. If -1, it is ignored.
+ */
+void pid_list_add(pid_list_t *list, pid_t pid) impl({
+  if (pid == -1)
+    return;
+
+  job_t *job = (typeof(job)) arena_alloc(&list->arena, sizeof(job_t));
+
+  job->pid = pid;
+  job->group = list;
+  job->output = (job_output_t){ .fds = { -1, -1 } };
+
+  pid_list_push(list, job);
+  builder_running_add(job);
+});
+
+impl(
+  /**
+   * @brief Checks whether a queued job should start before another one.
+   */
+  static bool builder_job_before(const job_t *a, const job_t *b) {
+    return a->priority != b->priority ? a->priority > b->priority : a->order < b->order;
+  }
+)
+
+/**
+ * @brief Adds a job to the jobs of a list that weren't started yet.
+ * @param list The list of the job.
+ * @param job The queued job.
+ */
+void pid_list_pending_push(pid_list_t *list, job_t *job) impl({
+  if (list->pending_size <= list->pending_count) {
+    size_t size = list->pending_size ? list->pending_size * 2 : 16;
+
+    list->pending = (job_t **)arena_grow(&list->arena, list->pending, sizeof(job_t *) * list->pending_size, sizeof(job_t *) * size);
+    list->pending_size = size;
+  }
+
+  size_t i = list->pending_count++;
+
+  for (; i > 0 && builder_job_before(job, list->pending[(i - 1) / 2]); i = (i - 1) / 2) {
+    list->pending[i] = list->pending[(i - 1) / 2];
+  }
+
+  list->pending[i] = job;
+});
+
+/**
+ * @brief Removes the job with the highest priority from the jobs of a list that weren't started yet.
+ * @param list The list, with at least one queued job.
+ * @return The removed job.
+ */
+job_t *pid_list_pending_pop(pid_list_t *list) impl({
+  job_t *top = list->pending[0], *last = list->pending[--list->pending_count];
+  size_t i = 0;
+
+  for (;;) {
+    size_t child = i * 2 + 1;
+
+    if (child >= list->pending_count)
+      break;
+
+    if (child + 1 < list->pending_count && builder_job_before(list->pending[child + 1], list->pending[child]))
+      child++;
+
+    if (!builder_job_before(list->pending[child], last))
+      break;
+
+    list->pending[i] = list->pending[child];
+    i = child;
+  }
+
+  if (list->pending_count > 0) {
+    list->pending[i] = last;
+  }
+
+  return top;
+});
+
+/** @brief A callback to be called once a deadline passes, see `builder_timer_add`. */
+typedef struct builder_timer_t {
+  /** @brief The identifier of the timer, to cancel it. */
+  uint64_t id;
+  /** @brief When the timer expires, in nanoseconds on the `builder_now_ns` clock. */
+  uint64_t deadline_ns;
+  /** @brief The callback. */
+  void (*callback)(void *data);
+  /** @brief The user data passed to `callback`. */
+  void *data;
+} builder_timer_t;
+
+/** @brief The timers that didn't expire yet, in no particular order. */
+impl_global(builder_timer_t *builder_timers, NULL);
+/** @brief The number of pending timers. */
+impl_global(size_t builder_timers_count, 0);
+/** @brief The allocated capacity of `builder_timers`. */
+impl_global(size_t builder_timers_size, 0);
+/** @brief The identifier of the last timer added. */
+impl_global(uint64_t builder_timers_last_id, 0);
+
+/**
+ * @brief Calls a function once some time passed. Timers expire while the build waits for jobs
+ * (e.g. in `job_wait_any` or at the end of a `SyncGroup`), so their callbacks may queue commands.
+ * @param delay_ms The time to wait in milliseconds.
+ * @param callback The function to call.
+ * @param data The user data passed to `callback`.
+ * @return The identifier of the timer, for `builder_timer_cancel`.
+ */
+uint64_t builder_timer_add(uint64_t delay_ms, void (*callback)(void *data), void *data) impl({
+  if (builder_timers_size <= builder_timers_count) {
+    builder_timers_size = (builder_timers_size + 1) * 2;
+
+    builder_timers = (builder_timer_t *)realloc(builder_timers, sizeof(builder_timer_t) * builder_timers_size);
+  }
+
+  builder_timers[builder_timers_count++] = (builder_timer_t){
+    .id = ++builder_timers_last_id,
+    .deadline_ns = builder_now_ns() + delay_ms * 1000000,
+    .callback = callback,
+    .data = data,
+  };
+
+  return builder_timers_last_id;
+});
+
+/**
+ * @brief Cancels a timer that didn't expire yet.
+ * @param id The identifier returned by `builder_timer_add`.
+ * @return `true` if the timer was cancelled, `false` if it already expired or was cancelled.
+ */
+bool builder_timer_cancel(uint64_t id) impl({
+  for (size_t i = 0; i < builder_timers_count; i++) {
+    if (builder_timers[i].id == id) {
+      builder_timers[i] = builder_timers[--builder_timers_count];
+
+      return true;
+    }
+  }
+
+  return false;
+});
+
+/**
+ * @brief Calls the callbacks of the expired timers.
+ * @return The time until the next timer expires in milliseconds, or -1 if there are none left.
+ */
+int builder_timers_run() impl({
+  for (;;) {
+    uint64_t now = builder_now_ns(), next = UINT64_MAX;
+    size_t expired = builder_timers_count;
+
+    for (size_t i = 0; i < builder_timers_count; i++) {
+      if (builder_timers[i].deadline_ns <= now) {
+        expired = i;
+        break;
+      }
+
+      if (builder_timers[i].deadline_ns < next) {
+        next = builder_timers[i].deadline_ns;
+      }
+    }
+
+    if (expired == builder_timers_count) {
+      if (next == UINT64_MAX) {
+        return -1;
+      }
+
+      // Rounded up, so the timer expired once the wait is over
+      uint64_t timeout_ms = (next - now + 999999) / 1000000;
+
+      return timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms;
+    }
+
+    // Removed first, the callback may add or cancel timers
+    builder_timer_t timer = builder_timers[expired];
+
+    builder_timers[expired] = builder_timers[--builder_timers_count];
+
+    timer.callback(timer.data);
+  }
+});
+
+impl(
+  /**
+   * @brief Draws the progress line once a throttled update is due.
+   */
+  static void builder_progress_on_timer(void *data) {
+    (void)data;
+
+    builder_progress.timer = 0;
+
+    builder_progress_draw(builder_running_count);
+  }
+
+  /**
+   * @brief Updates the progress line, at most once every `BUILDER_PROGRESS_INTERVAL_MS`.
+   * A throttled update is drawn by a timer, so the line doesn't stay behind while the jobs run.
+   */
+  static void builder_progress_update() {
+    // Jobs writing to the terminal directly would be mixed with the line
+    if (!builder_progress.active || !builder_output_capture || builder_progress.timer) {
+      return;
+    }
+
+    uint64_t elapsed_ms = (builder_now_ns() - builder_progress.drawn_ns) / 1000000;
+
+    if (elapsed_ms >= BUILDER_PROGRESS_INTERVAL_MS) {
+      builder_progress_draw(builder_running_count);
+    } else {
+      builder_progress.timer = builder_timer_add(BUILDER_PROGRESS_INTERVAL_MS - elapsed_ms, builder_progress_on_timer, NULL);
+    }
+  }
+
+  /**
+   * @brief Counts a job that is done or failed to start on the progress line, then calls its `on_exit`
+   * callback and its continuations.
+   */
+  static void builder_job_notify(job_t *job) {
+    builder_progress.done++;
+    builder_progress_update();
+
+    if (job->on_exit) {
+      job->on_exit(job, job->on_exit_data);
+    }
+
+    for (job_continuation_t *continuation = job->continuations; continuation; continuation = continuation->next) {
+      continuation->callback(job, continuation->data);
+    }
+  }
+
+  /**
+   * @brief Drops a job of a cancelled list that didn't start yet.
+   */
+  static void builder_job_drop(job_t *job) {
+    job->state = JOB_CANCELLED;
+    job->status = 127;
+    job->group->failed++;
+
+    builder_targets_commit(&job->targets, false, NULL);
+    builder_job_notify(job);
+  }
+
+  /**
+   * @brief Sends a signal to the process group of a running job, or to its process if it has no group.
+   */
+  static void builder_job_signal(job_t *job, int signal) {
+    if (kill(-job->pid, signal) != 0) {
+      kill(job->pid, signal);
+    }
+  }
+
+  /**
+   * @brief Kills a job that didn't exit after it was sent SIGTERM.
+   */
+  static void builder_job_on_kill(void *data) {
+    job_t *job = (job_t *)data;
+
+    job->timer = 0;
+
+    builder_job_signal(job, SIGKILL);
+  }
+
+  /**
+   * @brief Sends SIGTERM to a running job, then SIGKILL if it is still running `BUILDER_KILL_GRACE_MS` later.
+   */
+  static void builder_job_stop(job_t *job) {
+    if (job->cancelled) {
+      return;
+    }
+
+    if (job->timer) {
+      builder_timer_cancel(job->timer);
+    }
+
+    job->cancelled = true;
+    job->timer = builder_timer_add(BUILDER_KILL_GRACE_MS, builder_job_on_kill, job);
+
+    builder_job_signal(job, SIGTERM);
+  }
+
+  /**
+   * @brief Stops a job that ran longer than its timeout.
+   */
+  static void builder_job_on_timeout(void *data) {
+    job_t *job = (job_t *)data;
+
+    job->timer = 0;
+    job->timed_out = true;
+
+    builder_job_stop(job);
+  }
+
+  /**
+   * @brief Registers a job whose process was just started as running, and starts its timeout.
+   */
+  static void builder_job_started(job_t *job) {
+    size_t length = 0;
+
+    builder_running_add(job);
+
+    for (size_t i = 0; job->argv[i] && length < sizeof(builder_progress.current) - 1; i++) {
+      length += (size_t)snprintf(builder_progress.current + length, sizeof(builder_progress.current) - length,
+          "%s%s", i ? " " : "", job->argv[i]);
+    }
+
+    // Cut short, the last character may be incomplete: drop it if its lead byte announces more bytes than are left
+    if (length >= sizeof(builder_progress.current) - 1) {
+      size_t last = sizeof(builder_progress.current) - 2;
+
+      while (last > 0 && ((unsigned char)builder_progress.current[last] & 0xC0) == 0x80) {
+        last--;
+      }
+
+      unsigned char lead = (unsigned char)builder_progress.current[last];
+      size_t bytes = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+
+      if (last + bytes > sizeof(builder_progress.current) - 1) {
+        builder_progress.current[last] = '\0';
+      }
+    }
+
+    // A newline or an escape sequence in an argument would break the line (or the terminal)
+    for (char *c = builder_progress.current; *c; c++) {
+      if ((unsigned char)*c < 0x20 || *c == 0x7f) {
+        *c = ' ';
+      }
+    }
+
+    builder_progress_update();
+
+    if (job->timeout_ms) {
+      job->timer = builder_timer_add(job->timeout_ms, builder_job_on_timeout, job);
+    }
+  }
+)
+
+/**
+ * @brief Sets whether the other jobs of a list are stopped once one of them fails.
+ * @param fail_fast `true` to cancel a list (see `pid_list_cancel`) when one of its jobs fails, `false` to keep going.
+ */
+void builder_set_fail_fast(bool fail_fast) impl({
+  builder_fail_fast = fail_fast;
+});
+
+/**
+ * @brief Sets the time a command may run, unless its options or build context give another one.
+ * Commands running longer are sent SIGTERM, then SIGKILL if they don't exit in `BUILDER_KILL_GRACE_MS`.
+ * @param timeout_ms The limit in milliseconds, or 0 for no limit.
+ */
+void builder_set_timeout(uint64_t timeout_ms) impl({
+  builder_timeout_ms = timeout_ms;
+});
+
+/**
+ * @brief Cancels the jobs of a list: the queued ones are dropped, and the running ones are sent SIGTERM,
+ * then SIGKILL if they don't exit in `BUILDER_KILL_GRACE_MS`. Jobs queued on the list later are dropped too.
+ * Their processes are signaled with their process groups, so the compilers a driver started stop as well.
+ * @param list The list to cancel.
+ */
+void pid_list_cancel(pid_list_t *list) impl({
+  list->cancelled = true;
+
+  while (list->pending_count > 0) {
+    builder_job_drop(pid_list_pending_pop(list));
+  }
+
+  for (size_t i = 0; i < builder_running_count; i++) {
+    if (builder_running_jobs[i]->group == list) {
+      builder_job_stop(builder_running_jobs[i]);
+    }
+  }
+});
+
+/**
+ * @brief Forwards the interruption the build script got to the running jobs, waits for them,
+ * saves what was built so far, then lets the signal terminate the build script.
+ */
+void builder_interrupt() impl({
+  int signal = builder_interrupted;
+  struct sigaction action;
+
+  fflush(NULL);
+
+  for (size_t i = 0; i < builder_running_count; i++) {
+    builder_job_signal(builder_running_jobs[i], signal);
+  }
+
+  // Interrupted jobs didn't build their targets, only the finished ones are recorded
+  while (wait(NULL) > 0 || errno == EINTR) {}
+
+  builder_state_save();
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_DFL;
+
+  sigaction(signal, &action, NULL);
+  raise(signal);
+
+  // Not terminated by the signal, e.g. because it is blocked
+  _exit(128 + signal);
+});
+
+/**
+ * @brief Starts queued jobs until the job limit is reached or the queue is empty.
+ * Once the local job slots are full, jobs are handed to the executors with free slots that accept them.
+ * @param list The list whose queued jobs should be started.
+ */
+void pid_list_schedule(pid_list_t *list) impl({
+  long max_jobs = builder_get_max_jobs();
+
+  while (list->pending_count > 0) {
+    job_t *job = list->pending[0];
+
+    if ((long)(builder_running_count - builder_executors_running) >= max_jobs) {
+      executor_t *executor = builder_executor_find(job);
+
+      if (!executor || (job->pid = builder_executor_start(executor, job)) == -1)
+        break;
+
+      pid_list_pending_pop(list);
+      builder_job_started(job);
+
+      continue;
+    }
+
+    // The highest priority job waits until running jobs free enough resources
+    if (!builder_job_admit(job))
+      break;
+
+    pid_list_pending_pop(list);
+
+    job->pid = builder_job_spawn(job);
+
+    if (job->pid == -1) {
+      job->state = JOB_FAILED;
+      job->status = 127;
+      list->failed++;
+
+      builder_jobserver_release();
+
+      builder_targets_commit(&job->targets, false, NULL);
+      builder_job_notify(job);
+
+      if (builder_fail_fast) {
+        pid_list_cancel(list);
+      }
+
+      continue;
+    }
+
+    builder_job_started(job);
+  }
+});
+
+/**
+ * @brief Queues a command to run once a job slot is free, spawning it with the given options.
+ * The command is started right away if the job limit wasn't reached yet.
+ * @param list The list to queue the command on.
+ * @param argv The argument vector for the command, ending with NULL. It is copied.
+ * @param options How to set up the command's process, or NULL. It is copied.
+ * @return The queued job, owned by the list.
+ */
+job_t *pid_list_enqueue_ex(pid_list_t *list, char **argv, const spawn_options_t *options) impl({
+  size_t argc = 0;
+
+  while (argv[argc]) {
+    argc++;
+  }
+
+  job_t *job = (typeof(job)) arena_alloc(&list->arena, sizeof(job_t));
+
+  job->argv = (char **)arena_alloc(&list->arena, sizeof(char *) * (argc + 1));
+  job->pid = -1;
+  job->state = JOB_PENDING;
+  job->group = list;
+  job->output = (job_output_t){ .fds = { -1, -1 } };
+
+  for (size_t i = 0; i < argc; i++) {
+    job->argv[i] = arena_strdup(&list->arena, argv[i]);
+  }
+
+  job->argv[argc] = NULL;
+
+  builder_compdb_record(job->argv, options ? options->cwd : NULL);
+
+  // Counted where it was queued, nested contexts have stats of their own
+  job->stats = build_context ? builder_context_stats(build_context->name) : NULL;
+
+  if (job->stats) {
+    job->stats->commands++;
+  }
+
+  builder_progress.total++;
+
+  // The targets found out of date since the last queued command are built by this one
+  job->targets = builder_pending_targets;
+  builder_pending_targets = (rebuild_target_list_t){0};
+
+  // The job starts later, maybe once the build context is gone, so its environment is copied as well
+  char **env = options && options->env ? options->env : build_context ? build_context->env : NULL;
+
+  if (options || env) {
+    job->options = (typeof(job->options)) arena_alloc(&list->arena, sizeof(spawn_options_t));
+
+    if (options) {
+      *job->options = *options;
+
+      job->options->cwd = arena_strdup(&list->arena, options->cwd);
+      job->options->stdin_path = arena_strdup(&list->arena, options->stdin_path);
+      job->options->stdout_path = arena_strdup(&list->arena, options->stdout_path);
+      job->options->stderr_path = arena_strdup(&list->arena, options->stderr_path);
+    }
+
+    job->options->env = NULL;
+  }
+
+  if (env) {
+    size_t count = 0;
+
+    while (env[count]) {
+      count++;
+    }
+
+    job->options->env = (char **)arena_alloc(&list->arena, sizeof(char *) * (count + 1));
+
+    for (size_t i = 0; i < count; i++) {
+      job->options->env[i] = arena_strdup(&list->arena, env[i]);
+    }
+
+    job->options->env[count] = NULL;
+  }
+
+  char key[17];
+
+  builder_command_key(job->argv, key);
+
+  // Declared weights win over the ones learned from the command's last run
+  state_record_t *record = builder_state_get(STATE_COMMAND, key);
+
+  if (options && options->memory) {
+    job->memory = options->memory;
+  } else if (build_context && build_context->memory) {
+    job->memory = build_context->memory;
+  } else {
+    job->memory = record ? record->values[0] : 0;
+  }
+
+  // The longest commands start first, so they don't finish last
+  job->priority = options && options->priority ? options->priority : record ? record->values[1] : 0;
+  job->order = list->current;
+
+  if (options && options->timeout_ms) {
+    job->timeout_ms = options->timeout_ms;
+  } else if (build_context && build_context->timeout_ms) {
+    job->timeout_ms = build_context->timeout_ms;
+  } else {
+    job->timeout_ms = builder_timeout_ms;
+  }
+
+  pid_list_push(list, job);
+
+  if (list->cancelled) {
+    builder_job_drop(job);
+
+    return job;
+  }
+
+  pid_list_pending_push(list, job);
+  pid_list_schedule(list);
+
+  return job;
+});
+
+/**
+ * @brief Queues a command to run once a job slot is free.
+ * The command is started right away if the job limit wasn't reached yet.
+ * @param list The list to queue the command on.
+ * @param argv The argument vector for the command, ending with NULL. It is copied.
+ * @return The queued job, owned by the list.
+ */
+job_t *pid_list_enqueue(pid_list_t *list, char **argv) impl({
+  return pid_list_enqueue_ex(list, argv, NULL);
+});
+
+/**
+ * @brief Frees the memory used by a process ID list.
+ * @param list The list to free.
+ */
+void pid_list_free(pid_list_t *list) impl({
+  for (size_t i = 0; i < list->current; i++) {
+    job_t *job = list->items[i];
+
+    builder_targets_commit(&job->targets, false, NULL);
+    builder_cache_free(job);
+    builder_output_free(&job->output);
+  }
+
+  // The jobs and their commands go with the arena, its chunks are kept for the next list
+  arena_release(&list->arena);
+  free(list);
+});
+
+/**
+ * @brief Reaps the next child process that terminates, whichever group it belongs to.
+ *
+ * The job owning the process is marked as done, its exit is reported if it failed, and
+ * the queued jobs of its group are started to refill the freed slot.
+ * @param block `true` to wait until a child terminates, `false` to return if none did yet.
+ * @return The job that terminated, or NULL if no job was reaped.
+ */
+job_t *builder_reap(bool block) impl({
+  struct rusage usage;
+  int status;
+  pid_t pid;
+
+  // Install the SIGCHLD wakeup before polling, or a child exiting first could be missed
+  bool polling = builder_events_init();
+
+  for (;;) {
+    if (builder_interrupted) {
+      builder_interrupt();
+    }
+
+    pid = wait4(-1, &status, block && !polling ? 0 : WNOHANG, &usage);
+
+    if (pid == -1) {
+      if (errno == EINTR)
+        continue;
+
+      return NULL;
+    }
+
+    if (pid == 0) {
+      if (!block)
+        return NULL;
+
+      // Keeps reading the output of running jobs until a child exits or a timer expires
+      if (builder_poll_events(builder_timers_run())) {
+        // A jobserver token was returned, let the caller start a queued job
+        errno = EAGAIN;
+
+        return NULL;
+      }
+
+      continue;
+    }
+
+    // Stopped or continued children are still running
+    if (!WIFSIGNALED(status) && !WIFEXITED(status))
+      continue;
+
+    job_t *job = builder_running_take(pid);
+
+    // Not one of our jobs (e.g. a process forked by the build script itself)
+    if (!job)
+      continue;
+
+    // Every process of the job counts, the preprocessing of a cached compile as well
+    job->cpu_ns += (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+                   (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+
+    // A job an executor couldn't run continues locally
+    if (job->executor && builder_executor_step(job, &status)) {
+      builder_running_add(job);
+      continue;
+    }
+
+    // What the local process of a remote job used says nothing about the command
+    bool remote = job->executor != NULL;
+
+    // A cached compile may continue with its real command after preprocessing, unless it was stopped
+    bool preprocessed = job->cache && job->cache->stage == CACHE_PREPROCESSING;
+
+    if (job->cache && !job->cancelled && builder_cache_step(job, &status)) {
+      builder_running_add(job);
+      continue;
+    }
+
+    if (job->timer) {
+      builder_timer_cancel(job->timer);
+      job->timer = 0;
+    }
+
+    uint64_t peak_memory = (uint64_t)usage.ru_maxrss * BUILDER_MAXRSS_UNIT;
+
+    if (!preprocessed && !remote && peak_memory > job->peak_memory) {
+      job->peak_memory = peak_memory;
+    }
+
+    job->state = JOB_DONE;
+    job->status = WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status);
+
+    builder_jobserver_release();
+
+    // Jobs stopped because another one failed would only add noise, while a job's timeout is its own failure
+    bool dropped = job->cancelled && !job->timed_out;
+
+    // Printed in one piece, before the error, so it isn't mixed with the output of other jobs
+    builder_output_flush(&job->output, !dropped && (job->status != 0 || !builder_output_quiet));
+
+    if (dropped) {
+      // Reported by the job that failed
+    } else if (job->timed_out) {
+      error("%s (pid %d) timed out after %" PRIu64 " ms",
+          job->argv ? job->argv[0] : "process", pid, job->timeout_ms);
+    } else if (WIFSIGNALED(status)) {
+      error("%s (pid %d) received signal '%s'",
+          job->argv ? job->argv[0] : "process", pid, strsignal(job->status));
+    } else if (job->status != 0) {
+      error("%s (pid %d) exited with code %d",
+          job->argv ? job->argv[0] : "process", pid, job->status);
+    }
+
+    if (job->status != 0) {
+      job->group->failed++;
+    }
+
+    if (job->status != 0 && !dropped && builder_fail_fast && !job->group->cancelled) {
+      pid_list_cancel(job->group);
+    }
+
+    builder_trace_command(job->argv, pid, job->status, job->start_ns, job->lane);
+
+    // Learn what the command needs, unless a cache hit skipped it or it ran elsewhere
+    if (job->argv && job->status == 0 && !preprocessed && !remote) {
+      char key[17];
+      uint64_t user_ns = (uint64_t)usage.ru_utime.tv_sec * 1000000000 + (uint64_t)usage.ru_utime.tv_usec * 1000;
+      uint64_t values[4] = { job->peak_memory, builder_now_ns() - job->start_ns, user_ns, 0 };
+
+      builder_command_key(job->argv, key);
+      builder_state_put(STATE_COMMAND, key, values);
+    }
+
+    // Without known targets, the command may have written any file
+    if (job->targets.current == 0) {
+      builder_stat_invalidate_all();
+    }
+
+    job->unchanged = builder_targets_commit(&job->targets, job->status == 0, job->argv);
+
+    if (job->stats) {
+      job->stats->cpu_ns += job->cpu_ns;
+      job->stats->peak_memory = job->peak_memory > job->stats->peak_memory ? job->peak_memory : job->stats->peak_memory;
+    }
+
+    builder_job_notify(job);
+
+    pid_list_schedule(job->group);
+
+    return job;
+  }
+
+  return NULL;
+});
+
+/**
+ * @brief Waits for all jobs in a list to terminate, starting queued jobs as running ones exit.
+ *
+ * Children are reaped in the order they terminate, so failures are reported as they happen.
+ * The exit status of every job is kept in its `job_t`.
+ * @param pids The list of jobs to wait for.
+ * @return The number of jobs that failed to start, exited with a non-zero code or were signaled.
+ */
+int pid_list_wait_sync(pid_list_t *pids) impl({
+  pid_list_schedule(pids);
+
+  while (pids->running > 0 || pids->pending_count > 0) {
+    if (!builder_reap(true) && errno == ECHILD) {
+      // Our children were reaped behind our back, there is nothing left to wait for
+      break;
+    }
+
+    // The reaped job may belong to another group, so refill our own slots as well
+    pid_list_schedule(pids);
+  }
+
+  return (int)pids->failed;
+});
+
+/**
+ * @brief Runs a command as a job and waits for it to complete.
+ * Like jobs of a `SyncGroup`, it waits for a job slot, and is traced and cached.
+ * @param argv The argument vector for the command, ending with NULL.
+ * @param options How to set up the command's process, or NULL.
+ * @return The exit status of the process, the signal number if it was terminated by a signal,
+ * or 127 if it couldn't be started.
+ */
+int builder_run_sync(char **argv, const spawn_options_t *options) impl({
+  pid_list_t *list = pid_list_create();
+  job_t *job = pid_list_enqueue_ex(list, argv, options);
+
+  pid_list_wait_sync(list);
+
+  int status = job->status;
+
+  pid_list_free(list);
+
+  return status;
+});
+
+/**
+ * @brief Checks if a job is over, i.e. its process exited, couldn't be started or was dropped.
+ * @param job The job.
+ * @return `true` if the job is done, failed to start or was cancelled before it started.
+ */
+bool job_is_done(const job_t *job) impl({
+  return job->state == JOB_DONE || job->state == JOB_FAILED || job->state == JOB_CANCELLED;
+});
+
+/**
+ * @brief Adds a callback called once a job is done or failed to start, after the ones added before.
+ * It may queue more commands, e.g. linking a library as soon as its last object is compiled.
+ * @param job The job, e.g. returned by `$()`.
+ * @param callback The function to call, which finds the exit status in `job->status`.
+ * @param data The user data passed to `callback`.
+ * @note If the job is already over, the callback is called right away.
+ * @example
+ * static void link_library(job_t *job, void *data) {
+ *   if (job->status == 0 && --objects_left == 0) {
+ *     pid_list_enqueue(job->group, StringArrayN("ar", "rcs", "libfoo.a", "foo.o", "bar.o"));
+ *   }
+ * }
+ *
+ * job_then($("cc", "-c", "foo.c", "-o", "foo.o"), link_library, NULL);
+ */
+void job_then(job_t *job, void (*callback)(job_t *job, void *data), void *data) impl({
+  if (job_is_done(job)) {
+    callback(job, data);
+
+    return;
+  }
+
+  job_continuation_t **last = &job->continuations;
+
+  while (*last) {
+    last = &(*last)->next;
+  }
+
+  *last = (job_continuation_t *)arena_alloc(&job->group->arena, sizeof(job_continuation_t));
+  **last = (job_continuation_t){ .callback = callback, .data = data };
+});
+
+/**
+ * @brief Waits until one of some jobs is over, running the other jobs, callbacks and timers meanwhile.
+ * @param jobs The jobs to wait for. They may belong to different lists.
+ * @param count The number of jobs.
+ * @return The first job of `jobs` that is over, which the caller removes before waiting for the
+ * others, or NULL if there are no jobs or none of them can finish.
+ */
+job_t *job_wait_any(job_t **jobs, size_t count) impl({
+  for (;;) {
+    for (size_t i = 0; i < count; i++) {
+      if (job_is_done(jobs[i])) {
+        return jobs[i];
+      }
+    }
+
+    if (count == 0) {
+      return NULL;
+    }
+
+    // A queued job may have been waiting for a free slot or a jobserver token
+    for (size_t i = 0; i < count; i++) {
+      pid_list_schedule(jobs[i]->group);
+    }
+
+    if (!builder_reap(true) && errno == ECHILD) {
+      // Nothing runs, the jobs can't be over yet if they weren't already
+      for (size_t i = 0; i < count; i++) {
+        if (job_is_done(jobs[i])) {
+          return jobs[i];
+        }
+      }
+
+      return NULL;
+    }
+  }
+});
+
+/**
+ * @brief Waits until a job is over, running the other jobs, callbacks and timers meanwhile.
+ * @param job The job to wait for.
+ * @return The exit status of the job, the signal number if it was terminated by a signal,
+ * or 127 if it couldn't be started.
+ */
+int job_wait(job_t *job) impl({
+  return job_wait_any(&job, 1) ? job->status : 127;
+});
+
+/**
+ * @brief Waits until all of some jobs are over, running the other jobs, callbacks and timers meanwhile.
+ * @param jobs The jobs to wait for. They may belong to different lists.
+ * @param count The number of jobs.
+ * @return The number of jobs that failed to start, exited with a non-zero code or were signaled.
+ */
+int job_wait_all(job_t **jobs, size_t count) impl({
+  int failed = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    if (job_wait(jobs[i]) != 0) {
+      failed++;
+    }
+  }
+
+  return failed;
+});
+
+/**
+ * @brief Starts showing the progress of a build, if it is enabled and stdout is a terminal.
+ * Called before the entrypoint of the build script runs.
+ */
+void builder_progress_begin() impl({
+  const char *term = getenv("TERM");
+
+  builder_progress.active = builder_progress.enabled && isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0);
+  builder_progress.total = 0;
+  builder_progress.done = 0;
+  builder_progress.drawn_ns = 0;
+  builder_progress.current[0] = '\0';
+});
+
+impl(
+  /**
+   * @brief Orders context stats for `qsort`, the longest first.
+   */
+  static int builder_context_stats_compare(const void *a, const void *b) {
+    const context_stats_t *x = *(context_stats_t *const *)a, *y = *(context_stats_t *const *)b;
+
+    return x->wall_ns < y->wall_ns ? 1 : x->wall_ns > y->wall_ns ? -1 : 0;
+  }
+)
+
+/**
+ * @brief Erases the progress line, and prints the wall time, the CPU time and the peak memory of each
+ * build context of a build that ran commands, the longest first. Called once the entrypoint returned.
+ *
+ * The wall time of a context includes its nested contexts, while the CPU time and the peak memory of
+ * a command only count in the context it was queued in.
+ */
+void builder_progress_end() impl({
+  if (builder_progress.timer) {
+    builder_timer_cancel(builder_progress.timer);
+    builder_progress.timer = 0;
+  }
+
+  builder_progress_clear();
+
+  builder_progress.active = false;
+
+  if (builder_progress.total > 0 && builder_progress.contexts_count > 0) {
+    int width = 7;
+
+    qsort(builder_progress.contexts, builder_progress.contexts_count, sizeof(context_stats_t *),
+        builder_context_stats_compare);
+
+    for (size_t i = 0; i < builder_progress.contexts_count; i++) {
+      int length = (int)strlen(builder_progress.contexts[i]->name);
+
+      width = length > width ? (length < 40 ? length : 40) : width;
+    }
+
+    info("%-*s %10s %10s %10s %8s", width, "context", "wall", "cpu", "peak rss", "commands");
+
+    for (size_t i = 0; i < builder_progress.contexts_count; i++) {
+      context_stats_t *stats = builder_progress.contexts[i];
+      char wall[32], cpu[32], memory[32];
+
+      snprintf(wall, sizeof(wall), "%.2fs", (double)stats->wall_ns / 1e9);
+      snprintf(cpu, sizeof(cpu), "%.2fs", (double)stats->cpu_ns / 1e9);
+      snprintf(memory, sizeof(memory), "%.1f MiB", (double)stats->peak_memory / (1024.0 * 1024.0));
+
+      info("%-*.*s %10s %10s %10s %8zu", width, width, stats->name, wall, cpu, memory, stats->commands);
+    }
+  }
+
+  for (size_t i = 0; i < builder_progress.contexts_count; i++) {
+    free(builder_progress.contexts[i]->name);
+    free(builder_progress.contexts[i]);
+  }
+
+  builder_progress.contexts_count = 0;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Task graph /////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Creates a scope for declaring tasks with `Task()`. When the scope ends, the tasks
+ * run as soon as their dependencies are done (limited by the job limit) and the graph is freed.
+ */
+#define TaskGraph()                                                                   \
+  for (task_graph_t *task_graph = task_graph_create(); task_graph != NULL;            \
+    task_graph_run(task_graph), task_graph_free(task_graph), task_graph = NULL)
+
+/**
+ * @brief Declares a task in the current `TaskGraph()`.
+ * @param ... The initializers for the `task_definition_t` struct.
+ * @return The new `task_t *`, which can be used in the `.after` list of other tasks.
+ * @example
+ * TaskGraph() {
+ *   task_t *obj = Task(.name = "foo.o", .command = StringArrayN("cc", "-c", "foo.c", "-o", "foo.o"),
+ *                      .inputs = StringArrayN("foo.c"), .outputs = StringArrayN("foo.o"));
+ *   Task(.name = "foo", .command = StringArrayN("cc", "-o", "foo", "foo.o"), .after = TaskList(obj));
+ * }
+ */
+#define Task(...) task_add(task_graph, &(task_definition_t){__VA_ARGS__})
+
+/**
+ * @brief Creates a NULL-terminated `task_t *` array, for the `.after` field of a task.
+ * @param ... A comma-separated list of `task_t *`.
+ */
+#define TaskList(...) ((task_t *[]){__VA_ARGS__, NULL})
+
+/** @brief Describes a task to add to a graph. */
+typedef struct task_definition_t {
+  /** @brief The name of the task, used in messages. Defaults to the command's executable. */
+  const char *name;
+  /** @brief The command of the task, ending with NULL. Can be NULL for a task that only groups others. */
+  char **command;
+  /** @brief The files the task reads, ending with NULL, or NULL. */
+  char **inputs;
+  /** @brief The files the task writes, ending with NULL, or NULL. */
+  char **outputs;
+  /** @brief Tasks that must finish before this one, ending with NULL, or NULL. */
+  struct task_t **after;
+} task_definition_t;
+
+/** @brief The lifecycle of a task. */
+typedef enum task_state_t {
+  /** @brief The task waits for its dependencies. */
+  TASK_WAITING,
+  /** @brief The task's command was queued or is running. */
+  TASK_RUNNING,
+  /** @brief The task finished successfully, or was up to date. */
+  TASK_DONE,
+  /** @brief The task's command failed. */
+  TASK_FAILED,
+  /** @brief The task didn't run because one of its dependencies failed. */
+  TASK_SKIPPED,
+} task_state_t;
+
+/** @brief A node of a task graph. */
+typedef struct task_t {
+  /** @brief The name of the task. Owned by the task. */
+  char *name;
+  /** @brief The command of the task, inputs and outputs, each ending with NULL. Owned by the task. */
+  char **command, **inputs, **outputs;
+  /** @brief The tasks that must finish before this one. */
+  struct task_t **deps;
+  /** @brief The number of dependencies. */
+  size_t deps_count,
+  /** @brief The allocated capacity of `deps`. */
+         deps_size,
+  /** @brief The number of dependencies that didn't finish yet. */
+         waiting;
+  /** @brief The tasks that depend on this one. */
+  struct task_t **dependents;
+  /** @brief The number of dependents, and the allocated capacity of `dependents`. */
+  size_t dependents_count, dependents_size;
+  /** @brief The current state of the task. */
+  task_state_t state;
+  /** @brief The graph the task belongs to. */
+  struct task_graph_t *graph;
+  /** @brief The estimated time from the task's start until all its dependents are done, in nanoseconds. */
+  uint64_t critical_ns;
+} task_t;
+
+/** @brief A set of tasks and their dependency edges. */
+typedef struct task_graph_t {
+  /** @brief The allocated capacity of the graph. */
+  size_t size,
+  /** @brief The current number of tasks. */
+         current,
+  /** @brief The number of tasks that failed or were skipped. */
+         failed;
+  /** @brief The tasks, in the order they were declared. */
+  task_t **items;
+  /** @brief The group running the graph's commands while `task_graph_run` is in progress. */
+  pid_list_t *jobs;
+} task_graph_t;
+
+/**
+ * @brief Creates a new, empty task graph.
+ * @return A pointer to the newly allocated `task_graph_t`. Must be freed with `task_graph_free`.
+ */
+task_graph_t *task_graph_create()
+  impl({ return (task_graph_t *)calloc(1, sizeof(task_graph_t)); });
+
+impl(
+  /**
+   * @brief Copies a NULL-terminated string array.
+   * @return The copy, or NULL if `strings` is NULL.
+   */
+  static char **builder_strings_dup(char **strings) {
+    size_t count = 0;
+
+    if (!strings) {
+      return NULL;
+    }
+
+    while (strings[count]) {
+      count++;
+    }
+
+    char **copy = (char **)malloc(sizeof(char *) * (count + 1));
+
+    for (size_t i = 0; i < count; i++) {
+      copy[i] = strdup(strings[i]);
+    }
+
+    copy[count] = NULL;
+
+    return copy;
+  }
+
+  /**
+   * @brief Frees a string array allocated by `builder_strings_dup`.
+   */
+  static void builder_strings_free(char **strings) {
+    for (size_t i = 0; strings && strings[i]; i++) {
+      free(strings[i]);
+    }
+
+    free(strings);
+  }
+)
+
+/**
+ * @brief Adds an edge to the graph: `task` won't start before `dependency` is done.
+ * @param task The dependent task.
+ * @param dependency The task that must finish first.
+ */
+void task_depends_on(task_t *task, task_t *dependency) impl({
+  for (size_t i = 0; i < task->deps_count; i++) {
+    if (task->deps[i] == dependency) {
+      return;
+    }
+  }
+
+  if (task->deps_size <= task->deps_count) {
+    task->deps_size = (task->deps_size + 1) * 2;
+    task->deps = (task_t **)realloc(task->deps, sizeof(task_t *) * task->deps_size);
+  }
+
+  if (dependency->dependents_size <= dependency->dependents_count) {
+    dependency->dependents_size = (dependency->dependents_size + 1) * 2;
+    dependency->dependents = (task_t **)realloc(dependency->dependents, sizeof(task_t *) * dependency->dependents_size);
+  }
+
+  task->deps[task->deps_count++] = dependency;
+  dependency->dependents[dependency->dependents_count++] = task;
+});
+
+/**
+ * @brief Adds a task to a graph. Tasks reading a file written by another task depend on it.
+ * @param graph The graph to add the task to.
+ * @param definition The command, inputs, outputs and explicit dependencies of the task. It is copied.
+ * @return The new task, owned by the graph.
+ */
+task_t *task_add(task_graph_t *graph, const task_definition_t *definition) impl({
+  task_t *task = (typeof(task)) calloc(1, sizeof(task_t));
+
+  task->command = builder_strings_dup(definition->command);
+  task->inputs = builder_strings_dup(definition->inputs);
+  task->outputs = builder_strings_dup(definition->outputs);
+  task->graph = graph;
+
+  if (definition->name) {
+    task->name = strdup(definition->name);
+  } else if (task->command && task->command[0]) {
+    task->name = strdup(task->command[0]);
+  } else {
+    task->name = strdup("<unnamed task>");
+  }
+
+  for (size_t i = 0; definition->after && definition->after[i]; i++) {
+    task_depends_on(task, definition->after[i]);
+  }
+
+  if (graph->size <= graph->current) {
+    graph->size = (graph->size + 1) * 2;
+    graph->items = (task_t **)realloc(graph->items, sizeof(task_t *) * graph->size);
+  }
+
+  graph->items[graph->current++] = task;
+
+  return task;
+});
+
+/**
+ * @brief Frees a task graph and all its tasks.
+ * @param graph The graph to free.
+ */
+void task_graph_free(task_graph_t *graph) impl({
+  for (size_t i = 0; i < graph->current; i++) {
+    task_t *task = graph->items[i];
+
+    builder_strings_free(task->command);
+    builder_strings_free(task->inputs);
+    builder_strings_free(task->outputs);
+
+    free(task->name);
+    free(task->deps);
+    free(task->dependents);
+    free(task);
+  }
+
+  free(graph->items);
+  free(graph);
+});
+
+impl(
+  static void builder_task_start(task_t *task);
+
+  /**
+   * @brief Estimates the longest chain of commands starting at a task, from the durations of their last runs.
+   */
+  static uint64_t builder_task_critical_path(task_t *task) {
+    uint64_t longest = 0, duration = 0;
+
+    // Tasks on a cycle never start, the marker only stops the recursion
+    if (task->critical_ns) {
+      return task->critical_ns == UINT64_MAX ? 0 : task->critical_ns;
+    }
+
+    task->critical_ns = UINT64_MAX;
+
+    for (size_t i = 0; i < task->dependents_count; i++) {
+      uint64_t path = builder_task_critical_path(task->dependents[i]);
+
+      longest = path > longest ? path : longest;
+    }
+
+    if (task->command && task->command[0]) {
+      char key[17];
+
+      builder_command_key(task->command, key);
+
+      state_record_t *record = builder_state_get(STATE_COMMAND, key);
+
+      duration = record ? record->values[1] : 0;
+    }
+
+    // Counting each task keeps long chains of tasks that never ran first as well
+    task->critical_ns = duration + longest + 1;
+
+    return task->critical_ns;
+  }
+
+  /**
+   * @brief Marks a task and everything that depends on it as skipped.
+   */
+  static void builder_task_skip(task_t *task) {
+    if (task->state == TASK_SKIPPED) {
+      return;
+    }
+
+    task->state = TASK_SKIPPED;
+    task->graph->failed++;
+
+    for (size_t i = 0; i < task->dependents_count; i++) {
+      builder_task_skip(task->dependents[i]);
+    }
+  }
+
+  /**
+   * @brief Finishes a task, starting the dependents it was the last dependency of.
+   */
+  static void builder_task_finish(task_t *task, bool success) {
+    task->state = success ? TASK_DONE : TASK_FAILED;
+
+    if (!success) {
+      error("task %s failed", task->name);
+
+      task->graph->failed++;
+
+      for (size_t i = 0; i < task->dependents_count; i++) {
+        builder_task_skip(task->dependents[i]);
+      }
+
+      return;
+    }
+
+    for (size_t i = 0; i < task->dependents_count; i++) {
+      task_t *dependent = task->dependents[i];
+
+      if (--dependent->waiting == 0 && dependent->state == TASK_WAITING) {
+        builder_task_start(dependent);
+      }
+    }
+  }
+
+  /**
+   * @brief Finishes the task of a job once its command exits.
+   */
+  static void builder_task_on_exit(job_t *job, void *data) {
+    task_t *task = (task_t *)data;
+
+    // Outputs that were up to date are rewritten too, their dependents must see that
+    for (size_t i = 0; task->outputs && task->outputs[i]; i++) {
+      builder_stat_invalidate(task->outputs[i]);
+    }
+
+    builder_task_finish(task, job->state == JOB_DONE && job->status == 0);
+  }
+
+  /**
+   * @brief Starts a task whose dependencies are done, or finishes it right away if it is up to date.
+   */
+  static void builder_task_start(task_t *task) {
+    bool stale = !task->outputs || !task->outputs[0] || !task->inputs;
+
+    if (!task->command || !task->command[0]) {
+      builder_task_finish(task, true);
+
+      return;
+    }
+
+    // Every output is checked, so all the stale ones are claimed by the task's job
+    for (size_t i = 0; task->inputs && task->outputs && task->outputs[i]; i++) {
+      stale |= builder_needs_rebuild(task->outputs[i], task->inputs, task->command);
+    }
+
+    if (!stale) {
+      builder_task_finish(task, true);
+
+      return;
+    }
+
+    task->state = TASK_RUNNING;
+
+    // Ready tasks on the longest path through the rest of the graph start first
+    job_t *job = pid_list_enqueue_ex(task->graph->jobs, task->command, SpawnOptions(.priority = task->critical_ns));
+
+    job->on_exit = builder_task_on_exit;
+    job->on_exit_data = task;
+
+    // The job is started right away when a slot is free, and may have failed to start or been dropped
+    if (job->state == JOB_FAILED || job->state == JOB_CANCELLED) {
+      builder_task_finish(task, false);
+    }
+  }
+)
+
+/**
+ * @brief Runs the tasks of a graph, each as soon as all its dependencies are done.
+ *
+ * Tasks whose outputs are up to date with their inputs and command (see `builder_needs_rebuild`)
+ * are skipped. Since inputs are compared by contents, a task rewriting its outputs with the same
+ * bytes doesn't make the tasks reading them run again. When a task fails, the tasks depending on
+ * it are not run, while unrelated tasks keep running. Among the tasks ready to run, those on the
+ * longest path through the rest of the graph (estimated from the durations recorded in the build
+ * state) start first.
+ * @param graph The graph to run.
+ * @return The number of tasks that failed or were skipped because a dependency failed.
+ */
+int task_graph_run(task_graph_t *graph) impl({
+  // Connect the tasks reading a file to the task writing it
+  for (size_t i = 0; i < graph->current; i++) {
+    task_t *task = graph->items[i];
+
+    for (size_t j = 0; task->inputs && task->inputs[j]; j++) {
+      for (size_t k = 0; k < graph->current; k++) {
+        task_t *producer = graph->items[k];
+
+        for (size_t l = 0; producer != task && producer->outputs && producer->outputs[l]; l++) {
+          if (strcmp(producer->outputs[l], task->inputs[j]) == 0) {
+            task_depends_on(task, producer);
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  graph->failed = 0;
+  graph->jobs = pid_list_create();
+
+  for (size_t i = 0; i < graph->current; i++) {
+    graph->items[i]->state = TASK_WAITING;
+    graph->items[i]->waiting = graph->items[i]->deps_count;
+    graph->items[i]->critical_ns = 0;
+  }
+
+  for (size_t i = 0; i < graph->current; i++) {
+    builder_task_critical_path(graph->items[i]);
+  }
+
+  for (size_t i = 0; i < graph->current; i++) {
+    task_t *task = graph->items[i];
+
+    if (task->state == TASK_WAITING && task->waiting == 0) {
+      builder_task_start(task);
+    }
+  }
+
+  pid_list_wait_sync(graph->jobs);
+  pid_list_free(graph->jobs);
+
+  graph->jobs = NULL;
+
+  for (size_t i = 0; i < graph->current; i++) {
+    if (graph->items[i]->state == TASK_WAITING) {
+      error("task %s is part of a dependency cycle", graph->items[i]->name);
+
+      graph->failed++;
+    }
+  }
+
+  return (int)graph->failed;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+////////////////////////////// Argument parser ///////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Gets the program name.
+ * @return The name of the program.
+ */
+char *builder_program_name() impl({
+  return program_name;
+});
+
+impl(
+  /**
+   * @brief The options understood by every build script, looked up after the user's definitions.
+   */
+  static const argument_definition_t builder_builtin_arguments[] = {
+    { .longName = "jobs", .shortName = 'j', .requiresValue = true },
+    { .longName = "cache", .requiresValue = true },
+    { .longName = "trace", .requiresValue = true },
+    { .longName = "quiet", .shortName = 'q', .toggleOption = true },
+    { .longName = "max-memory", .requiresValue = true },
+    { .longName = "max-load", .shortName = 'l', .requiresValue = true },
+    { .longName = "jobserver", .toggleOption = true },
+    { .longName = "watch", .toggleOption = true },
+    { .longName = "daemon", .toggleOption = true },
+    { .longName = "compdb", .toggleOption = true },
+    { .longName = "remote", .requiresValue = true },
+    { .longName = "fail-fast", .toggleOption = true },
+    { .longName = "timeout", .requiresValue = true },
+    { .longName = "no-progress", .toggleOption = true },
+  };
+
+  /** @brief The number of builtin argument definitions. */
+  static const size_t builder_builtin_arguments_count =
+    sizeof(builder_builtin_arguments) / sizeof(builder_builtin_arguments[0]);
+
+  /**
+   * @brief Checks whether an argument was parsed with one of the builtin definitions.
+   * A script's own option with the same name as a builtin one takes precedence, and isn't applied.
+   */
+  static bool builder_argument_is_builtin(const argument_t *arg) {
+    for (size_t i = 0; i < builder_builtin_arguments_count; i++) {
+      if (arg->definition == &builder_builtin_arguments[i]) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * @brief The definitions of the options a build script understands, indexed by short and long name.
+   */
+  typedef struct argument_table_t {
+    /** @brief The definitions the table was built from. */
+    const argument_definition_t *defs;
+    /** @brief The number of definitions the table was built from. */
+    size_t defs_count;
+    /** @brief The definitions indexed by their short name. */
+    const argument_definition_t *short_names[256];
+    /** @brief An open addressing hash table of the definitions by long name. */
+    const argument_definition_t **long_names;
+    /** @brief The number of slots of `long_names`, a power of two. */
+    size_t long_names_size;
+  } argument_table_t;
+
+  /** @brief The lookup table of the definitions last given to `builder_parse_arguments`. */
+  static argument_table_t builder_argument_table = {0};
+
+  /**
+   * @brief Adds a definition to the argument table, unless its names are already taken by an earlier one.
+   */
+  static void builder_argument_table_insert(argument_table_t *table, const argument_definition_t *def) {
+    if (def->shortName != '\0' && !table->short_names[(unsigned char)def->shortName]) {
+      table->short_names[(unsigned char)def->shortName] = def;
+    }
+
+    if (!def->longName) {
+      return;
+    }
+
+    size_t mask = table->long_names_size - 1;
+
+    for (size_t i = builder_hash_string(def->longName) & mask; ; i = (i + 1) & mask) {
+      if (!table->long_names[i]) {
+        table->long_names[i] = def;
+        return;
+      }
+
+      if (strcmp(table->long_names[i]->longName, def->longName) == 0) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Builds the lookup table of a definitions array and the builtin options, once per array.
+   * The user's definitions are inserted first, so they take precedence over the builtin ones.
+   */
+  static argument_table_t *builder_argument_table_get(const argument_definition_t *defs, size_t defs_count) {
+    argument_table_t *table = &builder_argument_table;
+
+    if (table->long_names && table->defs == defs && table->defs_count == defs_count) {
+      return table;
+    }
+
+    free(table->long_names);
+    memset(table, 0, sizeof(*table));
+
+    table->defs = defs;
+    table->defs_count = defs_count;
+    table->long_names_size = 16;
+
+    // At most half full, to keep probe sequences short
+    while (table->long_names_size < (defs_count + builder_builtin_arguments_count) * 2) {
+      table->long_names_size *= 2;
+    }
+
+    table->long_names = (typeof(table->long_names)) calloc(table->long_names_size, sizeof(*table->long_names));
+
+    for (size_t i = 0; i < defs_count; i++) {
+      builder_argument_table_insert(table, &defs[i]);
+    }
+
+    for (size_t i = 0; i < builder_builtin_arguments_count; i++) {
+      builder_argument_table_insert(table, &builder_builtin_arguments[i]);
+    }
+
+    return table;
+  }
+
+  /**
+   * @brief Finds an argument definition by its long name (e.g., "help").
+   * @param table The lookup table of the definitions.
+   * @param name The long name to search for.
+   * @return A pointer to the matching definition, or NULL if not found.
+   */
+  static const argument_definition_t* builder_find_def_by_long_name(const argument_table_t *table, const char *name) {
+    size_t mask = table->long_names_size - 1;
+
+    for (size_t i = builder_hash_string(name) & mask; table->long_names[i]; i = (i + 1) & mask) {
+      if (strcmp(table->long_names[i]->longName, name) == 0) {
+        return table->long_names[i];
+      }
+    }
+    return NULL;
+  }
+
+  /**
+   * @brief Finds an argument definition by its short name (e.g., 'h').
+   * @param table The lookup table of the definitions.
+   * @param name The short name character to search for.
+   * @return A pointer to the matching definition, or NULL if not found.
+   */
+  static const argument_definition_t* builder_find_def_by_short_name(const argument_table_t *table, char name) {
+    return table->short_names[(unsigned char)name];
+  }
+
+  /**
+   * @brief The parsed arguments indexed by name, for `builder_get_argument`.
+   */
+  typedef struct argument_index_t {
+    /** @brief The last parsed argument of each short name. */
+    argument_t *short_names[256];
+    /** @brief An open addressing hash table of the last parsed argument of each long name. */
+    argument_t **long_names;
+    /** @brief The number of slots of `long_names`, a power of two. */
+    size_t long_names_size;
+  } argument_index_t;
+
+  /**
+   * @brief Indexes the parsed arguments by name, once they won't move anymore.
+   */
+  static void builder_index_arguments(arguments_t *args) {
+    argument_index_t *index = (typeof(index)) arena_alloc(args->arena, sizeof(argument_index_t));
+
+    index->long_names_size = 16;
+
+    while (index->long_names_size < args->count * 2) {
+      index->long_names_size *= 2;
+    }
+
+    index->long_names = (typeof(index->long_names)) arena_alloc(args->arena, sizeof(argument_t *) * index->long_names_size);
+
+    size_t mask = index->long_names_size - 1;
+
+    // Later arguments replace earlier ones, like repeated options usually do
+    for (size_t i = 0; i < args->count; i++) {
+      argument_t *arg = &args->items[i];
+
+      if (arg->shortName != '\0') {
+        index->short_names[(unsigned char)arg->shortName] = arg;
+      }
+
+      if (!arg->longName) continue;
+
+      size_t slot = builder_hash_string(arg->longName) & mask;
+
+      while (index->long_names[slot] && strcmp(index->long_names[slot]->longName, arg->longName) != 0) {
+        slot = (slot + 1) & mask;
+      }
+
+      index->long_names[slot] = arg;
+    }
+
+    args->index = index;
+  }
+
+  /**
+   * @brief Appends a new parsed argument to the array of arguments, growing it if needed.
+   * @param args The main arguments structure containing the array.
+   * @param def The definition of the argument being added.
+   * @param value The string value for the argument, or NULL for toggles.
+   * @return `true` on success.
+   */
+  static bool builder_add_argument(arguments_t *args, const argument_definition_t* def, char* value) {
+    if (args->size <= args->count) {
+      size_t size = args->size ? args->size * 2 : 8;
+
+      args->items = (typeof(args->items)) arena_grow(args->arena, args->items,
+          sizeof(argument_t) * args->size, sizeof(argument_t) * size);
+      args->size = size;
+    }
+
+    args->items[args->count++] = (argument_t){
+      .longName = def->longName,
+      .shortName = def->shortName,
+      .value = value,
+      .definition = def,
+    };
+
+    return true;
+  }
+)
+
+void builder_free_arguments(arguments_t *args);
+
+/**
+ * @brief Parses command-line arguments (argc, argv) based on a list of definitions.
+ *
+ * Options that aren't found in `defs` are looked up in the builtin options (e.g. `-j`),
+ * which are applied by `builder_apply_builtin_arguments`.
+ *
+ * @param argc The argument count from main().
+ * @param argv The argument vector from main().
+ * @param defs An array of argument_definition_t that defines valid arguments.
+ * @param defs_count The number of elements in the defs array.
+ * @return A pointer to a newly allocated arguments_t struct, or NULL on error.
+ * The caller is responsible for freeing this struct using builder_free_arguments().
+ */
+arguments_t* builder_parse_arguments(int argc, char **argv, const argument_definition_t *defs, size_t defs_count) impl({
+  if (defs_count <= 0) return NULL;
+
+  arena_t *arena = (typeof(arena)) calloc(1, sizeof(arena_t));
+
+  if (!arena) {
+    perror("Failed to allocate memory for arguments");
+    return NULL;
+  }
+
+  // The arguments live in their own arena, so they are freed in one go
+  arguments_t *parsed_args = (typeof(parsed_args)) arena_alloc(arena, sizeof(arguments_t));
+
+  parsed_args->arena = arena;
+
+  // Built on the first parse, so each option is found without scanning the definitions
+  const argument_table_t *table = builder_argument_table_get(defs, defs_count);
+
+  int i;
+  for (i = 1; i < argc; ++i) {
+    char *arg = argv[i];
+
+    // Stop parsing if "--" is encountered.
+    if (strcmp(arg, "--") == 0) {
+      i++; // Move past the "--"
+      break;
+    }
+
+    // Stop parsing if the argument doesn't start with '-'.
+    if (arg[0] != '-') {
+      break;
+    }
+
+    // --- Handle Long Options (e.g., --help) ---
+    if (strncmp(arg, "--", 2) == 0) {
+      char *long_name = arg + 2;
+      if (strlen(long_name) == 0) { // Argument is just "--"
+        i++;
+        break;
+      }
+
+      const argument_definition_t* def = builder_find_def_by_long_name(table, long_name);
+      if (!def) {
+        fprintf(stderr, "Error: Unknown option %s\n", arg);
+        builder_free_arguments(parsed_args);
+        return NULL;
+      }
+
+      if (def->requiresValue) {
+        if (i + 1 >= argc) {
+          fprintf(stderr, "Error: Option %s requires a value, but none was supplied.\n", arg);
+          builder_free_arguments(parsed_args);
+          return NULL;
+        }
+        if (!builder_add_argument(parsed_args, def, argv[i + 1])) return NULL;
+        i++; // Consume the value argument
+      } else { // It's a toggle
+        if (!builder_add_argument(parsed_args, def, NULL)) return NULL;
+      }
+    }
+    // --- Handle Short Options (e.g., -h, -xvf) ---
+    else {
+      char *short_opts = arg + 1;
+      bool value_option_found = false;
+
+      for (int j = 0; short_opts[j] != '\0'; ++j) {
+        const argument_definition_t* def = builder_find_def_by_short_name(table, short_opts[j]);
+        if (!def) {
+          fprintf(stderr, "Error: Unknown option -%c in %s\n", short_opts[j], arg);
+          builder_free_arguments(parsed_args);
+          return NULL;
+        }
+
+        if (def->requiresValue) {
+          if (value_option_found) {
+            fprintf(stderr, "Error: Only one option requiring a value is allowed in a single group like %s.\n", arg);
+            builder_free_arguments(parsed_args);
+            return NULL;
+          }
+          value_option_found = true;
+
+          // Check if value is attached (e.g., -f<value>)
+          if (short_opts[j + 1] != '\0') {
+            if (!builder_add_argument(parsed_args, def, &short_opts[j + 1])) return NULL;
+            goto next_arg; // Done with this argv element
+          }
+          // Else, the value must be the next argument
+          else {
+            if (i + 1 >= argc) {
+              fprintf(stderr, "Error: Option -%c requires a value, but none was supplied.\n", def->shortName);
+              builder_free_arguments(parsed_args);
+              return NULL;
+            }
+            if (!builder_add_argument(parsed_args, def, argv[i + 1])) return NULL;
+            i++; // Consume the value argument
+          }
+        } else { // It's a toggle
+          if (!builder_add_argument(parsed_args, def, NULL)) return NULL;
+        }
+      }
+    }
+next_arg:;
+  }
+
+  // Store the remaining non-option arguments
+  parsed_args->non_option_argc = argc - i;
+  parsed_args->non_option_argv = argv + i;
+
+  builder_index_arguments(parsed_args);
+
+  return parsed_args;
+});
+
+/**
+ * @brief Gets a parsed argument by name, without walking the arguments.
+ * @param args The parsed arguments. Can be NULL.
+ * @param name The long name of the option (e.g., "verbose"), or a one-character short name (e.g., "v").
+ * @return The last occurrence of the option on the command line, or NULL if it wasn't given.
+ */
+argument_t *builder_get_argument(arguments_t *args, const char *name) impl({
+  if (!args || !args->index || !name) return NULL;
+
+  argument_index_t *index = args->index;
+  size_t mask = index->long_names_size - 1;
+
+  for (size_t slot = builder_hash_string(name) & mask; index->long_names[slot]; slot = (slot + 1) & mask) {
+    if (strcmp(index->long_names[slot]->longName, name) == 0) {
+      return index->long_names[slot];
+    }
+  }
+
+  if (name[0] != '\0' && name[1] == '\0') {
+    return index->short_names[(unsigned char)name[0]];
+  }
+
+  return NULL;
+});
+
+/**
+ * @brief Frees all memory associated with an arguments_t struct.
+ * @param args The arguments structure to free.
+ */
+void builder_free_arguments(arguments_t *args) impl({
+  if (!args) return;
+
+  // The values point into argv, only the arguments themselves live in the arena
+  arena_t *arena = args->arena;
+
+  arena_release(arena);
+  free(arena);
+});
+
+/**
+ * @brief Applies the builtin options (e.g. `-j <jobs>`) found in the parsed arguments.
+ * @param args The parsed arguments. Can be NULL.
+ * @return `true` on success, `false` if a builtin option has an invalid value.
+ */
+bool builder_apply_builtin_arguments(arguments_t *args) impl({
+  argument_t *arg;
+
+  if (!args) return true;
+
+  arguments_foreach(args, arg) {
+    if (!builder_argument_is_builtin(arg)) {
+      continue;
+    }
+
+    if (arg->longName && strcmp(arg->longName, "jobs") == 0) {
+      char *end = NULL;
+      long jobs = strtol(arg->value, &end, 10);
+
+      if (end == arg->value || *end != '\0' || jobs < 1) {
+        error("invalid job count '%s'", arg->value);
+
+        return false;
+      }
+
+      builder_set_max_jobs(jobs);
+    } else if (arg->longName && strcmp(arg->longName, "max-memory") == 0) {
+      uint64_t max_memory;
+
+      if (!builder_parse_size(arg->value, &max_memory)) {
+        error("invalid memory limit '%s'", arg->value);
+
+        return false;
+      }
+
+      builder_set_max_memory(max_memory);
+    } else if (arg->longName && strcmp(arg->longName, "max-load") == 0) {
+      char *end = NULL;
+      double max_load = strtod(arg->value, &end);
+
+      if (end == arg->value || *end != '\0' || max_load < 0) {
+        error("invalid load average '%s'", arg->value);
+
+        return false;
+      }
+
+      builder_set_max_load(max_load);
+    } else if (arg->longName && strcmp(arg->longName, "timeout") == 0) {
+      char *end = NULL;
+      double seconds = strtod(arg->value, &end);
+
+      if (end == arg->value || *end != '\0' || seconds < 0) {
+        error("invalid timeout '%s'", arg->value);
+
+        return false;
+      }
+
+      builder_set_timeout((uint64_t)(seconds * 1000));
+    } else if (arg->longName && strcmp(arg->longName, "fail-fast") == 0) {
+      builder_set_fail_fast(true);
+    } else if (arg->longName && strcmp(arg->longName, "no-progress") == 0) {
+      builder_set_progress(false);
+    } else if (arg->longName && strcmp(arg->longName, "jobserver") == 0) {
+      builder_jobserver_requested = true;
+    } else if (arg->longName && strcmp(arg->longName, "remote") == 0) {
+      // A worker as "host" or "host/slots", like distcc's host lists
+      char *slash = strrchr(arg->value, '/'), *end = NULL;
+      long slots = 0;
+
+      if (slash) {
+        slots = strtol(slash + 1, &end, 10);
+
+        if (end == slash + 1 || *end != '\0' || slots < 1) {
+          error("invalid worker '%s'", arg->value);
+
+          return false;
+        }
+
+        *slash = '\0';
+      }
+
+      builder_ssh_executor(arg->value, (size_t)slots);
+
+      if (slash) {
+        *slash = '/';
+      }
+    } else if (arg->longName && strcmp(arg->longName, "compdb") == 0) {
+      builder_compdb_enable("compile_commands.json");
+    } else if (arg->longName && strcmp(arg->longName, "daemon") == 0) {
+      builder_daemon_requested = true;
+    } else if (arg->longName && strcmp(arg->longName, "watch") == 0) {
+      builder_watch_requested = true;
+    } else if (arg->longName && strcmp(arg->longName, "quiet") == 0) {
+      builder_set_quiet(true);
+    } else if (arg->longName && strcmp(arg->longName, "trace") == 0) {
+      builder_trace_enable(arg->value);
+    } else if (arg->longName && strcmp(arg->longName, "cache") == 0) {
+      if (!builder_cache_enable(arg->value, 0)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Watch mode /////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief How long a watch waits for more changes after the first one, so saving several files rebuilds once. */
+#ifndef BUILDER_WATCH_SETTLE_MS
+#define BUILDER_WATCH_SETTLE_MS 50
+#endif
+
+/** @brief How often a watch stats the inputs where inotify isn't available, in milliseconds. */
+#ifndef BUILDER_WATCH_POLL_MS
+#define BUILDER_WATCH_POLL_MS 500
+#endif
+
+/** @brief What a watch waits on between two builds. */
+typedef struct watch_set_t {
+  /** @brief The inputs of the last build, sorted: the files in the build state and the dependency database, and the build script's dependencies. */
+  path_list_t files,
+  /** @brief The directories read by globs, where adding or removing any file changes the build. */
+              dirs;
+} watch_set_t;
+
+impl(
   /**
-   * @brief Allocates and adds a new parsed argument to the linked list.
-   * @param args The main arguments structure containing the list.
-   * @param def The definition of the argument being added.
-   * @param value The string value for the argument, or NULL for toggles.
-   * @return `true` on success, `false` on memory allocation failure.
+   * @brief Adds the dependencies of the build script to a watch set.
    */
-  static bool builder_add_argument(arguments_t *args, const argument_definition_t* def, char* value) {
-    argument_t *new_arg = (typeof(new_arg)) malloc(sizeof(argument_t));
+  static void builder_watch_on_rule(const char *target, char **deps, size_t deps_count, void *data) {
+    watch_set_t *set = (watch_set_t *)data;
+
+    (void)target;
+
+    for (size_t i = 0; i < deps_count; i++) {
+      path_list_push(&set->files, deps[i]);
+    }
+  }
+
+  /**
+   * @brief Adds an input of the build to a watch set, unless the build writes it itself.
+   */
+  static void builder_watch_add_input(watch_set_t *set, const char *path) {
+    // Outputs that feed other commands change during every build, they'd trigger the next one
+    if (!builder_state_get(STATE_TARGET, path)) {
+      path_list_push(&set->files, path);
+    }
+  }
+
+  /**
+   * @brief Gets the name of a file in its directory.
+   */
+  static const char *builder_watch_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+  }
+
+  /**
+   * @brief Gets the current time of the clock file modification times are taken from.
+   */
+  static uint64_t builder_watch_now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+  }
+
+  /**
+   * @brief Checks if any input of a watch set was modified after a point in time.
+   */
+  static bool builder_watch_modified_since(watch_set_t *set, uint64_t since_ns) {
+    struct stat st;
+
+    for (size_t i = 0; i < set->files.count; i++) {
+      if (stat(set->files.items[i], &st) == 0 && builder_stat_mtime_ns(&st) >= since_ns) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+)
+
+/**
+ * @brief Collects what the last build depended on, for `builder_watch_wait`.
+ *
+ * Also forgets the directories globbed during the last build, the next one records them again.
+ * @param set The watch set to fill. Free it with `watch_set_free`.
+ * @param source_file The path of the build script source.
+ * @param depfile The depfile written by the last self-rebuild of the build script.
+ */
+void builder_watch_collect(watch_set_t *set, const char *source_file, const char *depfile) impl({
+  builder_state_load();
+
+  for (size_t i = 0; builder_state.items && i < builder_state.size; i++) {
+    if (builder_state.items[i].kind == STATE_FILE) {
+      builder_watch_add_input(set, builder_state.items[i].key);
+    }
+  }
+
+  for (size_t i = 0; builder_deps.items && i < builder_deps.size; i++) {
+    deps_entry_t *entry = &builder_deps.items[i];
+
+    for (const char *dep = entry->blob; entry->target && dep < entry->blob + entry->blob_len; dep += strlen(dep) + 1) {
+      builder_watch_add_input(set, dep);
+    }
+  }
+
+  path_list_push(&set->files, source_file);
+  depfile_parse(depfile, builder_watch_on_rule, set);
+
+  for (size_t i = 0; i < builder_watch_dirs.count; i++) {
+    path_list_push(&set->dirs, builder_watch_dirs.items[i]);
+  }
+
+  path_list_free(&builder_watch_dirs);
+
+  builder_path_list_sort(&set->files, 0);
+  builder_path_list_sort(&set->dirs, 0);
+});
+
+/**
+ * @brief Frees a watch set.
+ * @param set The watch set.
+ */
+void watch_set_free(watch_set_t *set) impl({
+  path_list_free(&set->files);
+  path_list_free(&set->dirs);
+});
+
+#ifdef __linux__
+/**
+ * @brief Blocks until an input of a watch set changes, with inotify.
+ *
+ * The directories of the inputs are watched rather than the files themselves, since editors
+ * often save by renaming a new file over the old one. Once something changed, the wait goes on
+ * until nothing did for `BUILDER_WATCH_SETTLE_MS`.
+ * @param set The inputs to watch.
+ * @param since_ns Inputs modified at or after this time (in nanoseconds since the epoch) count
+ * as changed right away, e.g. those saved while the last build ran.
+ * @return `true` once something changed, `false` if the inputs can't be watched.
+ */
+bool builder_watch_wait(watch_set_t *set, uint64_t since_ns) impl({
+  const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB | IN_DELETE_SELF;
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (fd == -1) {
+    error("couldn't watch for changes: %s", strerror(errno));
+
+    return false;
+  }
+
+  // The watch descriptor of every input, and whether a descriptor is of a globbed directory
+  int *file_wds = (int *)calloc(set->files.count + 1, sizeof(int));
+  bool *globbed = NULL;
+  size_t globbed_size = 0;
+  bool changed = false;
+
+  for (size_t i = 0; i < set->files.count + set->dirs.count; i++) {
+    bool is_dir = i >= set->files.count;
+    const char *path = is_dir ? set->dirs.items[i - set->files.count] : set->files.items[i];
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (is_dir) {
+      snprintf(dir, sizeof(dir), "%s", path);
+    } else if (!slash) {
+      strcpy(dir, ".");
+    } else {
+      snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+
+    // Adding a directory again returns the descriptor it already has
+    int wd = inotify_add_watch(fd, dir, mask);
+
+    if (wd < 0) {
+      continue;
+    }
+
+    if (!is_dir) {
+      file_wds[i] = wd;
+    } else {
+      if ((size_t)wd >= globbed_size) {
+        size_t size = (size_t)wd * 2 + 16;
+
+        globbed = (bool *)realloc(globbed, size * sizeof(bool));
+        memset(globbed + globbed_size, 0, (size - globbed_size) * sizeof(bool));
+        globbed_size = size;
+      }
+
+      globbed[wd] = true;
+    }
+  }
+
+  changed = builder_watch_modified_since(set, since_ns);
+
+  for (;;) {
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, changed ? BUILDER_WATCH_SETTLE_MS : -1);
+
+    if (ready == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (ready <= 0) {
+      if (ready == -1) {
+        error("couldn't watch for changes: %s", strerror(errno));
+      }
+
+      break;
+    }
+
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+
+    for (ssize_t pos = 0; pos < len;) {
+      const struct inotify_event *event = (const struct inotify_event *)(buffer + pos);
+
+      pos += sizeof(struct inotify_event) + event->len;
+
+      // Events were lost, or a watched directory went away
+      if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF)) {
+        changed = true;
+
+        continue;
+      }
+
+      if (event->len == 0) {
+        continue;
+      }
+
+      if (event->wd >= 0 && (size_t)event->wd < globbed_size && globbed[event->wd] && event->name[0] != '.' &&
+          (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        changed = true;
+
+        continue;
+      }
+
+      for (size_t i = 0; i < set->files.count && !changed; i++) {
+        changed = file_wds[i] == event->wd && strcmp(builder_watch_basename(set->files.items[i]), event->name) == 0;
+      }
+    }
+  }
+
+  free(file_wds);
+  free(globbed);
+  close(fd);
+
+  return changed;
+});
+#else
+impl(
+  /**
+   * @brief Gets a value that changes whenever a file is modified, replaced or removed.
+   */
+  static uint64_t builder_watch_stamp(const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+      return 0;
+    }
+
+    return builder_stat_mtime_ns(&st) ^ ((uint64_t)st.st_size << 32) ^ (uint64_t)st.st_ino ^ 1;
+  }
+)
+
+/**
+ * @brief Blocks until an input of a watch set changes, by stat'ing them every `BUILDER_WATCH_POLL_MS`.
+ *
+ * The directories read by globs are compared by modification time, which changes when a file is
+ * added or removed. Once something changed, the wait goes on until nothing did for
+ * `BUILDER_WATCH_SETTLE_MS`.
+ * @param set The inputs to watch.
+ * @param since_ns Inputs modified at or after this time (in nanoseconds since the epoch) count
+ * as changed right away, e.g. those saved while the last build ran.
+ * @return `true` once something changed, `false` if the inputs can't be watched.
+ */
+bool builder_watch_wait(watch_set_t *set, uint64_t since_ns) impl({
+  size_t count = set->files.count + set->dirs.count;
+  uint64_t *stamps = (uint64_t *)calloc(count + 1, sizeof(uint64_t));
+  bool changed = builder_watch_modified_since(set, since_ns);
+
+  for (size_t i = 0; i < count; i++) {
+    stamps[i] = builder_watch_stamp(i < set->files.count ? set->files.items[i] : set->dirs.items[i - set->files.count]);
+  }
+
+  for (;;) {
+    bool modified = false;
+
+    poll(NULL, 0, changed ? BUILDER_WATCH_SETTLE_MS : BUILDER_WATCH_POLL_MS);
+
+    for (size_t i = 0; i < count; i++) {
+      uint64_t stamp = builder_watch_stamp(i < set->files.count ? set->files.items[i] : set->dirs.items[i - set->files.count]);
+
+      if (stamp != stamps[i]) {
+        stamps[i] = stamp;
+        modified = true;
+      }
+    }
+
+    if (changed && !modified) {
+      break;
+    }
+
+    changed = changed || modified;
+  }
+
+  free(stamps);
+
+  return true;
+});
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////// Daemon ///////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+/** @brief The environment variable a restarting daemon hands its listening socket down in. */
+#define BUILDER_DAEMON_FD_ENV "BUILDER_DAEMON_FD"
+
+/** @brief The magic number at the start of a request to the daemon ("BDRQ"). */
+#define BUILDER_DAEMON_MAGIC 0x51524442u
+
+/** @brief The largest request the daemon accepts, in bytes. */
+#define BUILDER_DAEMON_MAX_REQUEST (1024 * 1024)
+
+/** @brief How many times a client sends its request again while the daemon restarts. */
+#define BUILDER_DAEMON_RETRIES 8
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+impl(
+  /**
+   * @brief Gets the address of the daemon of a build script, `BUILDER_STATE_DIR/<name>.sock`.
+   * @return `false` if the path doesn't fit in a socket address.
+   */
+  static bool builder_daemon_address(struct sockaddr_un *addr, const char *program) {
+    const char *name = strrchr(program, '/');
+    int length;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    length = snprintf(addr->sun_path, sizeof(addr->sun_path), BUILDER_STATE_DIR "/%s.sock", name ? name + 1 : program);
+
+    return length > 0 && (size_t)length < sizeof(addr->sun_path);
+  }
+
+  /**
+   * @brief Connects to the daemon of a build script.
+   * @return The connected socket, or -1 if no daemon is listening.
+   */
+  static int builder_daemon_connect(const char *program) {
+    struct sockaddr_un addr;
+
+    if (!builder_daemon_address(&addr, program))
+      return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1)
+      return -1;
+
+    builder_fd_setup(fd, false);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      close(fd);
+
+      return -1;
+    }
+
+    return fd;
+  }
+
+  /**
+   * @brief Reads exactly `length` bytes from a descriptor.
+   * @return `false` on failure or if the other end closed first.
+   */
+  static bool builder_daemon_read(int fd, void *data, size_t length) {
+    char *out = (char *)data;
+
+    while (length > 0) {
+      ssize_t count = read(fd, out, length);
+
+      if (count == -1 && errno == EINTR)
+        continue;
+
+      if (count <= 0)
+        return false;
+
+      out += count;
+      length -= (size_t)count;
+    }
+
+    return true;
+  }
+
+  /**
+   * @brief Reads a request from a client: its stdout and stderr, its arguments and its environment.
+   * @return The arguments (NULL-terminated, freed with a single `free` that also frees `*envp`), or NULL if
+   * the request is invalid.
+   */
+  static char **builder_daemon_receive(int client, int fds[2], int *argc, char ***envp) {
+    uint32_t header[4];
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(header) };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t count;
+
+    fds[0] = fds[1] = -1;
+
+    while ((count = recvmsg(client, &message, 0)) == -1 && errno == EINTR) {}
+
+    for (struct cmsghdr *cmsg = count > 0 ? CMSG_FIRSTHDR(&message) : NULL; cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int) * 2)) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+      }
+    }
+
+    // The descriptors come with the first byte, the rest of the header may follow separately
+    if (count <= 0 || ((size_t)count < sizeof(header) && !builder_daemon_read(client, (char *)header + count, sizeof(header) - (size_t)count)) ||
+        header[0] != BUILDER_DAEMON_MAGIC || header[1] == 0 || header[3] > BUILDER_DAEMON_MAX_REQUEST || fds[0] == -1) {
+      return NULL;
+    }
+
+    uint32_t argc_sent = header[1], envc = header[2], length = header[3];
+
+    // Every string takes at least its terminator
+    if (argc_sent > length || envc > length - argc_sent) {
+      return NULL;
+    }
+
+    // The argument vector, the environment and the strings they point to, in one allocation
+    char **argv = (char **)malloc(sizeof(char *) * (argc_sent + envc + 2) + length + 1);
+    char **env = argv + argc_sent + 1;
+    char *strings = (char *)(env + envc + 1);
+
+    if (!builder_daemon_read(client, strings, length)) {
+      free(argv);
+
+      return NULL;
+    }
+
+    strings[length] = '\0';
+
+    char *string = strings;
+
+    for (uint32_t i = 0; i < argc_sent + envc; i++) {
+      *(i < argc_sent ? &argv[i] : &env[i - argc_sent]) = string;
+
+      if (string < strings + length) {
+        string += strlen(string) + 1;
+      }
+    }
+
+    argv[argc_sent] = NULL;
+    env[envc] = NULL;
+    *argc = (int)argc_sent;
+    *envp = env;
+
+    return argv;
+  }
+
+  /**
+   * @brief Gets a value that changes when the build script executable is replaced.
+   */
+  static uint64_t builder_daemon_executable_stamp(const char *executable) {
+    struct stat st;
+
+    if (stat(executable, &st) != 0)
+      return 0;
+
+    return builder_stat_mtime_ns(&st) ^ (uint64_t)st.st_ino;
+  }
+)
+
+/**
+ * @brief Sends a build to the daemon of the build script, if one is running.
+ *
+ * The daemon builds in its own process, with the arguments and the environment of this one and
+ * writing to its stdout and stderr, which are passed over the socket. If the daemon restarts in
+ * the meantime (because the script was recompiled), the request is sent again.
+ * @param argc The argument count from main().
+ * @param argv The argument vector from main().
+ * @param code Where to store the exit code of the build.
+ * @return `true` if the daemon built, `false` if there is no daemon to build.
+ */
+bool builder_daemon_forward(int argc, char **argv, int *code) impl({
+  extern char **environ;
+  size_t length = 0, envc = 0;
+
+  for (int i = 0; i < argc; i++) {
+    length += strlen(argv[i]) + 1;
+  }
+
+  for (; environ[envc]; envc++) {
+    length += strlen(environ[envc]) + 1;
+  }
+
+  if (length > BUILDER_DAEMON_MAX_REQUEST) {
+    return false;
+  }
+
+  for (int attempt = 0; attempt < BUILDER_DAEMON_RETRIES; attempt++) {
+    int fd = builder_daemon_connect(argv[0]);
+
+    if (fd == -1) {
+      return false;
+    }
+
+    uint32_t header[4] = { BUILDER_DAEMON_MAGIC, (uint32_t)argc, (uint32_t)envc, (uint32_t)length };
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(header) };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    bool sent = true;
+    int32_t reply;
 
-    if (!new_arg) return false;
+    memset(control, 0, sizeof(control));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
 
-    new_arg->longName = def->longName;
-    new_arg->shortName = def->shortName;
-    new_arg->value = value;
+    fflush(NULL);
 
-    argument_node_t *new_node = (typeof(new_node)) malloc(sizeof(argument_node_t));
-    if (!new_node) {
-      free(new_arg);
-      return false;
+    if (sendmsg(fd, &message, MSG_NOSIGNAL) != (ssize_t)sizeof(header)) {
+      sent = false;
     }
-    new_node->argument = new_arg;
-    new_node->next = NULL;
 
-    // Append to the list
-    if (args->head == NULL) {
-      args->head = new_node;
-    } else {
-      argument_node_t *current = args->head;
-      while (current->next != NULL) {
-        current = current->next;
-      }
-      current->next = new_node;
+    for (int i = 0; sent && i < argc; i++) {
+      sent = builder_write_all(fd, argv[i], strlen(argv[i]) + 1);
     }
-    return true;
+
+    for (size_t i = 0; sent && i < envc; i++) {
+      sent = builder_write_all(fd, environ[i], strlen(environ[i]) + 1);
+    }
+
+    // A daemon that goes away without replying is restarting, its successor inherits the socket
+    if (sent && builder_daemon_read(fd, &reply, sizeof(reply))) {
+      close(fd);
+
+      *code = reply;
+
+      return true;
+    }
+
+    close(fd);
   }
-)
+
+  return false;
+});
 
 /**
- * @brief Parses command-line arguments (argc, argv) based on a list of definitions.
+ * @brief Serves builds from a Unix socket at `BUILDER_STATE_DIR/<name>.sock` until killed.
  *
- * @param argc The argument count from main().
- * @param argv The argument vector from main().
- * @param defs An array of argument_definition_t that defines valid arguments.
- * @param defs_count The number of elements in the defs array.
- * @return A pointer to a newly allocated arguments_t struct, or NULL on error.
- * The caller is responsible for freeing this struct using builder_free_arguments().
+ * The daemon detaches from the terminal, logging to `BUILDER_STATE_DIR/<name>.log` between
+ * builds, and builds once for every request of `builder_daemon_forward`, one at a time, in the
+ * environment of the client. The build state, the dependency database and the PATH lookups stay in memory between builds, so
+ * only the changed files are hashed again. When the executable is replaced, the daemon
+ * re-executes itself and hands the socket down to the new version.
+ * @param argv The argument vector from main(), used to restart the daemon.
+ * @param defs The argument definitions of the build script.
+ * @param defs_count The number of argument definitions.
+ * @param entry The entrypoint of the build script.
+ * @return The exit code of this process, once there's nothing left to serve.
  */
-arguments_t* builder_parse_arguments(int argc, char **argv, const argument_definition_t *defs, size_t defs_count) impl({
-  if (defs_count <= 0) return NULL;
+int builder_daemon_serve(char **argv, const argument_definition_t *defs, size_t defs_count,
+                         void (*entry)(arguments_t *)) impl({
+  struct sockaddr_un addr;
+  const char *inherited = getenv(BUILDER_DAEMON_FD_ENV);
+  int listener = inherited ? atoi(inherited) : -1;
 
-  arguments_t *parsed_args = (typeof(parsed_args)) calloc(1, sizeof(arguments_t));
+  if (!builder_daemon_address(&addr, argv[0])) {
+    error("the path of the daemon socket is too long");
 
-  if (!parsed_args) {
-    perror("Failed to allocate memory for arguments");
-    return NULL;
+    return 1;
   }
 
-  int i;
-  for (i = 1; i < argc; ++i) {
-    char *arg = argv[i];
+  if (inherited) {
+    unsetenv(BUILDER_DAEMON_FD_ENV);
+    builder_fd_setup(listener, false);
+  } else {
+    int running = builder_daemon_connect(argv[0]);
 
-    // Stop parsing if "--" is encountered.
-    if (strcmp(arg, "--") == 0) {
-      i++; // Move past the "--"
-      break;
+    if (running != -1) {
+      close(running);
+      error("a daemon is already listening on %s", addr.sun_path);
+
+      return 1;
     }
 
-    // Stop parsing if the argument doesn't start with '-'.
-    if (arg[0] != '-') {
+    if (mkdir(BUILDER_STATE_DIR, 0755) != 0 && errno != EEXIST) {
+      error("couldn't create " BUILDER_STATE_DIR ": %s", strerror(errno));
+    }
+
+    // Left behind by a daemon that was killed
+    unlink(addr.sun_path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listener == -1 || !builder_fd_setup(listener, false) ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+      error("couldn't listen on %s: %s", addr.sun_path, strerror(errno));
+
+      if (listener != -1) close(listener);
+
+      return 1;
+    }
+
+    fflush(NULL);
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+      error("couldn't start the daemon: %s", strerror(errno));
+
+      return 1;
+    }
+
+    if (pid != 0) {
+      info("daemon listening on %s (pid %d)", addr.sun_path, (int)pid);
+
+      return 0;
+    }
+
+    char log[PATH_MAX];
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int log_fd;
+
+    snprintf(log, sizeof(log), "%.*s.log", (int)(strlen(addr.sun_path) - strlen(".sock")), addr.sun_path);
+    log_fd = open(log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    setsid();
+
+    if (null != -1) dup2(null, STDIN_FILENO), close(null);
+    if (log_fd != -1) dup2(log_fd, STDOUT_FILENO), dup2(log_fd, STDERR_FILENO), close(log_fd);
+  }
+
+  // The defaults every build starts from, a request's options only apply to its own build
+  long max_jobs = builder_max_jobs;
+  uint64_t max_memory = builder_max_memory;
+  double max_load = builder_max_load;
+  bool quiet = builder_output_quiet, fail_fast = builder_fail_fast, progress = builder_progress.enabled;
+  uint64_t timeout_ms = builder_timeout_ms;
+  char *cache_dir = builder_cache_dir ? strdup(builder_cache_dir) : NULL;
+  uint64_t cache_max_size = builder_cache_max_size;
+  char *compdb_path = builder_compdb.path ? strdup(builder_compdb.path) : NULL;
+  size_t executors = builder_executors_count;
+  uint64_t executable = builder_daemon_executable_stamp(argv[0]);
+  int log_out = dup(STDOUT_FILENO), log_err = dup(STDERR_FILENO);
+
+  builder_fd_setup(log_out, false);
+  builder_fd_setup(log_err, false);
+
+  // Messages are interleaved with the output of the commands, which is written to the descriptors directly
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  info("daemon started (pid %d)", (int)getpid());
+
+  for (;;) {
+    int client = accept(listener, NULL, NULL);
+
+    if (client == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      error("couldn't accept a build request: %s", strerror(errno));
+
       break;
     }
 
-    // --- Handle Long Options (e.g., --help) ---
-    if (strncmp(arg, "--", 2) == 0) {
-      char *long_name = arg + 2;
-      if (strlen(long_name) == 0) { // Argument is just "--"
-        i++;
-        break;
-      }
+    builder_fd_setup(client, false);
 
-      const argument_definition_t* def = builder_find_def_by_long_name(long_name, defs, defs_count);
-      if (!def) {
-        fprintf(stderr, "Error: Unknown option %s\n", arg);
-        free(parsed_args);
-        return NULL;
+    // The script was recompiled by a client. Its request is dropped and sent again to the new version
+    if (builder_daemon_executable_stamp(argv[0]) != executable) {
+      char fd[16];
+
+      close(client);
+      info("%s changed, restarting the daemon...", argv[0]);
+
+      snprintf(fd, sizeof(fd), "%d", listener);
+      setenv(BUILDER_DAEMON_FD_ENV, fd, 1);
+      fcntl(listener, F_SETFD, 0);
+
+      fflush(NULL);
+      execv(argv[0], argv);
+
+      error("couldn't restart the daemon: %s", strerror(errno));
+      builder_fd_setup(listener, false);
+      unsetenv(BUILDER_DAEMON_FD_ENV);
+      executable = builder_daemon_executable_stamp(argv[0]);
+
+      continue;
+    }
+
+    int fds[2], request_argc = 0;
+    char **request_env = NULL;
+    char **request_argv = builder_daemon_receive(client, fds, &request_argc, &request_env);
+    int32_t code = 1;
+
+    if (request_argv) {
+      extern char **environ;
+      char **daemon_env = environ;
+
+      fflush(NULL);
+      dup2(fds[0], STDOUT_FILENO);
+      dup2(fds[1], STDERR_FILENO);
+
+      // The build sees the client's PATH, CC, CFLAGS..., as if it ran in the client
+      environ = request_env;
+
+      arguments_t *args = builder_parse_arguments(request_argc, request_argv, defs, defs_count);
+
+      code = args && builder_apply_builtin_arguments(args) ? 0 : 1;
+
+      if (code == 0) {
+        builder_stat_invalidate_all();
+        builder_progress_begin();
+
+        entry(args);
+
+        builder_progress_end();
+        builder_state_save();
+        builder_compdb_save();
+        builder_cache_trim();
+        builder_trace_write();
       }
 
-      if (def->requiresValue) {
-        if (i + 1 >= argc) {
-          fprintf(stderr, "Error: Option %s requires a value, but none was supplied.\n", arg);
-          free(parsed_args);
-          return NULL;
-        }
-        if (!builder_add_argument(parsed_args, def, argv[i + 1])) return NULL;
-        i++; // Consume the value argument
-      } else { // It's a toggle
-        if (!builder_add_argument(parsed_args, def, NULL)) return NULL;
+      builder_free_arguments(args);
+      builder_trace_disable();
+
+      builder_max_jobs = max_jobs;
+      builder_max_memory = max_memory;
+      builder_max_load = max_load;
+      builder_output_quiet = quiet;
+      builder_fail_fast = fail_fast;
+      builder_timeout_ms = timeout_ms;
+      builder_progress.enabled = progress;
+
+      if (cache_dir) {
+        builder_cache_enable(cache_dir, cache_max_size);
+      } else {
+        free(builder_cache_dir);
+        builder_cache_dir = NULL;
       }
+
+      free(builder_compdb.path);
+      builder_compdb.path = compdb_path ? strdup(compdb_path) : NULL;
+
+      builder_executors_truncate(executors);
+
+      // A setenv of the build copied the client's environment, the copy is left to the C library
+      environ = daemon_env;
+
+      fflush(NULL);
+      dup2(log_out, STDOUT_FILENO);
+      dup2(log_err, STDERR_FILENO);
     }
-    // --- Handle Short Options (e.g., -h, -xvf) ---
-    else {
-      char *short_opts = arg + 1;
-      bool value_option_found = false;
 
-      for (int j = 0; short_opts[j] != '\0'; ++j) {
-        const argument_definition_t* def = builder_find_def_by_short_name(short_opts[j], defs, defs_count);
-        if (!def) {
-          fprintf(stderr, "Error: Unknown option -%c in %s\n", short_opts[j], arg);
-          free(parsed_args);
-          return NULL;
-        }
+    for (int i = 0; i < 2; i++) {
+      if (fds[i] != -1) close(fds[i]);
+    }
 
-        if (def->requiresValue) {
-          if (value_option_found) {
-            fprintf(stderr, "Error: Only one option requiring a value is allowed in a single group like %s.\n", arg);
-            free(parsed_args);
-            return NULL;
-          }
-          value_option_found = true;
+    send(client, &code, sizeof(code), MSG_NOSIGNAL);
+    close(client);
+    free(request_argv);
+  }
 
-          // Check if value is attached (e.g., -f<value>)
-          if (short_opts[j + 1] != '\0') {
-            if (!builder_add_argument(parsed_args, def, &short_opts[j + 1])) return NULL;
-            goto next_arg; // Done with this argv element
-          }
-          // Else, the value must be the next argument
-          else {
-            if (i + 1 >= argc) {
-              fprintf(stderr, "Error: Option -%c requires a value, but none was supplied.\n", def->shortName);
-              free(parsed_args);
-              return NULL;
-            }
-            if (!builder_add_argument(parsed_args, def, argv[i + 1])) return NULL;
-            i++; // Consume the value argument
-          }
-        } else { // It's a toggle
-          if (!builder_add_argument(parsed_args, def, NULL)) return NULL;
-        }
+  free(cache_dir);
+  free(compdb_path);
+  close(listener);
+  unlink(addr.sun_path);
+
+  return 1;
+});
+
+//////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// Entry point ////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+impl(
+  /** @brief The state of the self-rebuild check while reading the script's depfile. */
+  typedef struct builder_script_check_t {
+    /** @brief The modification time of the build script executable, in nanoseconds. */
+    uint64_t executable_mtime_ns;
+    /** @brief `true` once a dependency newer than the executable was found. */
+    bool stale;
+  } builder_script_check_t;
+
+  /**
+   * @brief Checks the dependencies of the build script against its executable.
+   */
+  static void builder_script_on_rule(const char *target, char **deps, size_t deps_count, void *data) {
+    builder_script_check_t *check = (builder_script_check_t *)data;
+    struct stat st;
+
+    (void)target;
+
+    for (size_t i = 0; i < deps_count && !check->stale; i++) {
+      // A header that vanished must be noticed as well, the compiler will then complain
+      check->stale = stat(deps[i], &st) != 0 || builder_stat_mtime_ns(&st) > check->executable_mtime_ns;
+    }
+  }
+
+  /**
+   * @brief Checks the other source files of a build script, given in its `BUILDER_SCRIPT_CFLAGS`.
+   */
+  static bool builder_script_sources_are_stale(const char *executable, char **cflags, size_t cflags_count) {
+    struct stat st;
+
+    if (stat(executable, &st) != 0) {
+      return false;
+    }
+
+    uint64_t executable_mtime_ns = builder_stat_mtime_ns(&st);
+
+    for (size_t i = 0; i < cflags_count; i++) {
+      if (cflags[i][0] != '-' && builder_is_source_file(cflags[i]) &&
+          (stat(cflags[i], &st) != 0 || builder_stat_mtime_ns(&st) > executable_mtime_ns)) {
+        return true;
       }
     }
-next_arg:;
+
+    return false;
   }
+)
 
-  // Store the remaining non-option arguments
-  parsed_args->non_option_argc = argc - i;
-  parsed_args->non_option_argv = argv + i;
+/**
+ * @brief Checks if the build script has to be recompiled.
+ *
+ * The dependencies written by the last self-rebuild (the source and every header it includes,
+ * like builder.h) are compared to the executable. Without a depfile, the script is considered
+ * stale so the next self-rebuild writes one.
+ * @param executable The path of the build script executable.
+ * @param source_file The path of the build script source.
+ * @param depfile The depfile written by the last self-rebuild.
+ * @return `true` if a dependency is newer than the executable, `false` otherwise.
+ */
+bool builder_script_is_stale(const char *executable, const char *source_file, const char *depfile) impl({
+  builder_script_check_t check = {0};
+  struct stat st;
 
-  return parsed_args;
+  if (stat(executable, &st) != 0) {
+    return false;
+  }
+
+  check.executable_mtime_ns = builder_stat_mtime_ns(&st);
+
+  if (stat(source_file, &st) != 0) {
+    return false;
+  }
+
+  if (builder_stat_mtime_ns(&st) > check.executable_mtime_ns) {
+    return true;
+  }
+
+  // Without a depfile we can't tell which headers changed, rebuilding once records them
+  if (!depfile_parse(depfile, builder_script_on_rule, &check)) {
+    return true;
+  }
+
+  return check.stale;
 });
 
 /**
- * @brief Frees all memory associated with an arguments_t struct.
- * @param args The arguments structure to free.
+ * @brief Recompiles the build script with the host C compiler and restarts it.
+ *
+ * The executable is written next to the old one and renamed over it, with a depfile in
+ * `BUILDER_STATE_DIR` so the next run can tell which headers the script depends on.
+ * @param argv The argument vector from main(), used to restart the script.
+ * @param source_file The path of the build script source.
+ * @param depfile Where the compiler writes the dependencies of the script.
+ * @param cflags Extra compiler flags.
+ * @param cflags_count The number of extra compiler flags.
+ * @return 1 on failure. On success, this function doesn't return.
  */
-void builder_free_arguments(arguments_t *args) impl({
-  if (!args) return;
+int builder_rebuild_self(char **argv, const char *source_file, const char *depfile,
+                         char **cflags, size_t cflags_count) impl({
+  char host_cc[PATH_MAX] = {0}, executable_tmp[PATH_MAX];
+  char **command = (char **)calloc(cflags_count + 9, sizeof(char *));
+  size_t argc = 0;
+
+  info("build script is newer than the current executable, recompiling...");
+
+  // Find a C compiler to recompile the script
+  if (!find_executable("cc", host_cc) && !find_executable("clang", host_cc) && !find_executable("gcc", host_cc)) {
+    error("Failed to find host C compiler");
+    free(command);
+
+    return 1;
+  }
+
+  if (mkdir(BUILDER_STATE_DIR, 0755) != 0 && errno != EEXIST) {
+    error("couldn't create " BUILDER_STATE_DIR ": %s", strerror(errno));
+  }
+
+  snprintf(executable_tmp, sizeof(executable_tmp), "%s.tmp", argv[0]);
+
+  command[argc++] = host_cc;
+
+  for (size_t i = 0; i < cflags_count; i++) {
+    command[argc++] = cflags[i];
+  }
+
+  command[argc++] = "-MMD";
+  command[argc++] = "-MF";
+  command[argc++] = (char *)depfile;
+  command[argc++] = "-o";
+  command[argc++] = executable_tmp;
+  command[argc++] = (char *)source_file;
+  command[argc] = NULL;
+
+  int code = wait_pid_sync(run_command(host_cc, command));
+
+  free(command);
+
+  if (code != 0) {
+    error("compilation failed with code %d", code);
+    unlink(executable_tmp);
+
+    return 1;
+  }
+
+  // Replace the executable atomically, it may still be running elsewhere
+  if (rename(executable_tmp, argv[0]) != 0) {
+    error("couldn't replace %s: %s", argv[0], strerror(errno));
+
+    return 1;
+  }
+
+  info("re-running build script again...");
+  info("--------------------------------");
+
+  // Replace our process with the re-compiled build script, without losing buffered messages
+  fflush(NULL);
+  execv(argv[0], argv);
+
+  error("couldn't re-run %s: %s", argv[0], strerror(errno));
+
+  return 1;
+});
+
+/**
+ * @brief Runs the build script: recompiles it if needed, parses the arguments, calls the
+ * entrypoint and saves the build state. Called by `main_impl`.
+ * @param argc The argument count from main().
+ * @param argv The argument vector from main().
+ * @param source_file The path of the build script source (its `__FILE__`).
+ * @param cflags Extra compiler flags for self-rebuilds (`BUILDER_SCRIPT_CFLAGS`).
+ * @param cflags_count The number of extra compiler flags.
+ * @param defs The argument definitions of the build script.
+ * @param defs_count The number of argument definitions.
+ * @param entry The entrypoint of the build script.
+ * @return The exit code of the build script.
+ */
+int builder_main(int argc, char **argv, const char *source_file, char **cflags, size_t cflags_count,
+                 const argument_definition_t *defs, size_t defs_count, void (*entry)(arguments_t *)) impl({
+  char depfile[PATH_MAX];
+  const char *name = strrchr(argv[0], '/');
+
+  program_name = argv[0];
 
-  argument_node_t *current = args->head;
+  snprintf(depfile, sizeof(depfile), BUILDER_STATE_DIR "/%s.d", name ? name + 1 : argv[0]);
 
-  while (current != NULL) {
-    argument_node_t *next = current->next;
+  if (builder_script_is_stale(argv[0], source_file, depfile) || builder_script_sources_are_stale(argv[0], cflags, cflags_count)) {
+    return builder_rebuild_self(argv, source_file, depfile, cflags, cflags_count);
+  }
+
+  arguments_t *args = builder_parse_arguments(argc, argv, defs, defs_count);
+
+  if (!builder_apply_builtin_arguments(args)) {
+    builder_free_arguments(args);
+
+    return 1;
+  }
+
+  if (builder_daemon_requested) {
+    int code = builder_daemon_serve(argv, defs, defs_count, entry);
+
+    builder_free_arguments(args);
+
+    return code;
+  }
+
+  // A running daemon builds with a warm state, unless this build has to share the jobserver of a parent make
+  const char *makeflags = getenv("MAKEFLAGS");
+  int code;
+
+  if (args && !builder_watch_requested && !builder_jobserver_requested && !(makeflags && strstr(makeflags, "jobserver")) &&
+      builder_daemon_forward(argc, argv, &code)) {
+    builder_free_arguments(args);
+
+    return code;
+  }
+
+  // Share the job budget of a parent make, or hand ours down to the commands we run
+  if (!builder_jobserver_join(getenv("MAKEFLAGS")) && builder_jobserver_requested) {
+    builder_jobserver_serve(builder_get_max_jobs());
+  }
+
+  uint64_t started_ns = builder_watch_now_ns();
 
-    // The value is a pointer to argv, not heap-allocated, so we don't free it.
-    free(current->argument);
-    free(current);
+  builder_progress_begin();
+  entry(args);
+  builder_progress_end();
 
-    current = next;
+  builder_state_save();
+  builder_compdb_save();
+  builder_cache_trim();
+  builder_trace_write();
+
+  // Stay resident and build again on every change. The build state, the dependency database and
+  // the PATH lookups stay in memory, so only the changed files are hashed again
+  while (builder_watch_requested) {
+    watch_set_t set = {0};
+
+    builder_watch_collect(&set, source_file, depfile);
+    info("watching %zu files for changes...", set.files.count);
+
+    // The output of the build may go to a pipe, it shouldn't wait for the next change
+    fflush(NULL);
+
+    bool changed = builder_watch_wait(&set, started_ns);
+
+    watch_set_free(&set);
+
+    if (!changed) {
+      break;
+    }
+
+    // A new version of the script takes over, with the same arguments. If it doesn't compile, the old one keeps
+    // watching
+    if (builder_script_is_stale(argv[0], source_file, depfile) || builder_script_sources_are_stale(argv[0], cflags, cflags_count)) {
+      builder_rebuild_self(argv, source_file, depfile, cflags, cflags_count);
+
+      started_ns = builder_watch_now_ns();
+
+      continue;
+    }
+
+    started_ns = builder_watch_now_ns();
+    builder_stat_invalidate_all();
+
+    builder_progress_begin();
+    entry(args);
+    builder_progress_end();
+
+    builder_state_save();
+    builder_compdb_save();
+    builder_cache_trim();
+    builder_trace_write();
   }
 
-  free(args);
+  builder_free_arguments(args);
+  arena_trim();
+
+  return 0;
 });
 #endif /** __BUILDER_UNIX_H__ */